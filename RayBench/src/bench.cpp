@@ -0,0 +1,419 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include "lib.h"
+#include "sphere_batch.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "camera.h"
+#include "render.h"
+#include "random.h"
+#include "animation.h"
+#include "y4m.h"
+#include "paged_canvas.h"
+#include "benchmark.h"
+
+// Usage: RayBench [--counters]
+//   --counters  collect cycles, instructions, L1D/LLC and branch misses per benchmark (Linux only)
+
+std::vector<Ray> grid_rays(int width, int height, float spacing) {
+	std::vector<Ray> rays;
+	rays.reserve(width * height);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			rays.push_back(Ray{ point((x - width / 2) * spacing, (y - height / 2) * spacing, -5), vector(0, 0, 1) });
+		}
+	}
+	return rays;
+}
+
+int main(int argc, char** argv) {
+	bool collect_counters = false;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--counters") == 0)
+			collect_counters = true;
+	}
+
+	BenchmarkRunner runner(collect_counters);
+
+	Sphere sphere;
+	sphere.set_transform(Transform::scaling(2.f, 2.f, 2.f));
+
+	// Every ray of the 1000x1000 grid lands inside the sphere's silhouette
+	std::vector<Ray> hits = grid_rays(1000, 1000, 0.002f);
+	runner.run("intersect/hit", hits.size(), [&]() {
+		std::size_t count = 0;
+		for (const Ray& r : hits)
+			count += intersect(sphere, r).size();
+		return count;
+	});
+
+	// Same silhouette, but the rotation and non-uniform scale rule out the world-space test
+	Sphere ellipsoid;
+	ellipsoid.set_transform(Transform::identity.scale(2.f, 2.f, 1.5f).rotate_x(0.1f));
+	runner.run("intersect/hit-object-space", hits.size(), [&]() {
+		std::size_t count = 0;
+		for (const Ray& r : hits)
+			count += intersect(ellipsoid, r).size();
+		return count;
+	});
+
+	std::vector<Ray> misses = grid_rays(1000, 1000, 0.002f);
+	for (Ray& r : misses)
+		r.origin.x += 10.f;
+	runner.run("intersect/miss", misses.size(), [&]() {
+		std::size_t count = 0;
+		for (const Ray& r : misses)
+			count += intersect(sphere, r).size();
+		return count;
+	});
+
+	// Building one transform per object for a 1M object scene, three ways
+	const std::size_t objects = 1000000;
+	std::vector<AffineTransform> transforms(objects);
+	runner.run("transforms/product", objects, [&]() {
+		for (std::size_t i = 0; i < objects; ++i) {
+			float f = static_cast<float>(i);
+			transforms[i] = Transform::translation(f, 2 * f, 3 * f) * Transform::scaling(0.5f, 0.5f, 0.5f) * Transform::rotation_y(f * 0.001f);
+		}
+		return static_cast<std::size_t>(transforms[objects - 1][0][3]);
+	});
+
+	runner.run("transforms/fluent", objects, [&]() {
+		for (std::size_t i = 0; i < objects; ++i) {
+			float f = static_cast<float>(i);
+			transforms[i] = Transform::identity.rotate_y(f * 0.001f).scale(0.5f, 0.5f, 0.5f).translate(f, 2 * f, 3 * f);
+		}
+		return static_cast<std::size_t>(transforms[objects - 1][0][3]);
+	});
+
+	runner.run("transforms/builder", objects, [&]() {
+		for (std::size_t i = 0; i < objects; ++i) {
+			float f = static_cast<float>(i);
+			transforms[i] = TransformBuilder().rotate_y(f * 0.001f).scale(0.5f, 0.5f, 0.5f).translate(f, 2 * f, 3 * f);
+		}
+		return static_cast<std::size_t>(transforms[objects - 1][0][3]);
+	});
+
+	// Creating 1M spheres from all hardware threads, each filling its own block of ids
+	std::vector<Sphere> spheres(objects, Sphere(0));
+	const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	runner.run("objects/construct-parallel", objects, [&]() {
+		ObjectRegistry registry;
+		IdRange range = registry.allocate_range(static_cast<int>(objects));
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t) {
+			workers.emplace_back([&, t]() {
+				for (std::size_t i = objects * t / threads; i < objects * (t + 1) / threads; ++i) {
+					Sphere s(range.begin + static_cast<int>(i));
+					s.set_transform(transforms[i]);
+					spheres[i] = s;
+				}
+			});
+		}
+		for (auto& w : workers)
+			w.join();
+		return static_cast<std::size_t>(registry.size());
+	});
+
+	// One ray against a few hundred spheres: intersect() per sphere vs the batched kernel
+	const std::size_t scattered = 256;
+	std::vector<Sphere> field;
+	SphereBatch batch;
+	for (std::size_t i = 0; i < scattered; ++i) {
+		float f = static_cast<float>(i);
+		Sphere s;
+		s.set_transform(TransformBuilder().scale(0.2f, 0.2f, 0.3f).rotate_y(f).translate(std::sin(f) * 4, std::cos(f * 1.7f) * 4, 10 + (i % 13)));
+		field.push_back(s);
+		batch.add(s);
+	}
+	std::vector<Ray> primary;
+	for (int y = 0; y < 300; ++y) {
+		for (int x = 0; x < 300; ++x)
+			primary.push_back(Ray{ point(0, 0, 0), vector((x - 150) / 300.f, (y - 150) / 300.f, 1) });
+	}
+	runner.run("batch/intersect-loop-256", primary.size(), [&]() {
+		std::size_t count = 0;
+		for (const Ray& r : primary) {
+			float nearest = std::numeric_limits<float>::infinity();
+			for (const Sphere& s : field) {
+				for (const Intersection& x : intersect(s, r)) {
+					if (x.t > 0 && x.t < nearest)
+						nearest = x.t;
+				}
+			}
+			count += nearest < std::numeric_limits<float>::infinity();
+		}
+		return count;
+	});
+
+	SphereBatchView view = batch.view();
+	runner.run("batch/intersect-nearest-256", primary.size(), [&]() {
+		std::size_t count = 0;
+		for (const Ray& r : primary)
+			count += intersect_nearest(view, r).hit();
+		return count;
+	});
+
+	// Loading a 1M sphere scene, from memory and from disk
+	std::string source = "canvas 1920 1080\ncamera fov 1.0472 from 0 0 -5 to 0 0 0 up 0 1 0\n";
+	for (std::size_t i = 0; i < objects; ++i) {
+		source += "sphere scale 0.5 0.5 0.5 rotate_y " + std::to_string(i % 628 / 100.f)
+			+ " translate " + std::to_string(i % 1000) + " " + std::to_string(i / 1000 % 1000) + " 10\n";
+	}
+	runner.run("scene/load-1M", objects, [&]() {
+		Scene scene;
+		load_scene(source, scene);
+		return scene.objects.size();
+	});
+
+	const char* scene_path = "bench_1m.scene";
+	std::ofstream(scene_path, std::ios::binary) << source;
+	runner.run("scene/load-file-1M", objects, [&]() {
+		Scene scene;
+		load_scene_file(scene_path, scene);
+		return scene.objects.size();
+	});
+
+	// The same file through its binary cache: hashing the text and mapping the tables.
+	// The first call (the warmup) builds the cache.
+	std::string cache_path = std::string(scene_path) + ".cache";
+	runner.run("scene/load-cached-1M", objects, [&]() {
+		std::unique_ptr<SceneCache> cache = load_scene_cached(scene_path, cache_path);
+		return cache->size();
+	});
+	std::remove(cache_path.c_str());
+	std::remove(scene_path);
+
+	// A sparse frame: 1000 small spheres spread over a 600x600 perspective view,
+	// every pixel against every sphere vs only the spheres binned to its tile
+	SphereBatch sparse;
+	std::vector<Sphere> sparse_spheres;
+	for (std::size_t i = 0; i < 1000; ++i) {
+		float f = static_cast<float>(i);
+		Sphere s;
+		s.set_transform(TransformBuilder().scale(0.05f, 0.05f, 0.05f).translate(std::sin(f * 2.1f) * 4, std::cos(f * 1.7f) * 4, 10 + (i % 17)));
+		sparse.add(s);
+		sparse_spheres.push_back(s);
+	}
+	Camera camera(600, 600, 1.0472f);
+	camera.set_transform(view_transform(point(0, 0, 0), point(0, 0, 1), vector(0, 1, 0)));
+	SphereBatchView sparse_view = sparse.view();
+	runner.run("render/primary-unculled-1k", 600 * 600, [&]() {
+		std::size_t count = 0;
+		for (std::size_t y = 0; y < camera.vsize; ++y) {
+			RayRow row = camera.row(y);
+			for (std::size_t x = 0; x < camera.hsize; ++x)
+				count += intersect_nearest(sparse_view, row.at(x)).hit();
+		}
+		return count;
+	});
+
+	TileGrid grid{ camera.hsize, camera.vsize };
+	runner.run("render/bin-1k", sparse.size(), [&]() {
+		return bin_objects(camera, grid, sparse_view).objects.size();
+	});
+
+	TileBins bins = bin_objects(camera, grid, sparse_view);
+	Canvas frame(camera.hsize, camera.vsize);
+	runner.run("render/primary-culled-1k", 600 * 600, [&]() {
+		std::size_t count = 0;
+		render(camera, bins, frame, [&](const Ray&, const BatchHit& hit) {
+			count += hit.hit();
+			return color(0, 0, 0);
+		});
+		return count;
+	});
+
+	// One sphere of the sparse frame moves: rebinning and re-rendering everything vs
+	// only the tiles it left and entered
+	auto move_sphere = [&](float dx) {
+		Sphere& s = sparse_spheres[500];
+		s.set_transform(TransformBuilder(s.get_transform()).translate(dx, 0, 0));
+		sparse.set(500, s);
+		sparse_view = sparse.view();
+	};
+	float step = 0.3f;
+	runner.run("render/moved-full-1k", 600 * 600, [&]() {
+		move_sphere(step = -step);
+		bins = bin_objects(camera, grid, sparse_view);
+		render(camera, bins, frame, [](const Ray&, const BatchHit&) { return color(0, 0, 0); });
+		return bins.objects.size();
+	});
+
+	std::size_t tiles = 0;
+	runner.run("render/moved-dirty-tiles-1k", 600 * 600, [&]() {
+		move_sphere(step = -step);
+		tiles = rerender_changed(camera, bins, sparse_view, { 500 }, frame, [](const Ray&, const BatchHit&) { return color(0, 0, 0); });
+		return tiles;
+	});
+	std::printf("  (%zu of %zu tiles re-rendered)\n", tiles, grid.count());
+
+	// Random numbers for 1M pixels, one at a time vs 8 pixels per Philox pass
+	const std::size_t pixels = 1 << 20;
+	CounterRng rng(1);
+	std::vector<float> random(4 * pixels);
+	runner.run("random/scalar-1M", pixels, [&]() {
+		for (std::size_t i = 0; i < pixels; ++i) {
+			PhiloxBlock words = rng.block(i, 0, 0);
+			for (std::size_t w = 0; w < 4; ++w)
+				random[w * pixels + i] = uniform_float(words[w]);
+		}
+		return static_cast<std::size_t>(random[pixels - 1] * 1000);
+	});
+	float* const random_blocks[4] = { &random[0], &random[pixels], &random[2 * pixels], &random[3 * pixels] };
+	runner.run("random/bulk-1M", pixels, [&]() {
+		rng.uniform_blocks(0, pixels, 0, 0, random_blocks);
+		return static_cast<std::size_t>(random[pixels - 1] * 1000);
+	});
+
+	// The sparse frame with 4 jittered samples per pixel, on one thread and on all of them
+	RenderSettings sampled;
+	sampled.samples = 4;
+	runner.run("render/4spp-1-thread", 600 * 600, [&]() {
+		render(camera, bins, frame, [](const Ray&, const BatchHit& hit) { return color(hit.hit(), 0, 0); }, sampled);
+		return frame.width;
+	});
+	sampled.threads = threads;
+	runner.run("render/4spp-all-threads", 600 * 600, [&]() {
+		render(camera, bins, frame, [](const Ray&, const BatchHit& hit) { return color(hit.hit(), 0, 0); }, sampled);
+		return frame.width;
+	});
+
+	// 8 frames of the sparse scene with one sphere moving per frame and a checksum
+	// standing in for the encode: a fresh rebin, render and thread start every frame
+	// followed by the encode, vs render_sequence
+	const std::size_t frames = 8;
+	Scene animated;
+	for (const Sphere& s : sparse_spheres)
+		animated.add(s.get_transform());
+	auto wiggle = [&](std::size_t frame, Scene& scene, Camera&, FrameChanges& changes) {
+		std::size_t i = 500 + frame % 2;
+		scene.set_transform(i, TransformBuilder(scene.objects[i].get_transform()).translate(frame % 4 < 2 ? 0.3f : -0.3f, 0, 0));
+		changes.moved.push_back(i);
+	};
+	auto flat = [](const Ray&, const BatchHit& hit) { return color(hit.hit(), 0, 0); };
+	auto checksum = [](const Canvas& c) {
+		float sum = 0;
+		for (std::size_t i = 0; i < c.width * c.height; ++i)
+			sum += c.canvas[i].x;
+		return static_cast<std::size_t>(sum);
+	};
+	RenderSettings threaded;
+	threaded.threads = threads;
+	runner.run("sequence/per-frame-8", frames * 600 * 600, [&]() {
+		std::size_t total = 0;
+		for (std::size_t f = 0; f < frames; ++f) {
+			FrameChanges ignored;
+			wiggle(f, animated, camera, ignored);
+			Canvas c(camera.hsize, camera.vsize);
+			render(camera, bin_objects(camera, grid, animated.batch.view()), c, flat, threaded);
+			total += checksum(c);
+		}
+		return total;
+	});
+	SequenceSettings sequence;
+	sequence.render = threaded;
+	runner.run("sequence/persistent-8", frames * 600 * 600, [&]() {
+		std::size_t total = 0;
+		render_sequence(animated, camera, frames, wiggle, flat, [&](std::size_t, const Canvas& c) { total += checksum(c); }, sequence);
+		return total;
+	});
+
+	// Filling a 2048x2048 canvas (64 MB, past the last level cache) pixel by pixel:
+	// down the columns of a row-major canvas, as main.cpp once did, then tile by tile
+	// along the Hilbert curve into a row-major and a TILED canvas. --counters shows
+	// the cache misses each costs.
+	const std::size_t big_size = 2048;
+	TileGrid big_grid{ big_size, big_size };
+	std::vector<std::size_t> curve = hilbert_tiles(big_grid);
+	auto fill_tiles = [&](Canvas& c) {
+		for (std::size_t t : curve) {
+			PixelRect r = big_grid.tile(t);
+			for (std::size_t y = r.y0; y < r.y1; ++y) {
+				for (std::size_t x = r.x0; x < r.x1; ++x)
+					c.write_pixel(x, y, color(x, y, 0));
+			}
+		}
+		return c.width;
+	};
+	{
+		Canvas rows(big_size, big_size);
+		runner.run("canvas/columns-row-major-2k", big_size * big_size, [&]() {
+			for (std::size_t x = 0; x < big_size; ++x) {
+				for (std::size_t y = 0; y < big_size; ++y)
+					rows.write_pixel(x, y, color(x, y, 0));
+			}
+			return rows.width;
+		});
+		runner.run("canvas/hilbert-tiles-row-major-2k", big_size * big_size, [&]() { return fill_tiles(rows); });
+	}
+	{
+		Canvas tiled(big_size, big_size, CanvasLayout::TILED);
+		runner.run("canvas/hilbert-tiles-tiled-2k", big_size * big_size, [&]() { return fill_tiles(tiled); });
+	}
+
+	// The sparse frame's tiles in index order into a row-major canvas vs render():
+	// Hilbert order into a TILED canvas
+	runner.run("render/index-order-row-major-1k", 600 * 600, [&]() {
+		for (std::size_t t : all_tiles(bins.grid))
+			render_tile(camera, bins, t, frame, flat, RenderSettings{});
+		return frame.width;
+	});
+	Canvas tiled_frame(camera.hsize, camera.vsize, CanvasLayout::TILED);
+	runner.run("render/hilbert-tiled-1k", 600 * 600, [&]() {
+		render(camera, bins, tiled_frame, flat);
+		return tiled_frame.width;
+	});
+
+	// The same render paging each finished tile out to a sparse file, holding one
+	// tile in memory instead of the frame
+	{
+		PagedCanvas paged("bench_paged.tmp", camera.hsize, camera.vsize);
+		runner.run("render/paged-1k", 600 * 600, [&]() {
+			render_paged(camera, bins, paged, flat);
+			return paged.tiles_written();
+		});
+	}
+
+	// Encoding the sparse frame: plain PPM text vs a YUV4MPEG2 frame, both to a file
+	std::string encoded_path = "bench_encode.tmp";
+	runner.run("encode/ppm-600", 600 * 600, [&]() {
+		CanvasToPPM ppm(frame, 255);
+		std::string text = ppm.toPlainPPM();
+		std::ofstream(encoded_path, std::ios::binary) << text;
+		return text.size();
+	});
+	{
+		Y4MWriter video(encoded_path, frame.width, frame.height);
+		runner.run("encode/y4m-600", 600 * 600, [&]() {
+			video.write_frame(frame);
+			return video.frames_written();
+		});
+	}
+	std::remove(encoded_path.c_str());
+
+	// The scene rendered by RayTracer's main.cpp, without the PPM encode
+	const int size = 600;
+	Sphere big;
+	big.set_transform(Transform::scaling(size / 2.f, size / 2.f, size / 2.f));
+	runner.run("render/chapter5", size * size, [&]() {
+		Canvas c(size, size);
+		std::size_t count = 0;
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				Ray ray{ point(x - size / 2, y - size / 2, -5), vector(0, 0, 1) };
+				std::vector<Intersection> inters = intersections(intersect(big, ray));
+				Intersection* h = nullptr;
+				hit(inters, &h);
+				if (h != nullptr) {
+					c.write_pixel(x, y, color(1, 0, 0));
+					++count;
+				}
+			}
+		}
+		return count;
+	});
+}
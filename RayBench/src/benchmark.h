@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include "perf_counters.h"
+
+// Keeps the optimizer from discarding a benchmark body's result
+static volatile std::size_t benchmark_sink;
+
+class BenchmarkRunner {
+public:
+	explicit BenchmarkRunner(bool collect_counters);
+
+	// body() runs once to warm up, then once timed; `rays` is how many rays (or
+	// other units of work) one call of body() processes.
+	template<class F>
+	void run(const std::string& name, std::size_t rays, F body);
+
+	bool counters_enabled() const;
+private:
+	PerfCounters counters;
+	bool collect_counters;
+	void report(const std::string& name, std::size_t rays, double seconds, const CounterValues& values) const;
+};
+
+BenchmarkRunner::BenchmarkRunner(bool collect_counters) : collect_counters{ collect_counters } {
+	if (collect_counters && !counters.available()) {
+		std::printf("# hardware counters unavailable (check perf_event_paranoid), reporting time only\n");
+		this->collect_counters = false;
+	}
+	std::printf("%-32s %12s %10s", "benchmark", "rays", "ns/ray");
+	if (this->collect_counters) {
+		std::printf(" %10s %6s %10s %10s %10s", "cyc/ray", "IPC", "L1D/ray", "LLC/ray", "br/ray");
+	}
+	std::printf("\n");
+}
+
+bool BenchmarkRunner::counters_enabled() const {
+	return collect_counters;
+}
+
+template<class F>
+void BenchmarkRunner::run(const std::string& name, std::size_t rays, F body) {
+	benchmark_sink = body();
+
+	CounterValues values;
+	auto begin = std::chrono::steady_clock::now();
+	if (collect_counters)
+		counters.start();
+	benchmark_sink = body();
+	if (collect_counters)
+		values = counters.stop();
+	auto end = std::chrono::steady_clock::now();
+
+	report(name, rays, std::chrono::duration<double>(end - begin).count(), values);
+}
+
+static void print_per_ray(const CounterValues& values, Counter c, std::size_t rays) {
+	if (values.has(c))
+		std::printf(" %10.3f", values[c] / rays);
+	else
+		std::printf(" %10s", "n/a");
+}
+
+void BenchmarkRunner::report(const std::string& name, std::size_t rays, double seconds, const CounterValues& values) const {
+	std::printf("%-32s %12zu %10.2f", name.c_str(), rays, seconds * 1e9 / rays);
+	if (collect_counters) {
+		print_per_ray(values, CYCLES, rays);
+		if (values.has(CYCLES) && values.has(INSTRUCTIONS) && values[CYCLES] > 0)
+			std::printf(" %6.2f", values[INSTRUCTIONS] / values[CYCLES]);
+		else
+			std::printf(" %6s", "n/a");
+		print_per_ray(values, L1D_MISSES, rays);
+		print_per_ray(values, LLC_MISSES, rays);
+		print_per_ray(values, BRANCH_MISSES, rays);
+	}
+	std::printf("\n");
+	std::fflush(stdout);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters collected around a benchmark. Each counter is opened on its own
+// so that a PMU missing one event (common in VMs) still reports the others.
+enum Counter : std::size_t {
+	CYCLES,
+	INSTRUCTIONS,
+	L1D_MISSES,
+	LLC_MISSES,
+	BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+struct CounterValues {
+	double values[COUNTER_COUNT] = {};
+	bool valid[COUNTER_COUNT] = {};
+
+	bool has(Counter c) const {
+		return valid[c];
+	}
+
+	double operator[](Counter c) const {
+		return values[c];
+	}
+};
+
+class PerfCounters {
+public:
+	PerfCounters();
+	~PerfCounters();
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	// False when no counter could be opened (non-Linux, perf_event_paranoid, no PMU)
+	bool available() const;
+	void start();
+	CounterValues stop();
+private:
+	int fds[COUNTER_COUNT];
+};
+
+#ifdef __linux__
+
+static int open_counter(std::uint32_t type, std::uint64_t config) {
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static std::uint64_t cache_config(std::uint64_t cache, std::uint64_t op, std::uint64_t result) {
+	return cache | (op << 8) | (result << 16);
+}
+
+PerfCounters::PerfCounters() {
+	fds[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+		cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+	fds[LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fds[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+PerfCounters::~PerfCounters() {
+	for (int fd : fds) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+bool PerfCounters::available() const {
+	for (int fd : fds) {
+		if (fd >= 0)
+			return true;
+	}
+	return false;
+}
+
+void PerfCounters::start() {
+	for (int fd : fds) {
+		if (fd < 0) continue;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+// Values are scaled by enabled/running time, since the kernel multiplexes
+// counters when more are requested than the PMU has slots for.
+CounterValues PerfCounters::stop() {
+	CounterValues result;
+	for (std::size_t i = 0; i < COUNTER_COUNT; ++i) {
+		if (fds[i] >= 0)
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	for (std::size_t i = 0; i < COUNTER_COUNT; ++i) {
+		if (fds[i] < 0) continue;
+		std::uint64_t data[3];
+		if (read(fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+			continue;
+		result.values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+		result.valid[i] = true;
+	}
+	return result;
+}
+
+#else
+
+PerfCounters::PerfCounters() {
+	for (int& fd : fds)
+		fd = -1;
+}
+
+PerfCounters::~PerfCounters() {}
+
+bool PerfCounters::available() const {
+	return false;
+}
+
+void PerfCounters::start() {}
+
+CounterValues PerfCounters::stop() {
+	return CounterValues{};
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "raw_canvas.h"
+
+// Usage: RayMerge [--average] [--ppm file] output input...
+// Merges raw canvases of one frame, as written by RayTracer --raw, into a whole-frame
+// raw canvas. By default the inputs' rectangles are pasted together (crop regions or
+// shards); with --average, inputs rendered with different seeds are averaged by
+// their sample counts. --ppm also saves the merged frame as a viewable PPM.
+
+int main(int argc, char** argv) {
+	MergeMode mode = MergeMode::COMPOSE;
+	std::string ppm;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--average") == 0)
+			mode = MergeMode::AVERAGE;
+		else if (std::strcmp(argv[i], "--ppm") == 0 && i + 1 < argc)
+			ppm = argv[++i];
+		else
+			paths.push_back(argv[i]);
+	}
+	if (paths.size() < 2) {
+		std::cerr << "usage: RayMerge [--average] [--ppm file] output input...\n";
+		return 1;
+	}
+
+	try {
+		std::vector<std::string> inputs(paths.begin() + 1, paths.end());
+		RawCanvasHeader merged = merge_raw_canvases(inputs, paths[0], mode);
+		std::cout << paths[0] << ": " << merged.frame_width << "x" << merged.frame_height
+			<< ", " << merged.weight << " samples per pixel\n";
+		if (!ppm.empty())
+			raw_canvas_to_ppm(paths[0], ppm);
+	}
+	catch (const RawCanvasError& e) {
+		std::cerr << e.message << "\n";
+		return 1;
+	}
+}
@@ -1,5 +1,26 @@
 #include <gtest/gtest.h>
+#include <thread>
 #include "lib.h" // includes cmath
+#include "sphere_batch.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "camera.h"
+#include "render.h"
+#include "random.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "raw_canvas.h"
+#include "thread_pool.h"
+#include "animation.h"
+#include "y4m.h"
+#include "frame_pipeline.h"
+#include "budget.h"
+#include "render_job.h"
+#include "paged_canvas.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 TEST(Clamp, clamping) {
 	ASSERT_EQ(25, clamp(25, 0, 30));
@@ -182,6 +203,32 @@ TEST(Canvas, writePixel) {
 	ASSERT_TRUE(c.read_pixel(2, 3) == color(1.f, 0.f, 0.f));
 }
 
+TEST(Canvas, tiledLayoutMapsEachPixelOnce) {
+	Canvas c(13, 10, CanvasLayout::TILED);
+	ASSERT_EQ(c.size(), 2u * 2u * 64u);
+	std::vector<int> seen(c.size(), 0);
+	for (std::size_t y = 0; y < c.height; ++y) {
+		for (std::size_t x = 0; x < c.width; ++x) {
+			ASSERT_LT(c.index(x, y), c.size());
+			++seen[c.index(x, y)];
+			c.write_pixel(x, y, color(x, y, 0));
+		}
+	}
+	ASSERT_EQ(std::count(seen.begin(), seen.end(), 1), 13 * 10);
+	// A 2x2 quad is four neighbouring pixels; a block is 64
+	ASSERT_EQ(c.index(4, 2), 24u);
+	ASSERT_EQ(c.index(5, 3), 27u);
+	ASSERT_EQ(c.index(8, 0), 64u);
+	ASSERT_EQ(c.index(0, 8), 128u);
+
+	std::vector<Tuple> scratch(c.width);
+	const Tuple* row = c.row(9, scratch.data());
+	for (std::size_t x = 0; x < c.width; ++x)
+		ASSERT_TRUE(row[x] == color(x, 9, 0));
+	Canvas copy(c);
+	ASSERT_TRUE(copy.read_pixel(12, 9) == color(12, 9, 0));
+}
+
 std::string head(std::string str, int lines) {
 	std::size_t last = 0;
 	while (lines-- > 0) {
@@ -230,6 +277,30 @@ TEST(PlainPPM, ppmPixelData) {
 	ASSERT_STREQ(expected.c_str(), ppmStr.c_str());
 }
 
+TEST(PlainPPM, tiledCanvasWritesRows) {
+	Canvas rows(11, 9);
+	Canvas tiled(11, 9, CanvasLayout::TILED);
+	for (std::size_t y = 0; y < rows.height; ++y) {
+		for (std::size_t x = 0; x < rows.width; ++x) {
+			rows.write_pixel(x, y, color(x / 10.f, y / 8.f, 0.5f));
+			tiled.write_pixel(x, y, color(x / 10.f, y / 8.f, 0.5f));
+		}
+	}
+	ASSERT_EQ(CanvasToPPM(rows, 255).toPlainPPM(), CanvasToPPM(tiled, 255).toPlainPPM());
+}
+
+TEST(PlainPPM, pixelsInStrips) {
+	Canvas c(30, 7);
+	for (std::size_t y = 0; y < c.height; ++y) {
+		for (std::size_t x = 0; x < c.width; ++x)
+			c.write_pixel(x, y, color(x * 0.03f, y * 0.1f, 0.4f));
+	}
+	std::string strips = plainPPMHeader(30, 7, 255);
+	for (std::size_t y = 0; y < 7; y += 3)
+		strips += CanvasToPPM(copy_region(c, PixelRect{ 0, y, 30, std::min<std::size_t>(y + 3, 7) }), 255).toPlainPixels();
+	ASSERT_EQ(strips, CanvasToPPM(c, 255).toPlainPPM());
+}
+
 TEST(PlainPPM, splittingLongLines) {
 	Canvas c(10, 2);
 	Color c1 = color(1.f, 0.8f, 0.6f);
@@ -761,6 +832,258 @@ TEST(MatrixTransformation, fluentTransform) {
 }
 
 
+// The constexpr transforms fold at compile time; these mirror the tests above
+TEST(ConstexprTransformations, identity) {
+	static_assert(Transform::identity * point(1, 2, 3) == point(1, 2, 3));
+	static_assert(Transform::identity.inverse() == Transform::identity);
+}
+
+TEST(ConstexprTransformations, translation) {
+	constexpr Transform transform = Transform::translation(5.f, -3.f, 2.f);
+	static_assert(transform * point(-3, 4, 5) == point(2, 1, 7));
+	static_assert(transform * vector(-3, 4, 5) == vector(-3, 4, 5));
+}
+
+TEST(ConstexprTransformations, translationInverse) {
+	constexpr Transform transform = Transform::translation(5, -3, 2).inverse();
+	static_assert(transform * point(-3, 4, 5) == point(-8, 7, 3));
+}
+
+TEST(ConstexprTransformations, scaling) {
+	constexpr Transform transform = Transform::scaling(2, 3, 4);
+	static_assert(transform * point(-4, 6, 8) == point(-8, 18, 32));
+	static_assert(transform * vector(-4, 6, 8) == vector(-8, 18, 32));
+	static_assert(Transform::scaling(-1, 1, 1) * point(2, 3, 4) == point(-2, 3, 4));
+}
+
+TEST(ConstexprTransformations, scalingInverse) {
+	constexpr Transform transform = Transform::scaling(2, 3, 4).inverse();
+	static_assert(transform * vector(-4, 6, 8) == vector(-2, 2, 2));
+}
+
+TEST(ConstexprTransformations, shearing) {
+	static_assert(Transform::shearing(1, 0, 0, 0, 0, 0) * point(2, 3, 4) == point(5, 3, 4));
+	static_assert(Transform::shearing(0, 1, 0, 0, 0, 0) * point(2, 3, 4) == point(6, 3, 4));
+	static_assert(Transform::shearing(0, 0, 1, 0, 0, 0) * point(2, 3, 4) == point(2, 5, 4));
+	static_assert(Transform::shearing(0, 0, 0, 1, 0, 0) * point(2, 3, 4) == point(2, 7, 4));
+	static_assert(Transform::shearing(0, 0, 0, 0, 1, 0) * point(2, 3, 4) == point(2, 3, 6));
+	static_assert(Transform::shearing(0, 0, 0, 0, 0, 1) * point(2, 3, 4) == point(2, 3, 7));
+}
+
+TEST(ConstexprTransformations, chainTransforms) {
+	constexpr Transform T = Transform::translation(10, 5, 7) * Transform::scaling(5, 5, 5);
+	static_assert(T * point(1, -1, 0) == point(15, 0, 7));
+	static_assert(Transform::identity.scale(5, 5, 5).translate(10, 5, 7) == T);
+	static_assert(T.inverse() * point(15, 0, 7) == point(1, -1, 0));
+}
+
+TEST(ConstexprTransformations, tupleArithmetic) {
+	static_assert(point(3, 2, 1) - point(5, 6, 7) == vector(-2, -4, -6));
+	static_assert(vector(1, 2, 3).cross(vector(2, 3, 4)) == vector(-1, 2, -1));
+	static_assert(vector(1, 2, 3).dot(vector(2, 3, 4)) == 20.f);
+	static_assert(3.5f * Tuple{ 1, -2, 3, -4 } == Tuple{ 3.5f, -7.f, 10.5f, -14.f });
+}
+
+TEST(AffineTransform, roundTrip) {
+	Transform m = Transform::identity.rotate_x(0.5f).scale(1, 2, 3).shear(1, 0, 0, 2, 0, 0).translate(4, 5, 6);
+	AffineTransform a = m;
+	ASSERT_EQ(a.to_matrix(), m);
+	ASSERT_EQ(a, m);
+}
+
+TEST(AffineTransform, multiplication) {
+	Transform A = Transform::rotation_y(0.3f).translate(1, -2, 3);
+	Transform B = Transform::shearing(1, 0, 2, 0, 0, 1).scale(2, 3, 4);
+	ASSERT_EQ(AffineTransform(A) * AffineTransform(B), A * B);
+}
+
+TEST(AffineTransform, tupleMultiplication) {
+	AffineTransform t = Transform::scaling(2, 3, 4).translate(5, -3, 2);
+	ASSERT_EQ(t * point(-4, 6, 8), point(-3, 15, 34));
+	ASSERT_EQ(t * vector(-4, 6, 8), vector(-8, 18, 32));
+}
+
+TEST(AffineTransform, inverse) {
+	Transform m = Transform::identity.rotate_z(1.2f).scale(2, 0.5f, 3).shear(0, 1, 0, 0, 2, 0).translate(-1, 7, 2);
+	AffineTransform a = m;
+	ASSERT_FLOAT_EQ(a.determinant(), m.determinant());
+	ASSERT_EQ(a.inverse(), m.inverse());
+	ASSERT_EQ(a * a.inverse(), Transform::identity);
+	static_assert(AffineTransform(Transform::translation(5, -3, 2)).inverse() * point(-3, 4, 5) == point(-8, 7, 3));
+}
+
+TEST(TransformBuilder, identity) {
+	ASSERT_EQ(TransformBuilder().build(), Transform::identity);
+	static_assert(TransformBuilder().build() == Transform::identity);
+}
+
+TEST(TransformBuilder, singleSteps) {
+	ASSERT_EQ(TransformBuilder().translate(5, -3, 2).build(), Transform::translation(5, -3, 2));
+	ASSERT_EQ(TransformBuilder().scale(2, 3, 4).build(), Transform::scaling(2, 3, 4));
+	ASSERT_EQ(TransformBuilder().rotate_x(0.7f).build(), Transform::rotation_x(0.7f));
+	ASSERT_EQ(TransformBuilder().rotate_y(0.7f).build(), Transform::rotation_y(0.7f));
+	ASSERT_EQ(TransformBuilder().rotate_z(0.7f).build(), Transform::rotation_z(0.7f));
+	ASSERT_EQ(TransformBuilder().shear(1, 2, 3, 4, 5, 6).build(), Transform::shearing(1, 2, 3, 4, 5, 6));
+}
+
+TEST(TransformBuilder, chainMatchesProduct) {
+	Transform expected = Transform::translation(10, 5, 7) * Transform::shearing(0, 1, 0, 0, 2, 0)
+		* Transform::rotation_y(0.3f) * Transform::scaling(5, 5, 5) * Transform::rotation_x(M_PI / 2);
+	AffineTransform t = TransformBuilder()
+		.rotate_x(M_PI / 2)
+		.scale(5, 5, 5)
+		.rotate_y(0.3f)
+		.shear(0, 1, 0, 0, 2, 0)
+		.translate(10, 5, 7);
+	ASSERT_EQ(t, expected);
+	ASSERT_EQ(TransformBuilder().rotate_x(M_PI / 2).scale(5, 5, 5).translate(10, 5, 7).build() * point(1, 0, 1), point(15, 0, 7));
+}
+
+TEST(TransformBuilder, fluentMatchesProduct) {
+	Transform expected = Transform::translation(10, 5, 7) * Transform::shearing(0, 1, 0, 0, 2, 0)
+		* Transform::rotation_z(0.3f) * Transform::scaling(5, 5, 5) * Transform::rotation_x(M_PI / 2);
+	Transform t = Transform::identity
+		.rotate_x(M_PI / 2)
+		.scale(5, 5, 5)
+		.rotate_z(0.3f)
+		.shear(0, 1, 0, 0, 2, 0)
+		.translate(10, 5, 7);
+	ASSERT_EQ(t, expected);
+}
+
+TEST(TransformBuilder, fluentOnGeneralMatrix) {
+	Matrix<4> a{ {
+		{1.f, 2.f, 3.f, 4.f},
+		{5.f, 6.f, 7.f, 8.f},
+		{9.f, 8.f, 7.f, 6.f},
+		{5.f, 4.f, 3.f, 2.f},
+	} };
+	ASSERT_EQ(a.translate(1, 2, 3), Transform::translation(1, 2, 3) * a);
+	ASSERT_EQ(a.shear(1, 0, 0, 1, 0, 1), Transform::shearing(1, 0, 0, 1, 0, 1) * a);
+}
+
+// Drops the kind tag so inverse() and Ray::transform() take the generic path
+Transform untagged(Transform m) {
+	m.kind = TransformKind::GENERAL;
+	return m;
+}
+
+AffineTransform untagged(AffineTransform m) {
+	m.kind = TransformKind::AFFINE;
+	return m;
+}
+
+// Checks the elements against what m.kind promises about them
+bool kindHolds(const AffineTransform& m) {
+	bool zero_translation = m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0;
+	bool diagonal = true, unit_diagonal = true, orthonormal = true;
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 3; ++y) {
+			if (x != y && m[x][y] != 0)
+				diagonal = false;
+			float dot = m[0][x] * m[0][y] + m[1][x] * m[1][y] + m[2][x] * m[2][y];
+			if (std::abs(dot - (x == y ? 1.f : 0.f)) > EPSILON)
+				orthonormal = false;
+		}
+		if (m[x][x] != 1)
+			unit_diagonal = false;
+	}
+	switch (m.kind) {
+	case TransformKind::IDENTITY: return diagonal && unit_diagonal && zero_translation;
+	case TransformKind::TRANSLATION: return diagonal && unit_diagonal;
+	case TransformKind::SCALING: return diagonal && zero_translation;
+	case TransformKind::TRANSLATION_SCALING: return diagonal;
+	case TransformKind::RIGID: return orthonormal;
+	default: return true;
+	}
+}
+
+std::vector<Transform> taggedTransforms() {
+	return {
+		Transform::identity,
+		Transform::translation(5, -3, 2),
+		Transform::scaling(2, 3, 4),
+		Transform::scaling(2, 3, 4).translate(5, -3, 2),
+		Transform::translation(5, -3, 2).scale(2, 2, 2),
+		Transform::rotation_x(0.5f),
+		Transform::identity.rotate_y(0.5f).translate(1, 2, 3).rotate_z(1.f),
+		Transform::identity.rotate_x(M_PI / 2).scale(5, 5, 5).translate(10, 5, 7),
+		Transform::shearing(1, 0, 0, 1, 0, 0).translate(1, 2, 3),
+	};
+}
+
+TEST(TransformKind, builders) {
+	ASSERT_EQ(Transform::identity.kind, TransformKind::IDENTITY);
+	ASSERT_EQ(Transform::translation(1, 2, 3).kind, TransformKind::TRANSLATION);
+	ASSERT_EQ(Transform::scaling(1, 2, 3).kind, TransformKind::SCALING);
+	ASSERT_EQ(Transform::rotation_x(1).kind, TransformKind::RIGID);
+	ASSERT_EQ(Transform::rotation_y(1).kind, TransformKind::RIGID);
+	ASSERT_EQ(Transform::rotation_z(1).kind, TransformKind::RIGID);
+	ASSERT_EQ(Transform::shearing(1, 0, 0, 0, 0, 0).kind, TransformKind::AFFINE);
+	ASSERT_EQ(Matrix<4>({ { 1.f } }).kind, TransformKind::GENERAL);
+	ASSERT_EQ(TransformBuilder().build().kind, TransformKind::IDENTITY);
+}
+
+TEST(TransformKind, composition) {
+	ASSERT_EQ((Transform::translation(1, 2, 3) * Transform::translation(1, 2, 3)).kind, TransformKind::TRANSLATION);
+	ASSERT_EQ((Transform::translation(1, 2, 3) * Transform::scaling(1, 2, 3)).kind, TransformKind::TRANSLATION_SCALING);
+	ASSERT_EQ((Transform::scaling(1, 2, 3) * Transform::translation(1, 2, 3)).kind, TransformKind::TRANSLATION_SCALING);
+	ASSERT_EQ((Transform::translation(1, 2, 3) * Transform::rotation_x(1)).kind, TransformKind::RIGID);
+	ASSERT_EQ((Transform::scaling(1, 2, 3) * Transform::rotation_x(1)).kind, TransformKind::AFFINE);
+	ASSERT_EQ((Transform::identity * untagged(Transform::identity)).kind, TransformKind::GENERAL);
+	ASSERT_EQ(TransformBuilder().rotate_z(1).translate(1, 2, 3).build().kind, TransformKind::RIGID);
+	ASSERT_EQ(TransformBuilder().scale(2, 2, 2).translate(1, 2, 3).build().kind, TransformKind::TRANSLATION_SCALING);
+	ASSERT_EQ(TransformBuilder().scale(2, 2, 2).shear(1, 0, 0, 0, 0, 0).build().kind, TransformKind::AFFINE);
+}
+
+TEST(TransformKind, tagMatchesElements) {
+	for (const Transform& m : taggedTransforms()) {
+		ASSERT_TRUE(kindHolds(m)) << m;
+		ASSERT_TRUE(kindHolds(m.inverse())) << m;
+	}
+}
+
+TEST(TransformKind, inverseMatchesGeneric) {
+	for (const Transform& m : taggedTransforms()) {
+		ASSERT_EQ(m.inverse(), untagged(m).inverse());
+		ASSERT_EQ(AffineTransform(m).inverse(), untagged(AffineTransform(m)).inverse());
+		ASSERT_EQ(m.inverse().kind, m.kind);
+	}
+}
+
+TEST(TransformKind, rayTransformMatchesGeneric) {
+	Ray r{ point(1, 2, 3), vector(0.5f, -1, 2) };
+	for (const Transform& m : taggedTransforms()) {
+		Ray fast = r.transform(AffineTransform(m));
+		Ray generic = r.transform(untagged(m));
+		ASSERT_EQ(fast.origin, generic.origin);
+		ASSERT_EQ(fast.direction, generic.direction);
+		ASSERT_EQ(r.transform(m).origin, generic.origin);
+	}
+}
+
+TEST(TransformKind, elementWritesForgetTheKind) {
+	Transform translation = Transform::translation(1, 2, 3);
+	ASSERT_EQ(translation[0][3], 1.f);
+	ASSERT_EQ(translation.kind, TransformKind::TRANSLATION);
+
+	Transform t = Transform::identity;
+	t.set(0, 1, 2);
+	ASSERT_EQ(t.kind, TransformKind::GENERAL);
+	ASSERT_EQ(t * t.inverse(), Transform::identity);
+
+	Transform moved = Transform::translation(1, 2, 3);
+	moved.set(0, 0, 4);
+	ASSERT_EQ(moved * moved.inverse(), Transform::identity);
+
+	AffineTransform scaled = AffineTransform(Transform::scaling(2, 3, 4));
+	scaled.set(1, 2, 5);
+	ASSERT_EQ(scaled.kind, TransformKind::AFFINE);
+	ASSERT_EQ(scaled * scaled.inverse(), AffineTransform(Transform::identity));
+	Ray r{ point(1, 2, 3), vector(0.5f, -1, 2) };
+	ASSERT_EQ(r.transform(scaled).direction, scaled * r.direction);
+}
+
 TEST(RayCasting, creatingRay) {
 	Point origin = point(1, 2, 3);
 	Vector direction = vector(4, 5, 6);
@@ -904,19 +1227,19 @@ TEST(RayTransformation, scalingRay) {
 
 TEST(sphereTransform, defaultTrans) {
 	Sphere s;
-	ASSERT_EQ(s.transform, Transform::identity);
+	ASSERT_EQ(s.get_transform(), Transform::identity);
 }
 
 TEST(sphereTransformation, changingTrans) {
 	Sphere s;
-	s.transform = Transform::translation(2, 3, 4);
-	ASSERT_EQ(s.transform, Transform::translation(2, 3, 4));
+	s.set_transform(Transform::translation(2, 3, 4));
+	ASSERT_EQ(s.get_transform(), Transform::translation(2, 3, 4));
 }
 
 TEST(sphereTransform, scaleSphereIntersection) {
 	Ray ray{ point(0, 0, -5), vector(0, 0, 1) };
 	Sphere s;
-	s.transform = Transform::scaling(2, 2, 2);
+	s.set_transform(Transform::scaling(2, 2, 2));
 	std::vector<Intersection> xs = intersect(s, ray);
 	ASSERT_EQ(xs.size(), 2);
 	ASSERT_FLOAT_EQ(xs[0].t, 3.f);
@@ -926,7 +1249,1515 @@ TEST(sphereTransform, scaleSphereIntersection) {
 TEST(sphereTransform, intersectingWithTransformedSphere) {
 	Ray ray{point(0, 0, -5), vector(0, 0, 1)};
 	Sphere s;
-	s.transform = Transform::translation(5, 0, 0);
+	s.set_transform(Transform::translation(5, 0, 0));
 	std::vector<Intersection> xs = intersect(s, ray);
 	ASSERT_EQ(xs.size(), 0);
 }
+
+TEST(sphereTransform, analyticDetection) {
+	Sphere s;
+	ASSERT_TRUE(s.analytic);
+	s.set_transform(Transform::identity.scale(2, 2, 2).translate(1, 2, 3));
+	ASSERT_TRUE(s.analytic);
+	ASSERT_EQ(s.center, point(1, 2, 3));
+	ASSERT_FLOAT_EQ(s.radius, 2.f);
+	s.set_transform(Transform::identity.rotate_y(0.3f).translate(1, 2, 3));
+	ASSERT_TRUE(s.analytic);
+	ASSERT_FLOAT_EQ(s.radius, 1.f);
+	s.set_transform(Transform::scaling(2, 2, 3));
+	ASSERT_FALSE(s.analytic);
+	s.set_transform(Transform::identity.scale(2, 2, 2).rotate_x(0.3f));
+	ASSERT_FALSE(s.analytic);
+}
+
+TEST(sphereTransform, analyticMatchesObjectSpace) {
+	std::vector<Transform> transforms{
+		Transform::identity,
+		Transform::translation(1, -2, 0.5f),
+		Transform::scaling(3, 3, 3),
+		Transform::scaling(-0.5f, 0.5f, 0.5f).translate(0.2f, 0.1f, 0),
+		Transform::identity.rotate_z(1.f).translate(0.5f, 0, 1),
+	};
+	std::vector<Ray> rays{
+		Ray{ point(0, 0, -5), vector(0, 0, 1) },
+		Ray{ point(0.3f, -0.2f, -5), vector(0.05f, 0.1f, 2) },
+		Ray{ point(1, 1, 1), vector(-1, -1, -1) },
+		Ray{ point(0, 5, 0), vector(0, -1, 0) },
+	};
+	for (const Transform& t : transforms) {
+		Sphere analytic;
+		analytic.set_transform(t);
+		ASSERT_TRUE(analytic.analytic);
+		Sphere generic = analytic;
+		generic.analytic = false;
+		for (const Ray& r : rays) {
+			std::vector<Intersection> expected = intersect(generic, r);
+			std::vector<Intersection> result = intersect(analytic, r);
+			ASSERT_EQ(result.size(), expected.size());
+			for (std::size_t i = 0; i < result.size(); ++i) {
+				ASSERT_NEAR(result[i].t, expected[i].t, 1e-4f);
+			}
+		}
+	}
+}
+
+TEST(sphereTransform, distantSmallSphere) {
+	Ray ray{ point(0, 0, 0), vector(0, 0, 1) };
+	Sphere s;
+	s.set_transform(Transform::identity.scale(0.5f, 0.5f, 0.5f).translate(0, 0, 1000));
+	std::vector<Intersection> xs = intersect(s, ray);
+	ASSERT_EQ(xs.size(), 2);
+	ASSERT_FLOAT_EQ(xs[0].t, 999.5f);
+	ASSERT_FLOAT_EQ(xs[1].t, 1000.5f);
+}
+
+TEST(ObjectRegistry, sequentialIds) {
+	ObjectRegistry registry;
+	ASSERT_EQ(registry.allocate(), 0);
+	ASSERT_EQ(registry.allocate(), 1);
+	IdRange range = registry.allocate_range(10);
+	ASSERT_EQ(range.begin, 2);
+	ASSERT_EQ(range.end, 12);
+	ASSERT_EQ(range.size(), 10);
+	ASSERT_EQ(registry.allocate(), 12);
+	ASSERT_EQ(registry.size(), 13);
+}
+
+TEST(ObjectRegistry, explicitSphereId) {
+	Sphere s(42);
+	ASSERT_EQ(s.id, 42);
+	ASSERT_EQ(s.get_transform(), Transform::identity);
+	Sphere a, b;
+	ASSERT_NE(a.id, b.id);
+}
+
+TEST(ObjectRegistry, concurrentAllocationIsDense) {
+	ObjectRegistry registry;
+	const int threads = 8, per_thread = 10000;
+	std::vector<std::vector<int>> ids(threads);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t]() {
+			for (int i = 0; i < per_thread; ++i)
+				ids[t].push_back(Sphere(registry.allocate()).id);
+		});
+	}
+	for (auto& w : workers)
+		w.join();
+
+	std::vector<int> all;
+	for (auto& v : ids)
+		all.insert(all.end(), v.begin(), v.end());
+	std::sort(all.begin(), all.end());
+	ASSERT_EQ(registry.size(), threads * per_thread);
+	for (int i = 0; i < threads * per_thread; ++i)
+		ASSERT_EQ(all[i], i);
+}
+
+TEST(ObjectRegistry, rangesGiveStableIds) {
+	// Each worker owns a slice of the scene; object i always gets id range.begin + i
+	ObjectRegistry registry;
+	const int objects = 40000, threads = 4;
+	IdRange range = registry.allocate_range(objects);
+	std::vector<int> ids(objects, -1);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t]() {
+			for (int i = t; i < objects; i += threads)
+				ids[i] = Sphere(range.begin + i).id;
+		});
+	}
+	for (auto& w : workers)
+		w.join();
+	for (int i = 0; i < objects; ++i)
+		ASSERT_EQ(ids[i], i);
+}
+
+// A mix of analytic and object-space spheres scattered in front of the origin
+std::vector<Sphere> scatteredSpheres(std::size_t count) {
+	std::vector<Sphere> spheres;
+	for (std::size_t i = 0; i < count; ++i) {
+		float f = static_cast<float>(i);
+		Sphere s;
+		s.set_transform(TransformBuilder()
+			.scale(0.3f + 0.1f * (i % 3), 0.3f + 0.05f * (i % 5), 0.3f)
+			.rotate_y(f)
+			.translate(std::sin(f) * 3, std::cos(f * 1.3f) * 3, 5 + (i % 7)));
+		spheres.push_back(s);
+	}
+	return spheres;
+}
+
+// The reference: every sphere through intersect(), keeping the nearest positive t
+BatchHit nearestByLoop(const std::vector<Sphere>& spheres, const Ray& ray, std::size_t begin, std::size_t end) {
+	BatchHit result{ BatchHit::NONE, std::numeric_limits<float>::infinity() };
+	for (std::size_t i = begin; i < end; ++i) {
+		for (const Intersection& x : intersect(spheres[i], ray)) {
+			if (x.t > 0 && x.t < result.t)
+				result = BatchHit{ i, x.t };
+		}
+	}
+	return result;
+}
+
+TEST(SphereBatch, layout) {
+	std::vector<Sphere> spheres = scatteredSpheres(3);
+	SphereBatch batch;
+	for (const Sphere& s : spheres)
+		batch.add(s);
+	SphereBatchView view = batch.view();
+	ASSERT_EQ(view.count, 3);
+	ASSERT_EQ(view.ids[1], spheres[1].id);
+	ASSERT_FLOAT_EQ(view.rows[7][2], spheres[2].inverse_transform[1][3]);
+}
+
+TEST(SphereBatch, matchesIntersectLoop) {
+	// 29 is not a multiple of the SIMD width, so the scalar tail runs too
+	std::vector<Sphere> spheres = scatteredSpheres(29);
+	SphereBatch batch;
+	for (const Sphere& s : spheres)
+		batch.add(s);
+	for (int y = -20; y <= 20; ++y) {
+		for (int x = -20; x <= 20; ++x) {
+			Ray ray{ point(0, 0, 0), vector(x * 0.02f, y * 0.02f, 1) };
+			BatchHit expected = nearestByLoop(spheres, ray, 0, spheres.size());
+			BatchHit result = intersect_nearest(batch.view(), ray);
+			ASSERT_EQ(result.index, expected.index);
+			// Relative: where a ray grazes a sphere, contracting into FMAs can move t by
+			// more than an absolute bound allows
+			if (expected.hit()) {
+				ASSERT_NEAR(result.t, expected.t, 1e-4f * expected.t);
+			}
+		}
+	}
+}
+
+TEST(SphereBatch, subRangeAndMiss) {
+	std::vector<Sphere> spheres = scatteredSpheres(40);
+	SphereBatch batch;
+	for (const Sphere& s : spheres)
+		batch.add(s);
+	Ray ray{ point(0, 0, 0), vector(0.1f, 0.05f, 1) };
+	BatchHit expected = nearestByLoop(spheres, ray, 5, 27);
+	BatchHit result = intersect_nearest(batch.view(), ray, 5, 27);
+	ASSERT_EQ(result.index, expected.index);
+
+	Ray away{ point(0, 0, 0), vector(0, 0, -1) };
+	ASSERT_FALSE(intersect_nearest(batch.view(), away).hit());
+}
+
+TEST(SphereBatch, rayInsideSphere) {
+	Sphere s;
+	s.set_transform(Transform::scaling(2, 2, 2));
+	SphereBatch batch;
+	for (int i = 0; i < 8; ++i)
+		batch.add(s);
+	BatchHit result = intersect_nearest(batch.view(), Ray{ point(0, 0, 0), vector(0, 0, 1) });
+	ASSERT_EQ(result.index, 0);
+	ASSERT_FLOAT_EQ(result.t, 2.f);
+}
+
+TEST(SceneLoader, fullScene) {
+	Scene scene;
+	load_scene(
+		"# two spheres\n"
+		"canvas 320 240\n"
+		"output frame.ppm\n"
+		"\n"
+		"camera fov 0.5 from 1 2 -3 to 0 1 0 up 0 0 1\n"
+		"sphere\n"
+		"sphere scale 2 2 2 rotate_x 1.5707964 translate 10 5 7   # trailing comment\r\n"
+		"sphere shear 1 0 0 0 0 0\n", scene);
+	ASSERT_EQ(scene.width, 320);
+	ASSERT_EQ(scene.height, 240);
+	ASSERT_EQ(scene.output, "frame.ppm");
+	ASSERT_FLOAT_EQ(scene.camera.field_of_view, 0.5f);
+	ASSERT_EQ(scene.camera.from, point(1, 2, -3));
+	ASSERT_EQ(scene.camera.to, point(0, 1, 0));
+	ASSERT_EQ(scene.camera.up, vector(0, 0, 1));
+	ASSERT_EQ(scene.objects.size(), 3);
+	ASSERT_EQ(scene.batch.size(), 3);
+	ASSERT_EQ(scene.objects[0].get_transform(), Transform::identity);
+	ASSERT_EQ(scene.objects[1].get_transform(), Transform::identity.scale(2, 2, 2).rotate_x(M_PI / 2).translate(10, 5, 7));
+	ASSERT_EQ(scene.objects[2].get_transform(), Transform::shearing(1, 0, 0, 0, 0, 0));
+	for (int i = 0; i < 3; ++i)
+		ASSERT_EQ(scene.objects[i].id, i);
+}
+
+TEST(SceneLoader, defaults) {
+	Scene scene;
+	load_scene("", scene);
+	ASSERT_EQ(scene.width, 600);
+	ASSERT_EQ(scene.output, "output.ppm");
+	ASSERT_TRUE(scene.objects.empty());
+}
+
+SceneError sceneErrorFor(const char* source) {
+	Scene scene;
+	try {
+		load_scene(source, scene);
+	}
+	catch (const SceneError& e) {
+		return e;
+	}
+	return SceneError{ 0, 0, "no error" };
+}
+
+TEST(SceneLoader, errorPositions) {
+	SceneError e = sceneErrorFor("canvas 10 10\nsphere scale 1 x 1\n");
+	ASSERT_EQ(e.line, 2);
+	ASSERT_EQ(e.column, 16);
+	ASSERT_EQ(e.message, "expected a number, got 'x'");
+
+	e = sceneErrorFor("\n\n  cube\n");
+	ASSERT_EQ(e.line, 3);
+	ASSERT_EQ(e.column, 3);
+	ASSERT_EQ(e.message, "unknown keyword 'cube'");
+
+	e = sceneErrorFor("sphere translate 1 2\n");
+	ASSERT_EQ(e.line, 1);
+	ASSERT_EQ(e.column, 21);
+	ASSERT_EQ(e.message, "expected a number");
+
+	e = sceneErrorFor("canvas 10 10 10\n");
+	ASSERT_EQ(e.column, 14);
+	ASSERT_EQ(e.message, "unexpected '10'");
+
+	e = sceneErrorFor("sphere scale 0 1 1\n");
+	ASSERT_EQ(e.message, "sphere transform is not invertible");
+
+	e = sceneErrorFor("canvas 0 10\n");
+	ASSERT_EQ(e.column, 8);
+}
+
+TEST(SceneLoader, missingFile) {
+	Scene scene;
+	ASSERT_THROW(load_scene_file("does/not/exist.scene", scene), SceneError);
+}
+
+const char* cachedSceneSource =
+	"canvas 320 200\n"
+	"output cached.ppm\n"
+	"camera fov 0.5 from 1 2 3 to 0 0 1 up 0 1 0\n"
+	"sphere scale 2 2 2 translate 0 0 10\n"
+	"sphere scale 1 2 1 rotate_y 0.5 translate 3 0 10\n"
+	"sphere translate -3 1 8\n";
+
+std::string writeTemporary(const std::string& name, const std::string& contents) {
+	std::string path = (std::filesystem::temp_directory_path() / name).string();
+	std::ofstream(path, std::ios::binary) << contents;
+	return path;
+}
+
+TEST(SceneCache, roundTrip) {
+	Scene scene;
+	load_scene(cachedSceneSource, scene);
+	std::string path = (std::filesystem::temp_directory_path() / "roundtrip.scene.cache").string();
+	write_scene_cache(path, scene, 42);
+
+	SceneCache cache(path);
+	ASSERT_TRUE(cache.valid(42));
+	ASSERT_EQ(cache.header().width, 320);
+	ASSERT_EQ(cache.header().height, 200);
+	ASSERT_EQ(cache.output(), "cached.ppm");
+	ASSERT_EQ(cache.camera().field_of_view, 0.5f);
+	ASSERT_EQ(cache.camera().from, point(1, 2, 3));
+	ASSERT_EQ(cache.size(), 3);
+
+	SphereBatchView view = cache.batch();
+	for (std::size_t i = 0; i < scene.objects.size(); ++i) {
+		Sphere s = cached_sphere(cache.objects()[i]);
+		ASSERT_EQ(s.id, scene.objects[i].id);
+		ASSERT_EQ(s.get_transform(), scene.objects[i].get_transform());
+		ASSERT_EQ(s.get_transform().kind, scene.objects[i].get_transform().kind);
+		ASSERT_EQ(view.ids[i], scene.objects[i].id);
+		for (std::size_t e = 0; e < 12; ++e) {
+			ASSERT_EQ(view.rows[e][i], scene.batch.rows[e][i]);
+			ASSERT_EQ(reinterpret_cast<std::uintptr_t>(view.rows[e]) % SCENE_CACHE_ALIGNMENT, 0);
+		}
+	}
+
+	for (int x = -5; x <= 5; ++x) {
+		Ray r{ point(x, 0.5f, 0), vector(0, 0, 1) };
+		BatchHit expected = intersect_nearest(scene.batch.view(), r);
+		BatchHit actual = intersect_nearest(view, r);
+		ASSERT_EQ(actual.index, expected.index);
+		ASSERT_EQ(actual.t, expected.t);
+	}
+	std::filesystem::remove(path);
+}
+
+TEST(SceneCache, rejectsStaleAndDamagedFiles) {
+	Scene scene;
+	load_scene(cachedSceneSource, scene);
+	std::string path = (std::filesystem::temp_directory_path() / "damaged.scene.cache").string();
+	write_scene_cache(path, scene, 42);
+	ASSERT_FALSE(SceneCache(path).valid(43));
+
+	std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+	ASSERT_FALSE(SceneCache(path).valid(42));
+
+	writeTemporary("damaged.scene.cache", "not a scene cache");
+	ASSERT_FALSE(SceneCache(path).valid(42));
+
+	std::filesystem::remove(path);
+	ASSERT_FALSE(SceneCache(path).valid(42));
+}
+
+TEST(SceneCache, failedRenameIsASceneError) {
+	Scene scene;
+	load_scene(cachedSceneSource, scene);
+	// A non-empty directory where the cache goes can't be renamed over
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "blocked.scene.cache";
+	std::filesystem::create_directories(dir / "inside");
+	ASSERT_THROW(write_scene_cache(dir.string(), scene, 42), SceneError);
+	ASSERT_FALSE(std::filesystem::exists(dir.string() + ".tmp"));
+	std::filesystem::remove_all(dir);
+}
+
+TEST(SceneCache, rejectsBadKindsAndCounts) {
+	Scene scene;
+	load_scene(cachedSceneSource, scene);
+	std::string path = (std::filesystem::temp_directory_path() / "patched.scene.cache").string();
+	auto patch = [&](std::uint64_t offset, const auto& value) {
+		write_scene_cache(path, scene, 42);
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(static_cast<std::streamoff>(offset));
+		file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	};
+	write_scene_cache(path, scene, 42);
+	std::uint64_t kind = SceneCache(path).header().objects_offset + offsetof(CachedObject, kind);
+
+	patch(kind, static_cast<std::int32_t>(TransformKind::GENERAL));
+	ASSERT_FALSE(SceneCache(path).valid(42));
+	patch(kind, std::int32_t{ -1 });
+	ASSERT_FALSE(SceneCache(path).valid(42));
+	// Large enough that object_count * sizeof(CachedObject) wraps around to a small size
+	patch(offsetof(SceneCacheHeader, object_count), std::uint64_t{ 1 } << 62);
+	ASSERT_FALSE(SceneCache(path).valid(42));
+
+	std::filesystem::remove(path);
+}
+
+TEST(SceneCache, rebuiltOnlyWhenSourceChanges) {
+	std::string scene_path = writeTemporary("rebuild.scene", cachedSceneSource);
+	std::string cache_path = scene_path + ".cache";
+	std::filesystem::remove(cache_path);
+
+	std::unique_ptr<SceneCache> cache = load_scene_cached(scene_path, cache_path);
+	ASSERT_EQ(cache->size(), 3);
+	ASSERT_EQ(cache->header().source_hash, scene_hash(cachedSceneSource));
+	auto built = std::filesystem::last_write_time(cache_path);
+
+	// Unchanged source maps the existing file
+	cache = load_scene_cached(scene_path, cache_path);
+	ASSERT_EQ(std::filesystem::last_write_time(cache_path), built);
+
+	writeTemporary("rebuild.scene", std::string(cachedSceneSource) + "sphere translate 0 5 5\n");
+	cache = load_scene_cached(scene_path, cache_path);
+	ASSERT_EQ(cache->size(), 4);
+
+	cache.reset();
+	std::filesystem::remove(cache_path);
+	std::filesystem::remove(scene_path);
+}
+
+TEST(Camera, viewTransform) {
+	ASSERT_EQ(view_transform(point(0, 0, 0), point(0, 0, -1), vector(0, 1, 0)), AffineTransform(Transform::identity));
+	ASSERT_EQ(view_transform(point(0, 0, 0), point(0, 0, 1), vector(0, 1, 0)), AffineTransform(Transform::scaling(-1, 1, -1)));
+	ASSERT_EQ(view_transform(point(0, 0, 8), point(0, 0, 0), vector(0, 1, 0)), AffineTransform(Transform::translation(0, 0, -8)));
+
+	// Not perpendicular to the line of sight, but the result is still rigid
+	AffineTransform t = view_transform(point(1, 3, 2), point(4, -2, 8), vector(1, 1, 0));
+	ASSERT_EQ(t.kind, TransformKind::RIGID);
+	ASSERT_EQ(t * t.inverse(), AffineTransform(Transform::identity));
+	ASSERT_EQ(t.inverse().to_matrix(), t.to_matrix().inverse());
+	ASSERT_EQ(t * point(4, -2, 8), point(0, 0, -std::sqrt(70.f)));
+}
+
+TEST(Camera, pixelSize) {
+	ASSERT_TRUE(absolute(Camera(200, 125, M_PI / 2).pixel_size - 0.01f) <= EPSILON);
+	ASSERT_TRUE(absolute(Camera(125, 200, M_PI / 2).pixel_size - 0.01f) <= EPSILON);
+	Camera c(300, 200, 6.f, Projection::ORTHOGRAPHIC);
+	ASSERT_EQ(c.half_width, 3.f);
+	ASSERT_EQ(c.half_height, 2.f);
+	ASSERT_TRUE(absolute(c.pixel_size - 0.02f) <= EPSILON);
+}
+
+TEST(Camera, rayForPixel) {
+	Camera c(201, 101, M_PI / 2);
+	Ray r = c.ray_for_pixel(100, 50);
+	ASSERT_EQ(r.origin, point(0, 0, 0));
+	ASSERT_EQ(r.direction, vector(0, 0, -1));
+
+	r = c.ray_for_pixel(0, 0);
+	ASSERT_EQ(r.origin, point(0, 0, 0));
+	ASSERT_EQ(r.direction, vector(0.66519f, 0.33259f, -0.66851f));
+
+	c.set_transform(Transform::rotation_y(M_PI / 4) * Transform::translation(0, -2, 5));
+	r = c.ray_for_pixel(100, 50);
+	ASSERT_EQ(r.origin, point(0, 2, -5));
+	ASSERT_EQ(r.direction, vector(std::sqrt(2.f) / 2, 0, -std::sqrt(2.f) / 2));
+}
+
+TEST(Camera, orthographicRayForPixel) {
+	Camera c(200, 100, 20.f, Projection::ORTHOGRAPHIC);
+	c.set_transform(view_transform(point(0, 0, -5), point(0, 0, 0), vector(0, 1, 0)));
+	Ray r = c.ray_for_pixel(0, 0);
+	ASSERT_EQ(r.origin, point(-9.95f, 4.95f, -5));
+	ASSERT_EQ(r.direction, vector(0, 0, 1));
+	r = c.ray_for_pixel(199, 99);
+	ASSERT_EQ(r.origin, point(9.95f, -4.95f, -5));
+	ASSERT_EQ(r.direction, vector(0, 0, 1));
+}
+
+TEST(Camera, rowsMatchRayForPixel) {
+	Camera perspective(64, 48, 1.2f);
+	perspective.set_transform(view_transform(point(1, 3, 2), point(4, -2, 8), vector(1, 1, 0)));
+	Camera orthographic(64, 48, 10.f, Projection::ORTHOGRAPHIC);
+	orthographic.set_transform(view_transform(point(-2, 1, -6), point(0, 0, 0), vector(0, 1, 0)));
+	for (const Camera* c : { &perspective, &orthographic }) {
+		for (std::size_t y = 0; y < c->vsize; ++y) {
+			RayRow row = c->row(y);
+			for (std::size_t x = 0; x < c->hsize; ++x) {
+				Ray expected = c->ray_for_pixel(x, y);
+				Ray actual = row.at(x);
+				ASSERT_EQ(actual.origin, expected.origin);
+				ASSERT_EQ(actual.direction, expected.direction);
+			}
+		}
+	}
+}
+
+TEST(TileRender, grid) {
+	TileGrid grid{ 40, 20 };
+	ASSERT_EQ(grid.columns(), 3);
+	ASSERT_EQ(grid.rows(), 2);
+	ASSERT_EQ(grid.count(), 6);
+	PixelRect last = grid.tile(5);
+	ASSERT_EQ(last.x0, 32);
+	ASSERT_EQ(last.y0, 16);
+	ASSERT_EQ(last.x1, 40);
+	ASSERT_EQ(last.y1, 20);
+}
+
+TEST(TileRender, hilbertOrderWalksNeighbours) {
+	for (TileGrid grid : { TileGrid{ 128, 128, 16 }, TileGrid{ 600, 600, 16 }, TileGrid{ 40, 20, 16 } }) {
+		std::vector<std::size_t> order = hilbert_tiles(grid);
+		std::vector<std::size_t> sorted = order;
+		std::sort(sorted.begin(), sorted.end());
+		ASSERT_EQ(sorted, all_tiles(grid));
+		ASSERT_EQ(order.front(), 0u);
+		if (grid.columns() != 8 || grid.rows() != 8)
+			continue;
+		// On a power-of-two square every step is to a neighbouring tile
+		for (std::size_t i = 1; i < order.size(); ++i) {
+			long long dx = static_cast<long long>(order[i] % 8) - static_cast<long long>(order[i - 1] % 8);
+			long long dy = static_cast<long long>(order[i] / 8) - static_cast<long long>(order[i - 1] / 8);
+			ASSERT_EQ(std::abs(dx) + std::abs(dy), 1);
+		}
+	}
+}
+
+std::vector<Camera> cullingCameras() {
+	Camera perspective(64, 48, 1.2f);
+	perspective.set_transform(view_transform(point(0, 0, 0), point(0.5f, 0.2f, 8), vector(0, 1, 0)));
+	Camera orthographic(64, 48, 8.f, Projection::ORTHOGRAPHIC);
+	orthographic.set_transform(view_transform(point(-1, 1, -2), point(0, 0, 8), vector(0, 1, 0)));
+	return { perspective, orthographic };
+}
+
+// scatteredSpheres(40) in a batch, binned for the first of cullingCameras()
+struct BinnedSpheres {
+	SphereBatch batch;
+	Camera camera;
+	TileBins bins;
+};
+
+BinnedSpheres binnedSpheres(std::size_t tile_size = TILE_SIZE) {
+	BinnedSpheres scene{ SphereBatch{}, cullingCameras()[0], TileBins{} };
+	for (const Sphere& s : scatteredSpheres(40))
+		scene.batch.add(s);
+	scene.bins = bin_objects(scene.camera, TileGrid{ scene.camera.hsize, scene.camera.vsize, tile_size }, scene.batch.view());
+	return scene;
+}
+
+TEST(TileRender, footprintIsConservative) {
+	std::vector<Sphere> spheres = scatteredSpheres(40);
+	for (const Camera& camera : cullingCameras()) {
+		for (const Sphere& s : spheres) {
+			PixelRect r = screen_footprint(camera, s.get_transform());
+			for (std::size_t y = 0; y < camera.vsize; ++y) {
+				for (std::size_t x = 0; x < camera.hsize; ++x) {
+					bool hit = nearestByLoop({ s }, camera.ray_for_pixel(x, y), 0, 1).hit();
+					bool inside = x >= r.x0 && x < r.x1 && y >= r.y0 && y < r.y1;
+					ASSERT_TRUE(inside || !hit);
+				}
+			}
+		}
+	}
+}
+
+TEST(TileRender, footprintBehindAndAroundCamera) {
+	Camera c(64, 48, 1.2f);
+	Sphere behind(0);
+	behind.set_transform(Transform::translation(0, 0, 5));
+	ASSERT_TRUE(screen_footprint(c, behind.get_transform()).empty());
+
+	Sphere around(1);
+	around.set_transform(Transform::scaling(2, 2, 2));
+	PixelRect r = screen_footprint(c, around.get_transform());
+	ASSERT_EQ(r.x0, 0);
+	ASSERT_EQ(r.y0, 0);
+	ASSERT_EQ(r.x1, 64);
+	ASSERT_EQ(r.y1, 48);
+}
+
+TEST(TileRender, culledMatchesUnculled) {
+	std::vector<Sphere> spheres = scatteredSpheres(40);
+	SphereBatch batch;
+	for (const Sphere& s : spheres)
+		batch.add(s);
+	for (const Camera& camera : cullingCameras()) {
+		TileBins bins = bin_objects(camera, TileGrid{ camera.hsize, camera.vsize, 8 }, batch.view());
+		ASSERT_LT(bins.objects.size(), spheres.size() * bins.grid.count());
+		Canvas canvas(camera.hsize, camera.vsize);
+		render(camera, bins, canvas, [&](const Ray& ray, const BatchHit& hit) {
+			BatchHit expected = intersect_nearest(batch.view(), ray);
+			EXPECT_EQ(hit.index, expected.index);
+			// A sphere can land in the SIMD body in one batch and the scalar tail in the
+			// other, which rounds differently
+			if (expected.hit()) {
+				EXPECT_NEAR(hit.t, expected.t, 1e-4f * expected.t);
+			}
+			return color(0, 0, 0);
+		});
+	}
+}
+
+Color shadeByObject(const Ray&, const BatchHit& hit) {
+	return hit.hit() ? color(static_cast<float>(hit.index + 1), hit.t, 0) : color(0, 0, 0);
+}
+
+TEST(TileRender, rerenderOnlyChangedTiles) {
+	Scene scene;
+	for (const Sphere& s : scatteredSpheres(40))
+		scene.add(s.get_transform());
+	Camera camera = cullingCameras()[0];
+	TileGrid grid{ camera.hsize, camera.vsize, 8 };
+	TileBins bins = bin_objects(camera, grid, scene.batch.view());
+	Canvas canvas(camera.hsize, camera.vsize);
+	render(camera, bins, canvas, shadeByObject);
+
+	ASSERT_EQ(rerender_changed(camera, bins, scene.batch.view(), {}, canvas, shadeByObject), 0);
+
+	PixelRect before = bins.covered[3];
+	scene.set_transform(3, TransformBuilder(scene.objects[3].get_transform()).translate(0.8f, -0.4f, 0));
+	scene.set_transform(17, TransformBuilder(scene.objects[17].get_transform()).scale(0.5f, 0.5f, 0.5f));
+	std::size_t rendered = rerender_changed(camera, bins, scene.batch.view(), { 17, 3, 3 }, canvas, shadeByObject);
+	ASSERT_GT(rendered, 0);
+	ASSERT_LT(rendered, grid.count());
+	ASSERT_FALSE(before.x0 == bins.covered[3].x0 && before.y0 == bins.covered[3].y0);
+
+	// Same bins and pixels as starting over
+	TileBins fresh = bin_objects(camera, grid, scene.batch.view());
+	ASSERT_EQ(bins.offsets, fresh.offsets);
+	ASSERT_EQ(bins.objects, fresh.objects);
+	for (std::size_t e = 0; e < 12; ++e)
+		ASSERT_EQ(bins.batch.rows[e], fresh.batch.rows[e]);
+	Canvas expected(camera.hsize, camera.vsize);
+	render(camera, fresh, expected, shadeByObject);
+	for (std::size_t y = 0; y < camera.vsize; ++y) {
+		for (std::size_t x = 0; x < camera.hsize; ++x)
+			ASSERT_EQ(canvas.read_pixel(x, y), expected.read_pixel(x, y));
+	}
+}
+
+TEST(CounterRng, philoxKnownAnswers) {
+	// From the Random123 known-answer tests
+	PhiloxBlock zero = philox({ 0, 0, 0, 0 }, 0, 0);
+	ASSERT_EQ(zero, (PhiloxBlock{ 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 }));
+	PhiloxBlock ones = philox({ 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff }, 0xffffffff, 0xffffffff);
+	ASSERT_EQ(ones, (PhiloxBlock{ 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd }));
+	PhiloxBlock pi = philox({ 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 }, 0xa4093822, 0x299f31d0);
+	ASSERT_EQ(pi, (PhiloxBlock{ 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 }));
+}
+
+TEST(CounterRng, keyedByPixelSampleAndDimension) {
+	CounterRng rng(7);
+	float u = rng.uniform(10, 2, 5);
+	ASSERT_EQ(u, rng.uniform(10, 2, 5));
+	ASSERT_EQ(u, uniform_float(rng.block(10, 2, 1)[1]));
+	ASSERT_NE(u, rng.uniform(11, 2, 5));
+	ASSERT_NE(u, rng.uniform(10, 3, 5));
+	ASSERT_NE(u, rng.uniform(10, 2, 6));
+	ASSERT_NE(u, CounterRng(8).uniform(10, 2, 5));
+	// Pixels past 2^32 use the counter's high word
+	ASSERT_NE(rng.uniform(1, 0, 0), rng.uniform(1ull << 32 | 1, 0, 0));
+
+	double mean = 0;
+	for (std::uint64_t pixel = 0; pixel < 100000; ++pixel) {
+		float f = rng.uniform(pixel, 0, 0);
+		ASSERT_GE(f, 0.f);
+		ASSERT_LT(f, 1.f);
+		mean += f / 100000.0;
+	}
+	ASSERT_NEAR(mean, 0.5, 0.005);
+}
+
+TEST(CounterRng, bulkMatchesScalar) {
+	CounterRng rng(0x0123456789abcdefull);
+	// Starts just below 2^32 and isn't a multiple of 8, so it wraps the low word and runs the tail
+	const std::size_t count = 21;
+	std::uint64_t first = 0xfffffff5ull;
+	std::vector<float> out(4 * count);
+	float* const blocks[4] = { &out[0], &out[count], &out[2 * count], &out[3 * count] };
+	rng.uniform_blocks(first, count, 3, 2, blocks);
+	for (std::size_t i = 0; i < count; ++i) {
+		for (std::uint32_t w = 0; w < 4; ++w)
+			ASSERT_EQ(blocks[w][i], rng.uniform(first + i, 3, 8 + w));
+	}
+}
+
+// Compared row by row, so canvases of different layouts can match
+bool sameBits(const Canvas& a, const Canvas& b) {
+	if (a.width != b.width || a.height != b.height)
+		return false;
+	std::vector<Tuple> scratch_a(a.width), scratch_b(b.width);
+	for (std::size_t y = 0; y < a.height; ++y) {
+		if (std::memcmp(a.row(y, scratch_a.data()), b.row(y, scratch_b.data()), a.width * sizeof(Tuple)) != 0)
+			return false;
+	}
+	return true;
+}
+
+TEST(TileRender, samplesIndependentOfThreads) {
+	BinnedSpheres scene = binnedSpheres(8);
+
+	RenderSettings settings;
+	settings.samples = 4;
+	settings.seed = 99;
+	Canvas single(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, single, shadeByObject, settings);
+
+	settings.threads = 4;
+	Canvas threaded(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, threaded, shadeByObject, settings);
+	ASSERT_TRUE(sameBits(single, threaded));
+
+	// Tiles in the opposite order
+	Canvas reversed(scene.camera.hsize, scene.camera.vsize);
+	for (std::size_t t = scene.bins.grid.count(); t-- > 0;)
+		render_tile(scene.camera, scene.bins, t, reversed, shadeByObject, settings);
+	ASSERT_TRUE(sameBits(single, reversed));
+
+	Canvas tiled(scene.camera.hsize, scene.camera.vsize, CanvasLayout::TILED);
+	render(scene.camera, scene.bins, tiled, shadeByObject, settings);
+	ASSERT_TRUE(sameBits(single, tiled));
+
+	settings.seed = 100;
+	Canvas reseeded(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, reseeded, shadeByObject, settings);
+	ASSERT_FALSE(sameBits(single, reseeded));
+}
+
+TEST(TileRender, shadeErrorsReachTheCaller) {
+	BinnedSpheres scene = binnedSpheres(8);
+	auto failing = [](const Ray& ray, const BatchHit& hit) {
+		if (hit.hit())
+			throw RawCanvasError{ "out of texture memory" };
+		return shadeByObject(ray, hit);
+	};
+	for (unsigned threads : { 1u, 4u }) {
+		RenderSettings settings;
+		settings.threads = threads;
+		Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+		ASSERT_THROW(render(scene.camera, scene.bins, canvas, failing, settings), RawCanvasError);
+	}
+}
+
+TEST(Checkpoint, resumeRendersOnlyMissingTiles) {
+	BinnedSpheres scene = binnedSpheres(8);
+	RenderSettings settings;
+	settings.samples = 2;
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject, settings);
+
+	// A render killed after its even tiles
+	std::string path = (std::filesystem::temp_directory_path() / "resume.checkpoint").string();
+	std::filesystem::remove(path);
+	{
+		Canvas partial(scene.camera.hsize, scene.camera.vsize);
+		CheckpointWriter writer(path, partial, scene.bins.grid, 5, std::vector<char>(scene.bins.grid.count(), 0), std::chrono::hours(1));
+		for (std::size_t t = 0; t < scene.bins.grid.count(); t += 2) {
+			render_tile(scene.camera, scene.bins, t, partial, shadeByObject, settings);
+			writer.tile_done(t);
+		}
+		writer.flush();
+		ASSERT_EQ(writer.checkpoints_written(), 1);
+	}
+
+	std::size_t rendered = 0;
+	CheckpointSettings checkpoints;
+	checkpoints.path = path;
+	checkpoints.key = 5;
+	Canvas resumed(scene.camera.hsize, scene.camera.vsize);
+	ResumeStats stats = render_resumable(scene.camera, scene.bins, resumed, [&](const Ray& ray, const BatchHit& hit) {
+		++rendered;
+		return shadeByObject(ray, hit);
+	}, settings, checkpoints);
+	ASSERT_EQ(stats.tiles_resumed, (scene.bins.grid.count() + 1) / 2);
+	ASSERT_EQ(stats.tiles_rendered, scene.bins.grid.count() / 2);
+	ASSERT_LT(rendered, scene.camera.hsize * scene.camera.vsize * settings.samples);
+	ASSERT_TRUE(sameBits(resumed, expected));
+
+	// The final checkpoint has every tile
+	Canvas reloaded(scene.camera.hsize, scene.camera.vsize);
+	std::vector<char> done = load_checkpoint(path, scene.bins.grid, 5, reloaded);
+	ASSERT_EQ(std::count(done.begin(), done.end(), 1), scene.bins.grid.count());
+	ASSERT_TRUE(sameBits(reloaded, expected));
+	std::filesystem::remove(path);
+}
+
+TEST(Checkpoint, ignoresOtherRendersAndDamage) {
+	TileGrid grid{ 20, 12, 8 };
+	Canvas canvas(20, 12);
+	canvas.write_pixel(3, 3, color(1, 2, 3));
+	std::string path = (std::filesystem::temp_directory_path() / "other.checkpoint").string();
+	{
+		CheckpointWriter writer(path, canvas, grid, 1, std::vector<char>(grid.count(), 0), std::chrono::hours(1));
+		writer.tile_done(0);
+		writer.flush();
+	}
+	Canvas loaded(20, 12);
+	ASSERT_EQ(load_checkpoint(path, grid, 1, loaded)[0], 1);
+	ASSERT_EQ(loaded.read_pixel(3, 3), color(1, 2, 3));
+	ASSERT_EQ(load_checkpoint(path, grid, 2, loaded)[0], 0);
+	ASSERT_EQ(load_checkpoint(path, TileGrid{ 20, 12, 4 }, 1, loaded)[0], 0);
+
+	std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+	ASSERT_EQ(load_checkpoint(path, grid, 1, loaded)[0], 0);
+	std::filesystem::remove(path);
+	ASSERT_EQ(load_checkpoint(path, grid, 1, loaded)[0], 0);
+}
+
+TEST(Checkpoint, writesInBackground) {
+	TileGrid grid{ 20, 12, 8 };
+	Canvas canvas(20, 12);
+	std::string path = (std::filesystem::temp_directory_path() / "background.checkpoint").string();
+	CheckpointWriter writer(path, canvas, grid, 1, std::vector<char>(grid.count(), 0), std::chrono::milliseconds(1));
+	writer.tile_done(2);
+	for (int i = 0; i < 1000 && writer.checkpoints_written() == 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	ASSERT_GE(writer.checkpoints_written(), 1);
+	Canvas loaded(20, 12);
+	ASSERT_EQ(load_checkpoint(path, grid, 1, loaded)[2], 1);
+	std::filesystem::remove(path);
+}
+
+#ifndef _WIN32
+
+// A marker file per test process, so concurrent test runs don't share it
+std::string onceMarker(const std::string& name) {
+	std::string path = (std::filesystem::temp_directory_path() / (name + "." + std::to_string(getpid()))).string();
+	std::filesystem::remove(path);
+	return path;
+}
+
+// True for the first process to get here; creating the marker exclusively keeps it
+// to one even when workers reach it at the same time
+bool firstToMark(const std::string& marker) {
+	int fd = open(marker.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+class Sharding : public ::testing::Test {
+protected:
+	BinnedSpheres scene = binnedSpheres(8);
+	RenderSettings settings;
+	Canvas expected{ scene.camera.hsize, scene.camera.vsize };
+
+	void SetUp() override {
+		settings.samples = 2;
+		render(scene.camera, scene.bins, expected, shadeByObject, settings);
+	}
+};
+
+TEST_F(Sharding, matchesInProcessRender) {
+	ShardSettings shards;
+	shards.workers = 3;
+	shards.tiles_per_assignment = 5;
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	ShardStats stats = render_sharded(scene.camera, scene.bins, canvas, shadeByObject, settings, shards);
+	ASSERT_EQ(stats.worker_crashes, 0);
+	ASSERT_EQ(stats.assignments, (scene.bins.grid.count() + 4) / 5);
+	ASSERT_TRUE(sameBits(canvas, expected));
+}
+
+TEST_F(Sharding, reassignsTilesOfCrashedWorkers) {
+	// The first worker to shade a sample dies
+	pid_t coordinator = getpid();
+	std::string marker = onceMarker("shard.crashed");
+	auto crashOnce = [&](const Ray& ray, const BatchHit& hit) {
+		if (getpid() != coordinator && firstToMark(marker))
+			_exit(3);
+		return shadeByObject(ray, hit);
+	};
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	ShardStats stats = render_sharded(scene.camera, scene.bins, canvas, crashOnce, settings, ShardSettings{});
+	ASSERT_EQ(stats.worker_crashes, 1);
+	ASSERT_EQ(stats.tiles_reassigned, ShardSettings{}.tiles_per_assignment);
+	ASSERT_TRUE(sameBits(canvas, expected));
+	std::filesystem::remove(marker);
+}
+
+TEST_F(Sharding, shadeErrorsCrashOnlyTheWorker) {
+	pid_t coordinator = getpid();
+	std::string marker = onceMarker("shard.threw");
+	auto throwOnce = [&](const Ray& ray, const BatchHit& hit) {
+		if (getpid() != coordinator && firstToMark(marker))
+			throw RawCanvasError{ "out of texture memory" };
+		return shadeByObject(ray, hit);
+	};
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	ShardStats stats = render_sharded(scene.camera, scene.bins, canvas, throwOnce, settings, ShardSettings{});
+	ASSERT_EQ(stats.worker_crashes, 1);
+	ASSERT_TRUE(sameBits(canvas, expected));
+	std::filesystem::remove(marker);
+}
+
+TEST_F(Sharding, killsAndReplacesHungWorkers) {
+	// The first worker to shade a sample never returns it
+	pid_t coordinator = getpid();
+	std::string marker = onceMarker("shard.hung");
+	auto hangOnce = [&](const Ray& ray, const BatchHit& hit) {
+		if (getpid() != coordinator && firstToMark(marker)) {
+			for (;;)
+				pause();
+		}
+		return shadeByObject(ray, hit);
+	};
+	ShardSettings shards;
+	shards.assignment_timeout = std::chrono::milliseconds(300);
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	ShardStats stats = render_sharded(scene.camera, scene.bins, canvas, hangOnce, settings, shards);
+	ASSERT_EQ(stats.worker_crashes, 1);
+	ASSERT_EQ(stats.worker_timeouts, 1);
+	ASSERT_EQ(stats.tiles_reassigned, shards.tiles_per_assignment);
+	ASSERT_TRUE(sameBits(canvas, expected));
+	std::filesystem::remove(marker);
+}
+
+TEST_F(Sharding, givesUpWhenWorkersKeepCrashing) {
+	pid_t coordinator = getpid();
+	auto crashAlways = [&](const Ray& ray, const BatchHit& hit) {
+		if (getpid() != coordinator)
+			_exit(3);
+		return shadeByObject(ray, hit);
+	};
+	ShardSettings shards;
+	shards.max_restarts = 2;
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	ASSERT_THROW(render_sharded(scene.camera, scene.bins, canvas, crashAlways, settings, shards), ShardError);
+}
+
+#endif
+
+Canvas gradientCanvas(std::size_t width, std::size_t height, float scale, CanvasLayout layout = CanvasLayout::ROW_MAJOR) {
+	Canvas c(width, height, layout);
+	for (std::size_t y = 0; y < height; ++y) {
+		for (std::size_t x = 0; x < width; ++x)
+			c.write_pixel(x, y, color(x * scale, y * scale, 0.1f + scale));
+	}
+	return c;
+}
+
+TEST(RawCanvas, roundTrip) {
+	Canvas c = gradientCanvas(13, 7, 0.37f);
+	std::string path = (std::filesystem::temp_directory_path() / "roundtrip.raw").string();
+	write_raw_canvas(path, c, 4);
+	Canvas loaded(13, 7);
+	RawCanvasHeader h = read_raw_canvas(path, loaded);
+	ASSERT_EQ(h.weight, 4);
+	ASSERT_EQ(h.width, 13);
+	ASSERT_TRUE(sameBits(c, loaded));
+
+	Canvas wrongSize(12, 7);
+	ASSERT_THROW(read_raw_canvas(path, wrongSize), RawCanvasError);
+	std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+	ASSERT_THROW(read_raw_canvas(path, loaded), RawCanvasError);
+	std::filesystem::remove(path);
+	ASSERT_THROW(read_raw_canvas(path, loaded), RawCanvasError);
+}
+
+TEST(RawCanvas, composeRegions) {
+	Canvas c = gradientCanvas(20, 10, 0.5f);
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	std::vector<std::string> parts = { (dir / "left.raw").string(), (dir / "right.raw").string(), (dir / "bottom.raw").string() };
+	write_raw_canvas(parts[0], c, PixelRect{ 0, 0, 8, 6 });
+	write_raw_canvas(parts[1], c, PixelRect{ 8, 0, 20, 6 });
+	write_raw_canvas(parts[2], c, PixelRect{ 0, 6, 20, 10 });
+	std::string merged = (dir / "composed.raw").string();
+	RawCanvasHeader h = merge_raw_canvases(parts, merged, MergeMode::COMPOSE);
+	ASSERT_EQ(h.x0, 0);
+	ASSERT_EQ(h.width, 20);
+	ASSERT_EQ(h.height, 10);
+
+	Canvas loaded(20, 10);
+	read_raw_canvas(merged, loaded);
+	ASSERT_TRUE(sameBits(c, loaded));
+
+	// Uncovered pixels are black
+	merge_raw_canvases({ parts[1] }, merged, MergeMode::COMPOSE);
+	read_raw_canvas(merged, loaded);
+	ASSERT_EQ(loaded.read_pixel(0, 0), color(0, 0, 0));
+	ASSERT_EQ(loaded.read_pixel(8, 0), c.read_pixel(8, 0));
+	for (const std::string& p : parts)
+		std::filesystem::remove(p);
+	std::filesystem::remove(merged);
+}
+
+TEST(RawCanvas, mergeRefusesToOverwriteAnInput) {
+	Canvas c = gradientCanvas(6, 4, 0.2f);
+	std::string path = (std::filesystem::temp_directory_path() / "inplace.raw").string();
+	write_raw_canvas(path, c);
+	ASSERT_THROW(merge_raw_canvases({ path }, path, MergeMode::COMPOSE), RawCanvasError);
+	Canvas loaded(6, 4);
+	read_raw_canvas(path, loaded);
+	ASSERT_TRUE(sameBits(c, loaded));
+	std::filesystem::remove(path);
+}
+
+TEST(RawCanvas, convertsToPPM) {
+	Canvas c = gradientCanvas(30, 5, 0.1f);
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	std::string raw = (dir / "convert.raw").string(), ppm = (dir / "convert.ppm").string();
+	write_raw_canvas(raw, c, PixelRect{ 4, 1, 30, 5 });
+	raw_canvas_to_ppm(raw, ppm);
+	std::stringstream text;
+	text << std::ifstream(ppm, std::ios::binary).rdbuf();
+	ASSERT_EQ(text.str(), CanvasToPPM(copy_region(c, PixelRect{ 4, 1, 30, 5 }), 255).toPlainPPM());
+	std::filesystem::remove(raw);
+	std::filesystem::remove(ppm);
+}
+
+TEST(RawCanvas, averageByWeight) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	std::string one = (dir / "one.raw").string(), three = (dir / "three.raw").string(), merged = (dir / "average.raw").string();
+	Canvas a(4, 3), b(4, 3);
+	for (std::size_t y = 0; y < 3; ++y) {
+		for (std::size_t x = 0; x < 4; ++x) {
+			a.write_pixel(x, y, color(1, 0, 0.5f));
+			b.write_pixel(x, y, color(0, 1, 0.5f));
+		}
+	}
+	write_raw_canvas(one, a, 1);
+	write_raw_canvas(three, b, 3);
+	RawCanvasHeader h = merge_raw_canvases({ one, three }, merged, MergeMode::AVERAGE);
+	ASSERT_EQ(h.weight, 4);
+	Canvas loaded(4, 3);
+	read_raw_canvas(merged, loaded);
+	ASSERT_EQ(loaded.read_pixel(2, 1), color(0.25f, 0.75f, 0.5f));
+
+	Canvas other(5, 3);
+	write_raw_canvas(three, other, 3);
+	ASSERT_THROW(merge_raw_canvases({ one, three }, merged, MergeMode::AVERAGE), RawCanvasError);
+	std::filesystem::remove(one);
+	std::filesystem::remove(three);
+	std::filesystem::remove(merged);
+}
+
+TEST(ThreadPool, parallelForRunsEachIndexOnce) {
+	ThreadPool pool(3);
+	ASSERT_EQ(pool.size(), 3u);
+	for (std::size_t count : { 0, 1, 2, 1000 }) {
+		std::vector<std::atomic<int>> runs(count);
+		pool.parallel_for(count, [&](std::size_t i) { ++runs[i]; });
+		for (std::size_t i = 0; i < count; ++i)
+			ASSERT_EQ(runs[i], 1);
+	}
+	ASSERT_EQ(pool.submit([]() { throw 7; }).wait_for(std::chrono::seconds(10)), std::future_status::ready);
+}
+
+TEST(ThreadPool, parallelForRethrowsAfterEveryThreadStops) {
+	ThreadPool pool(3);
+	std::atomic<int> running{ 0 };
+	auto failing = [&](std::size_t i) {
+		++running;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		--running;
+		if (i == 5)
+			throw RawCanvasError{ "out of texture memory" };
+	};
+	ASSERT_THROW(pool.parallel_for(1000, failing), RawCanvasError);
+	ASSERT_EQ(running, 0);
+	// The pool still works afterwards
+	std::atomic<int> runs{ 0 };
+	pool.parallel_for(10, [&](std::size_t) { ++runs; });
+	ASSERT_EQ(runs, 10);
+}
+
+TEST(Sequence, framesMatchIndependentRenders) {
+	Scene scene;
+	for (const Sphere& s : scatteredSpheres(40))
+		scene.add(s.get_transform());
+	Camera camera = cullingCameras()[0];
+	std::vector<AffineTransform> start;
+	for (const Sphere& s : scene.objects)
+		start.push_back(s.get_transform());
+	// Frames 1 and 2 move one object each, frame 3 nothing, frame 4 most of them
+	auto update = [&](std::size_t frame, Scene& scene, Camera&, FrameChanges& changes) {
+		std::size_t moving = frame == 4 ? 30 : frame == 3 ? 0 : 1;
+		for (std::size_t i = 0; i < moving && frame > 0; ++i) {
+			scene.set_transform(i, TransformBuilder(start[i]).translate(0.3f * frame, -0.2f * frame, 0));
+			changes.moved.push_back(i);
+		}
+	};
+
+	// Each frame rendered from scratch
+	Scene reference;
+	for (const AffineTransform& t : start)
+		reference.add(t);
+	std::vector<Canvas> expected;
+	for (std::size_t frame = 0; frame < 5; ++frame) {
+		FrameChanges ignored;
+		update(frame, reference, camera, ignored);
+		expected.emplace_back(camera.hsize, camera.vsize);
+		render(camera, bin_objects(camera, TileGrid{ camera.hsize, camera.vsize }, reference.batch.view()), expected.back(), shadeByObject);
+	}
+
+	SequenceSettings settings;
+	settings.render.threads = 3;
+	std::vector<std::size_t> encoded;
+	SequenceStats stats = render_sequence(scene, camera, 5, update, shadeByObject, [&](std::size_t frame, const Canvas& c) {
+		ASSERT_TRUE(sameBits(c, expected[frame]));
+		encoded.push_back(frame);
+	}, settings);
+	ASSERT_EQ(encoded, (std::vector<std::size_t>{ 0, 1, 2, 3, 4 }));
+	ASSERT_EQ(stats.frames, 5u);
+	ASSERT_EQ(stats.rebuilds, 2u);
+	ASSERT_EQ(stats.refits, 2u);
+	std::size_t tiles = TileGrid{ camera.hsize, camera.vsize }.count();
+	ASSERT_GT(stats.tiles_rendered, 2 * tiles);
+	ASSERT_LT(stats.tiles_rendered, 3 * tiles);
+}
+
+TEST(Sequence, encodeErrorsReachTheCaller) {
+	Scene scene;
+	scene.add(Transform::identity);
+	Camera camera(16, 16, M_PI / 2);
+	camera.set_transform(view_transform(point(0, 0, -5), point(0, 0, 0), vector(0, 1, 0)));
+	std::size_t updates = 0;
+	auto update = [&](std::size_t, Scene&, Camera&, FrameChanges&) { ++updates; };
+	auto encode = [](std::size_t frame, const Canvas&) {
+		if (frame == 1)
+			throw RawCanvasError{ "disk full" };
+	};
+	SequenceSettings settings;
+	settings.queue_depth = 2;
+	ASSERT_THROW(render_sequence(scene, camera, 10, update, shadeByObject, encode, settings), RawCanvasError);
+	// Frames 2 and 3 may be queued and frame 4 rendered before the failure shows
+	ASSERT_GE(updates, 2u);
+	ASSERT_LE(updates, 5u);
+}
+
+TEST(Y4M, bt601Colors) {
+	Canvas c(2, 2);
+	auto convert = [&](const Color& rgb) {
+		for (std::size_t y = 0; y < 2; ++y) {
+			for (std::size_t x = 0; x < 2; ++x)
+				c.write_pixel(x, y, rgb);
+		}
+		std::uint8_t luma[4], u, v;
+		yuv420_rows(c.canvas, c.canvas + 2, 2, luma, luma + 2, &u, &v);
+		return std::vector<int>{ luma[0], u, v };
+	};
+	ASSERT_EQ(convert(color(0, 0, 0)), (std::vector<int>{ 16, 128, 128 }));
+	ASSERT_EQ(convert(color(1, 1, 1)), (std::vector<int>{ 235, 128, 128 }));
+	ASSERT_EQ(convert(color(1, 0, 0)), (std::vector<int>{ 81, 90, 240 }));
+	ASSERT_EQ(convert(color(0, 0, 1)), (std::vector<int>{ 41, 240, 110 }));
+	// Clamped to [0, 1] first
+	ASSERT_EQ(convert(color(255, -3, 0)), convert(color(1, 0, 0)));
+}
+
+TEST(Y4M, vectorRowsMatchScalarFormula) {
+	// 21 pixels: two 8 pixel blocks, then a tail with an unpaired last column
+	const std::size_t width = 21;
+	Canvas c(width, 2);
+	for (std::size_t y = 0; y < 2; ++y) {
+		for (std::size_t x = 0; x < width; ++x)
+			c.write_pixel(x, y, color(std::sin(x * 1.3f + y) * 0.7f + 0.4f, (x * 37 % 11) / 10.f, y ? 1.2f : 0.05f * x));
+	}
+	std::vector<std::uint8_t> luma(2 * width), u(11), v(11);
+	yuv420_rows(c.canvas, c.canvas + width, width, luma.data(), luma.data() + width, u.data(), v.data());
+
+	auto channel = [&](std::size_t x, std::size_t y, std::size_t k) {
+		Color p = c.read_pixel(x, y);
+		return std::min(std::max(static_cast<double>(k == 0 ? p.x : k == 1 ? p.y : p.z), 0.0), 1.0);
+	};
+	for (std::size_t y = 0; y < 2; ++y) {
+		for (std::size_t x = 0; x < width; ++x) {
+			double expected = 16 + 65.481 * channel(x, y, 0) + 128.553 * channel(x, y, 1) + 24.966 * channel(x, y, 2);
+			ASSERT_NEAR(luma[y * width + x], expected, 0.5 + 1e-3) << x << ", " << y;
+		}
+	}
+	for (std::size_t i = 0; i < 11; ++i) {
+		double mean[3] = { 0, 0, 0 };
+		std::size_t n = 0;
+		for (std::size_t x = 2 * i; x < std::min(2 * i + 2, width); ++x) {
+			for (std::size_t y = 0; y < 2; ++y, ++n) {
+				for (std::size_t k = 0; k < 3; ++k)
+					mean[k] += channel(x, y, k);
+			}
+		}
+		for (double& m : mean)
+			m /= n;
+		ASSERT_NEAR(u[i], 128 - 37.797 * mean[0] - 74.203 * mean[1] + 112 * mean[2], 0.5 + 1e-3) << i;
+		ASSERT_NEAR(v[i], 128 + 112 * mean[0] - 93.786 * mean[1] - 18.214 * mean[2], 0.5 + 1e-3) << i;
+	}
+}
+
+TEST(Y4M, streamLayout) {
+	std::string path = (std::filesystem::temp_directory_path() / "frames.y4m").string();
+	Canvas c(5, 3);
+	{
+		Y4MWriter video(path, 5, 3, 24);
+		video.write_frame(c);
+		c.write_pixel(0, 0, color(1, 1, 1));
+		video.write_frame(c);
+		ASSERT_THROW(video.write_frame(Canvas(4, 3)), Y4MError);
+		ASSERT_EQ(video.frames_written(), 2u);
+		video.close();
+	}
+	std::ifstream file(path, std::ios::binary);
+	std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::string header = "YUV4MPEG2 W5 H3 F24:1 Ip A1:1 C420jpeg\n";
+	// 15 luma bytes and 3x2 per chroma plane per frame
+	std::size_t frame = 6 + 15 + 2 * 6;
+	ASSERT_EQ(contents.size(), header.size() + 2 * frame);
+	ASSERT_EQ(contents.substr(0, header.size()), header);
+	ASSERT_EQ(contents.substr(header.size() + frame, 6), "FRAME\n");
+	ASSERT_EQ(static_cast<std::uint8_t>(contents[header.size() + 6]), 16);
+	ASSERT_EQ(static_cast<std::uint8_t>(contents[header.size() + frame + 6]), 235);
+	file.close();
+	std::filesystem::remove(path);
+	ASSERT_THROW(Y4MWriter((std::filesystem::temp_directory_path() / "missing" / "x.y4m").string(), 5, 3), Y4MError);
+}
+
+TEST(FramePipeline, recyclesBuffersInOrder) {
+	std::vector<std::size_t> written;
+	std::vector<float> firsts;
+	FramePipeline pipeline(3, 2, [&](std::size_t frame, const Canvas& c) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		written.push_back(frame);
+		firsts.push_back(c.read_pixel(0, 0).x);
+	}, 2);
+	Canvas canvas(3, 2);
+	for (std::size_t frame = 0; frame < 20; ++frame) {
+		canvas.write_pixel(0, 0, color(static_cast<float>(frame), 0, 0));
+		Tuple* handed_over = canvas.canvas;
+		pipeline.submit(frame, canvas);
+		ASSERT_NE(canvas.canvas, handed_over);
+	}
+	pipeline.finish();
+	ASSERT_EQ(pipeline.frames_written(), 20u);
+	std::vector<std::size_t> order(20);
+	for (std::size_t i = 0; i < 20; ++i)
+		order[i] = i;
+	ASSERT_EQ(written, order);
+	for (std::size_t i = 0; i < 20; ++i)
+		ASSERT_EQ(firsts[i], static_cast<float>(i));
+	// With the caller's own canvas: two waiting, one being written and one to render into
+	ASSERT_LE(pipeline.buffers(), 3u);
+}
+
+TEST(FramePipeline, writeErrorsStopThePipeline) {
+	std::size_t writes = 0;
+	FramePipeline pipeline(2, 2, [&](std::size_t frame, const Canvas&) {
+		++writes;
+		if (frame == 0)
+			throw Y4MError{ "broken pipe" };
+	}, 1);
+	Canvas canvas(2, 2);
+	pipeline.submit(0, canvas);
+	ASSERT_THROW(pipeline.finish(), Y4MError);
+	ASSERT_THROW(pipeline.submit(1, canvas), Y4MError);
+	ASSERT_EQ(writes, 1u);
+	ASSERT_EQ(pipeline.frames_written(), 0u);
+}
+
+TEST(TileRender, regionsMatchFullRender) {
+	BinnedSpheres scene = binnedSpheres(8);
+	RenderSettings settings;
+	settings.samples = 4;
+	settings.seed = 5;
+	Canvas full(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, full, shadeByObject, settings);
+
+	// Across tile edges, and past the frame's right edge
+	for (PixelRect region : { PixelRect{ 5, 3, 19, 12 }, PixelRect{ scene.camera.hsize - 6, 9, scene.camera.hsize + 20, 17 } }) {
+		Color marker = color(-1, -1, -1);
+		Canvas partial(scene.camera.hsize, scene.camera.vsize);
+		for (std::size_t y = 0; y < scene.camera.vsize; ++y) {
+			for (std::size_t x = 0; x < scene.camera.hsize; ++x)
+				partial.write_pixel(x, y, marker);
+		}
+		render_region(scene.camera, scene.bins, region, partial, shadeByObject, settings);
+		CropCanvas crop = render_crop(scene.camera, scene.bins, region, shadeByObject, settings);
+		PixelRect clipped = overlap(region, PixelRect{ 0, 0, scene.camera.hsize, scene.camera.vsize });
+		ASSERT_EQ(crop.region.x1, clipped.x1);
+		ASSERT_EQ(crop.canvas.width, clipped.width());
+		ASSERT_EQ(crop.canvas.height, clipped.height());
+		for (std::size_t y = 0; y < scene.camera.vsize; ++y) {
+			for (std::size_t x = 0; x < scene.camera.hsize; ++x) {
+				bool inside = x >= clipped.x0 && x < clipped.x1 && y >= clipped.y0 && y < clipped.y1;
+				ASSERT_EQ(partial.read_pixel(x, y), inside ? full.read_pixel(x, y) : marker) << x << ", " << y;
+				if (inside) {
+					ASSERT_EQ(crop.canvas.read_pixel(x - clipped.x0, y - clipped.y0), full.read_pixel(x, y));
+				}
+			}
+		}
+		ASSERT_TRUE(sameBits(copy_region(full, clipped), crop.canvas));
+	}
+	ASSERT_TRUE(region_tiles(scene.bins.grid, PixelRect{ scene.camera.hsize, 0, scene.camera.hsize + 8, 8 }).empty());
+}
+
+TEST(RawCanvas, cropKeepsItsPlaceInTheFrame) {
+	std::string path = (std::filesystem::temp_directory_path() / "crop.raw").string();
+	Canvas full = gradientCanvas(20, 10, 0.5f);
+	PixelRect region{ 3, 2, 11, 7 };
+	CropCanvas crop(20, 10, region);
+	Canvas pixels = copy_region(full, region);
+	crop.canvas.swap_pixels(pixels);
+	write_raw_canvas(path, crop, 2);
+	Canvas loaded(20, 10);
+	RawCanvasHeader h = read_raw_canvas(path, loaded);
+	ASSERT_EQ(h.x0, 3u);
+	ASSERT_EQ(h.width, 8u);
+	ASSERT_EQ(h.weight, 2);
+	ASSERT_EQ(loaded.read_pixel(3, 2), full.read_pixel(3, 2));
+	ASSERT_EQ(loaded.read_pixel(10, 6), full.read_pixel(10, 6));
+	ASSERT_EQ(loaded.read_pixel(2, 2), color(0, 0, 0));
+	std::filesystem::remove(path);
+}
+
+TEST(Y4M, regionOfALargerCanvas) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	std::string whole = (dir / "region-copy.y4m").string(), direct = (dir / "region-direct.y4m").string();
+	std::string tiled = (dir / "region-tiled.y4m").string();
+	Canvas full = gradientCanvas(20, 10, 0.05f);
+	PixelRect region{ 1, 3, 18, 8 };
+	{
+		Y4MWriter a(whole, 17, 5), b(direct, 17, 5), c(tiled, 17, 5);
+		a.write_frame(copy_region(full, region));
+		b.write_frame(full, region);
+		c.write_frame(gradientCanvas(20, 10, 0.05f, CanvasLayout::TILED), region);
+		ASSERT_THROW(b.write_frame(full, PixelRect{ 4, 3, 21, 8 }), Y4MError);
+		a.close();
+		b.close();
+		c.close();
+	}
+	auto contents = [](const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	};
+	ASSERT_EQ(contents(whole), contents(direct));
+	ASSERT_EQ(contents(whole), contents(tiled));
+	std::filesystem::remove(whole);
+	std::filesystem::remove(direct);
+	std::filesystem::remove(tiled);
+}
+
+TEST(Budget, generousBudgetMatchesRender) {
+	BinnedSpheres scene = binnedSpheres();
+	RenderSettings settings;
+	settings.threads = 2;
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject, settings);
+
+	BudgetSettings budget;
+	budget.budget = std::chrono::seconds(30);
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	BudgetStats stats = render_budgeted(scene.camera, scene.bins, canvas, shadeByObject, settings, budget);
+	ASSERT_EQ(stats.refined_tiles, scene.bins.grid.count());
+	ASSERT_EQ(stats.coarse_tiles, scene.bins.grid.count());
+	ASSERT_EQ(stats.coverage, 1.f);
+	ASSERT_TRUE(sameBits(canvas, expected));
+
+	budget.budget = std::chrono::milliseconds(0);
+	stats = render_budgeted(scene.camera, scene.bins, canvas, shadeByObject, settings, budget);
+	ASSERT_EQ(stats.coarse_tiles, 0u);
+	ASSERT_EQ(stats.refined_tiles, 0u);
+	ASSERT_EQ(stats.coarse_coverage, 0.f);
+}
+
+TEST(Budget, stopsAtDeadlineWithCoarseFill) {
+	BinnedSpheres scene = binnedSpheres();
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject);
+
+	// The coarse pass traces 48 rays, about 10 ms; a whole tile 256, more than the budget
+	auto slow = [](const Ray& ray, const BatchHit& hit) {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		return shadeByObject(ray, hit);
+	};
+	BudgetSettings budget;
+	budget.budget = std::chrono::milliseconds(40);
+	Canvas canvas(scene.camera.hsize, scene.camera.vsize);
+	BudgetStats stats = render_budgeted(scene.camera, scene.bins, canvas, slow, RenderSettings{}, budget);
+	ASSERT_EQ(stats.coarse_tiles, scene.bins.grid.count());
+	ASSERT_EQ(stats.coarse_coverage, 1.f);
+	ASSERT_GE(stats.refined_tiles, 1u);
+	ASSERT_LT(stats.refined_tiles, scene.bins.grid.count());
+	ASSERT_LT(stats.coverage, 1.f);
+	ASSERT_LT(stats.elapsed, std::chrono::milliseconds(1000));
+
+	// Refined tiles from the middle out, the rest filled by 8x8 blocks
+	std::vector<std::size_t> order = center_out_tiles(scene.bins.grid);
+	for (std::size_t i = 0; i < order.size(); ++i) {
+		PixelRect r = scene.bins.grid.tile(order[i]);
+		for (std::size_t y = r.y0; y < r.y1; ++y) {
+			for (std::size_t x = r.x0; x < r.x1; ++x) {
+				if (i < stats.refined_tiles) {
+					ASSERT_EQ(canvas.read_pixel(x, y), expected.read_pixel(x, y));
+					continue;
+				}
+				std::size_t bx = x - (x - r.x0) % 8, by = y - (y - r.y0) % 8;
+				std::size_t cx = (bx + std::min(bx + 8, r.x1)) / 2, cy = (by + std::min(by + 8, r.y1)) / 2;
+				ASSERT_EQ(canvas.read_pixel(x, y), expected.read_pixel(cx, cy));
+			}
+		}
+	}
+}
+
+TEST(RenderJob, reportsProgressAndFinishes) {
+	BinnedSpheres scene = binnedSpheres(8);
+	RenderSettings settings;
+	settings.threads = 3;
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject, settings);
+
+	std::vector<std::size_t> reported;
+	RenderJob job(scene.camera, scene.bins, shadeByObject, settings, [&](std::size_t done, std::size_t total) {
+		ASSERT_EQ(total, scene.bins.grid.count());
+		reported.push_back(done);
+	});
+	ASSERT_TRUE(job.wait());
+	ASSERT_EQ(job.state(), JobState::FINISHED);
+	ASSERT_EQ(job.tiles_done(), job.tiles_total());
+	ASSERT_EQ(reported.size(), scene.bins.grid.count());
+	for (std::size_t i = 0; i < reported.size(); ++i)
+		ASSERT_EQ(reported[i], i + 1);
+	ASSERT_TRUE(sameBits(job.canvas(), expected));
+	ASSERT_TRUE(sameBits(job.snapshot(), expected));
+}
+
+TEST(RenderJob, cancelStopsWithinATile) {
+	BinnedSpheres scene = binnedSpheres();
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject);
+
+	// About 25 ms a tile
+	auto slow = [](const Ray& ray, const BatchHit& hit) {
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+		return shadeByObject(ray, hit);
+	};
+	RenderSettings settings;
+	settings.threads = 2;
+	RenderJob job(scene.camera, scene.bins, slow, settings);
+	ASSERT_FALSE(job.wait_for(std::chrono::milliseconds(0)));
+	while (job.tiles_done() == 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	std::size_t at_cancel = job.tiles_done();
+	job.cancel();
+	ASSERT_FALSE(job.wait());
+	ASSERT_EQ(job.state(), JobState::CANCELLED);
+	// Only the tiles already started finish
+	ASSERT_LE(job.tiles_done(), at_cancel + settings.threads);
+	ASSERT_LT(job.tiles_done(), job.tiles_total());
+
+	Canvas partial = job.snapshot();
+	std::size_t finished = 0;
+	for (std::size_t t = 0; t < scene.bins.grid.count(); ++t) {
+		PixelRect r = scene.bins.grid.tile(t);
+		bool same = true, black = true;
+		for (std::size_t y = r.y0; y < r.y1; ++y) {
+			for (std::size_t x = r.x0; x < r.x1; ++x) {
+				same = same && partial.read_pixel(x, y) == expected.read_pixel(x, y);
+				black = black && partial.read_pixel(x, y) == color(0, 0, 0);
+			}
+		}
+		ASSERT_TRUE(same || black) << t;
+		finished += same && !black;
+	}
+	ASSERT_GE(finished, 1u);
+}
+
+TEST(RenderJob, shadeErrorsFailTheJob) {
+	BinnedSpheres scene = binnedSpheres();
+	auto failing = [](const Ray& ray, const BatchHit& hit) {
+		if (hit.hit())
+			throw RawCanvasError{ "out of texture memory" };
+		return shadeByObject(ray, hit);
+	};
+	RenderSettings settings;
+	settings.threads = 2;
+	RenderJob job(scene.camera, scene.bins, failing, settings);
+	ASSERT_THROW(job.wait(), RawCanvasError);
+	ASSERT_EQ(job.state(), JobState::FAILED);
+	ASSERT_LT(job.tiles_done(), job.tiles_total());
+}
+
+TEST(PagedCanvas, matchesInMemoryRender) {
+	BinnedSpheres scene = binnedSpheres(8);
+	RenderSettings settings;
+	settings.samples = 2;
+	settings.threads = 2;
+	Canvas expected(scene.camera.hsize, scene.camera.vsize);
+	render(scene.camera, scene.bins, expected, shadeByObject, settings);
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	std::string path = (dir / "paged.tiles").string();
+	std::string raw = (dir / "paged.raw").string(), ppm = (dir / "paged.ppm").string();
+	{
+		PagedCanvas paged(path, scene.camera.hsize, scene.camera.vsize, 8);
+		render_paged(scene.camera, scene.bins, paged, shadeByObject, settings);
+		ASSERT_EQ(paged.tiles_written(), scene.bins.grid.count());
+		ASSERT_TRUE(sameBits(paged.read_rows(0, scene.camera.vsize), expected));
+		ASSERT_TRUE(sameBits(paged.read_rows(5, 21), copy_region(expected, PixelRect{ 0, 5, scene.camera.hsize, 21 })));
+
+		write_raw_canvas(raw, paged, 2);
+		Canvas loaded(scene.camera.hsize, scene.camera.vsize);
+		ASSERT_EQ(read_raw_canvas(raw, loaded).weight, 2);
+		ASSERT_TRUE(sameBits(loaded, expected));
+		write_plain_ppm(ppm, paged);
+		std::ifstream file(ppm, std::ios::binary);
+		std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		ASSERT_EQ(contents, CanvasToPPM(expected, 255).toPlainPPM());
+	}
+	ASSERT_FALSE(std::filesystem::exists(path));
+	std::filesystem::remove(raw);
+	std::filesystem::remove(ppm);
+}
+
+TEST(PagedCanvas, unwrittenTilesTakeNoSpace) {
+	std::string path = (std::filesystem::temp_directory_path() / "sparse.tiles").string();
+	PagedCanvas paged(path, 4096, 4096);
+	ASSERT_EQ(paged.file_size(), 4096ull * 4096 * 3 * sizeof(float));
+	ASSERT_EQ(std::filesystem::file_size(path), paged.file_size());
+	std::size_t tile = paged.grid().count() / 2 + 3;
+	Canvas pixels = gradientCanvas(TILE_SIZE, TILE_SIZE, 0.06f);
+	paged.write_tile(tile, pixels);
+	ASSERT_TRUE(sameBits(paged.read_tile(tile), pixels));
+	ASSERT_TRUE(sameBits(paged.read_tile(tile + 1), Canvas(TILE_SIZE, TILE_SIZE)));
+	ASSERT_THROW(PagedCanvas((std::filesystem::temp_directory_path() / "missing" / "x.tiles").string(), 16, 16), PagedCanvasError);
+#ifndef _WIN32
+	// 192 MB in size, but only the written tile is on disk
+	struct stat info;
+	ASSERT_EQ(stat(path.c_str(), &info), 0);
+	ASSERT_LT(static_cast<std::uint64_t>(info.st_blocks) * 512, 1u << 20);
+#endif
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include "lib.h"
+#include "scene.h"
+#include "camera.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "frame_pipeline.h"
+
+// Renders a sequence of frames of one scene. The threads, tile bins and canvases
+// live for the whole sequence: between frames only the moved objects are rebinned
+// and only the tiles they touch are re-rendered, and finished frames are encoded by
+// a FramePipeline while the next ones render.
+
+// What an update changed since the last frame
+struct FrameChanges {
+	// Indices of objects moved with Scene::set_transform
+	std::vector<std::size_t> moved;
+	// The camera moved, so every object is rebinned and every tile rendered
+	bool camera_moved = false;
+};
+
+struct SequenceSettings {
+	// render.pool is ignored; the sequence makes a pool of render.threads threads
+	RenderSettings render;
+	// Above this fraction of the objects moving in one frame, the bins are rebuilt
+	// rather than updated object by object
+	float rebuild_fraction = 0.25f;
+	// Finished frames waiting to be encoded before rendering waits for the encoder
+	std::size_t queue_depth = 2;
+};
+
+struct SequenceStats {
+	std::size_t frames = 0;
+	std::size_t tiles_rendered = 0;
+	// Frames binned from scratch, including the first
+	std::size_t rebuilds = 0;
+	// Frames that rebinned only their moved objects
+	std::size_t refits = 0;
+};
+
+// Renders frames [0, frames). update(frame, scene, camera, changes) poses a frame
+// by moving objects and the camera and recording what it moved. encode(frame, canvas)
+// gets each finished frame, in order, on a background thread; the canvas is only
+// valid until it returns. The canvas is the camera's size, and shade is called as
+// by render(). An exception from encode is rethrown here, stopping the sequence
+// within settings.queue_depth + 1 frames of the one that failed.
+template<class Update, class Shade, class Encode>
+SequenceStats render_sequence(Scene& scene, Camera& camera, std::size_t frames, Update&& update, Shade&& shade, Encode&& encode,
+	const SequenceSettings& settings = {}) {
+	TileGrid grid{ camera.hsize, camera.vsize };
+	Canvas current(grid.width, grid.height);
+	Canvas finished(grid.width, grid.height, current.layout);
+	TileBins bins{ grid };
+	TileBins spare{ grid };
+	std::vector<std::size_t> everything = hilbert_tiles(grid);
+	// The calling thread renders too
+	ThreadPool pool(std::max(1u, settings.render.threads) - 1);
+	FramePipeline pipeline(grid.width, grid.height, [&encode](std::size_t frame, const Canvas& canvas) {
+		encode(frame, canvas);
+	}, settings.queue_depth);
+	RenderSettings render_settings = settings.render;
+	render_settings.pool = &pool;
+
+	SequenceStats stats;
+	FrameChanges changes;
+	for (std::size_t frame = 0; frame < frames; ++frame) {
+		changes.moved.clear();
+		changes.camera_moved = false;
+		update(frame, scene, camera, changes);
+
+		SphereBatchView batch = scene.batch.view();
+		std::vector<std::size_t> updated;
+		const std::vector<std::size_t>* tiles = &updated;
+		if (frame == 0 || changes.camera_moved || changes.moved.size() > settings.rebuild_fraction * batch.count) {
+			bins = bin_objects(camera, grid, batch);
+			tiles = &everything;
+			++stats.rebuilds;
+		}
+		else if (!changes.moved.empty()) {
+			updated = update_bins(camera, bins, batch, changes.moved, spare);
+			++stats.refits;
+		}
+		for_each_tile(*tiles, render_settings, [&](std::size_t t) {
+			render_tile(camera, bins, t, current, shade, render_settings);
+		});
+		stats.tiles_rendered += tiles->size();
+
+		// `current` carries over to the next frame, so the pipeline gets a copy
+		std::copy(current.canvas, current.canvas + current.size(), finished.canvas);
+		pipeline.submit(frame, finished);
+		++stats.frames;
+	}
+	pipeline.finish();
+	return stats;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include "lib.h"
+#include "render.h"
+
+// Previews within a time budget. A coarse pass traces one ray per block of pixels
+// and fills the block with it, then tiles are rendered properly, nearest the middle
+// of the frame first, until the budget runs out. Tiles that didn't get their turn
+// keep the coarse pass's blocks. The budget is checked between tiles, so a render
+// overruns it by at most one tile per thread.
+
+struct BudgetSettings {
+	std::chrono::milliseconds budget{ 50 };
+	// The coarse pass traces one ray per block of coarse_step x coarse_step pixels
+	std::size_t coarse_step = 8;
+};
+
+struct BudgetStats {
+	std::size_t coarse_tiles = 0;
+	std::size_t refined_tiles = 0;
+	std::size_t tiles = 0;
+	// Fractions of the frame's pixels from the coarse pass and from the refinement
+	float coarse_coverage = 0;
+	float coverage = 0;
+	std::chrono::microseconds elapsed{ 0 };
+};
+
+// The grid's tiles by the distance of their centres from the frame's centre
+std::vector<std::size_t> center_out_tiles(const TileGrid& grid) {
+	std::vector<std::size_t> tiles = all_tiles(grid);
+	auto distance = [&](std::size_t t) {
+		PixelRect r = grid.tile(t);
+		// Doubled coordinates keep half pixels exact
+		long long dx = static_cast<long long>(r.x0 + r.x1) - static_cast<long long>(grid.width);
+		long long dy = static_cast<long long>(r.y0 + r.y1) - static_cast<long long>(grid.height);
+		return dx * dx + dy * dy;
+	};
+	std::stable_sort(tiles.begin(), tiles.end(), [&](std::size_t a, std::size_t b) { return distance(a) < distance(b); });
+	return tiles;
+}
+
+// Traces the middle pixel of each step x step block of a tile and fills the block with it
+template<class Shade>
+void render_tile_coarse(const Camera& camera, const TileBins& bins, std::size_t tile, std::size_t step, Canvas& canvas, Shade&& shade) {
+	PixelRect r = bins.grid.tile(tile);
+	SphereBatchView objects = bins.view(tile);
+	const std::uint32_t* source = bins.objects.data() + bins.offsets[tile];
+	for (std::size_t by = r.y0; by < r.y1; by += step) {
+		std::size_t ey = std::min(by + step, r.y1);
+		RayRow row = camera.row((by + ey) / 2);
+		for (std::size_t bx = r.x0; bx < r.x1; bx += step) {
+			std::size_t ex = std::min(bx + step, r.x1);
+			Ray ray = row.at((bx + ex) / 2);
+			BatchHit hit = intersect_nearest(objects, ray);
+			if (hit.hit())
+				hit.index = source[hit.index];
+			Color c = shade(ray, hit);
+			for (std::size_t y = by; y < ey; ++y) {
+				for (std::size_t x = bx; x < ex; ++x)
+					canvas.write_pixel(x, y, c);
+			}
+		}
+	}
+}
+
+// render() that stops starting tiles once budget.budget has passed. The coarse pass
+// is held to the same deadline, so pixels of a frame too heavy for even that keep
+// what the canvas held.
+template<class Shade>
+BudgetStats render_budgeted(const Camera& camera, const TileBins& bins, Canvas& canvas, Shade&& shade,
+	const RenderSettings& settings, const BudgetSettings& budget) {
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + budget.budget;
+	std::vector<std::size_t> order = center_out_tiles(bins.grid);
+	std::size_t step = std::max<std::size_t>(1, budget.coarse_step);
+	std::atomic<std::size_t> coarse_pixels{ 0 }, refined_pixels{ 0 };
+	std::atomic<std::size_t> coarse_tiles{ 0 }, refined_tiles{ 0 };
+
+	auto pixels = [&](std::size_t t) {
+		PixelRect r = bins.grid.tile(t);
+		return r.width() * r.height();
+	};
+	for_each_tile(order, settings, [&](std::size_t t) {
+		if (std::chrono::steady_clock::now() >= deadline)
+			return;
+		render_tile_coarse(camera, bins, t, step, canvas, shade);
+		coarse_pixels += pixels(t);
+		++coarse_tiles;
+	});
+	for_each_tile(order, settings, [&](std::size_t t) {
+		if (std::chrono::steady_clock::now() >= deadline)
+			return;
+		render_tile(camera, bins, t, canvas, shade, settings);
+		refined_pixels += pixels(t);
+		++refined_tiles;
+	});
+
+	BudgetStats stats;
+	stats.coarse_tiles = coarse_tiles;
+	stats.refined_tiles = refined_tiles;
+	stats.tiles = order.size();
+	float total = static_cast<float>(bins.grid.width * bins.grid.height);
+	stats.coarse_coverage = coarse_pixels / total;
+	stats.coverage = refined_pixels / total;
+	stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	return stats;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "lib.h"
+#include "scene.h"
+
+// Camera space looks down -z with +y up. Pixel (0, 0) is the top left corner and
+// rays go through pixel centers.
+
+enum class Projection {
+	PERSPECTIVE,
+	ORTHOGRAPHIC,
+};
+
+// Orients the world so the eye is at `from` looking at `to`. Rigid, since the basis
+// is normalized even when `up` isn't perpendicular to the line of sight.
+AffineTransform view_transform(const Point& from, const Point& to, const Vector& up) {
+	Vector forward = (to - from).normalize();
+	Vector left = forward.cross(up.normalize()).normalize();
+	Vector true_up = left.cross(forward);
+	return AffineTransform({
+		{ left.x, left.y, left.z, -left.dot(from) },
+		{ true_up.x, true_up.y, true_up.z, -true_up.dot(from) },
+		{ -forward.x, -forward.y, -forward.z, forward.dot(from) },
+	}, TransformKind::RIGID);
+}
+
+// The rays for one row of pixels. Pixel px is reached by stepping from pixel 0, so
+// producing a ray costs a multiply-add (and a normalize for perspective) instead of
+// a matrix product.
+struct RayRow {
+	Projection projection;
+	Point origin;      // of pixel 0
+	Vector direction;  // of pixel 0; not normalized for perspective
+	Vector step;       // per pixel: added to the direction (perspective) or the origin (orthographic)
+	Vector rise;       // like step, but one pixel down the canvas
+
+	// Through the center of pixel px
+	Ray at(std::size_t px) const;
+	// Through (u, v) within pixel px, where (0.5, 0.5) is the center
+	Ray at(std::size_t px, float u, float v) const;
+};
+
+struct Camera {
+	std::size_t hsize, vsize;
+	Projection projection;
+	// Perspective: the angle across the longer side of the canvas.
+	// Orthographic: the width in world units across the longer side.
+	float field_of_view;
+	float half_width, half_height;
+	float pixel_size;
+
+	Camera(std::size_t hsize, std::size_t vsize, float field_of_view, Projection projection = Projection::PERSPECTIVE);
+	// A perspective camera placed by a scene file's camera line
+	Camera(std::size_t hsize, std::size_t vsize, const CameraSettings& settings);
+
+	// World to camera space
+	const AffineTransform& get_transform() const;
+	// The only way to change the transform, so its inverse stays in sync
+	void set_transform(const AffineTransform& t);
+	Ray ray_for_pixel(std::size_t px, std::size_t py) const;
+	RayRow row(std::size_t py) const;
+private:
+	AffineTransform transform;
+	AffineTransform inverse_transform;
+};
+
+Ray RayRow::at(std::size_t px) const {
+	float x = static_cast<float>(px);
+	if (projection == Projection::PERSPECTIVE)
+		return Ray{ origin, (direction + step * x).normalize() };
+	return Ray{ origin + step * x, direction };
+}
+
+Ray RayRow::at(std::size_t px, float u, float v) const {
+	Vector offset = step * (static_cast<float>(px) + u - 0.5f) + rise * (v - 0.5f);
+	if (projection == Projection::PERSPECTIVE)
+		return Ray{ origin, (direction + offset).normalize() };
+	return Ray{ origin + offset, direction };
+}
+
+Camera::Camera(std::size_t hsize, std::size_t vsize, float field_of_view, Projection projection)
+	: hsize{ hsize }, vsize{ vsize }, projection{ projection }, field_of_view{ field_of_view } {
+	float half_view = projection == Projection::PERSPECTIVE ? std::tan(field_of_view / 2) : field_of_view / 2;
+	float aspect = static_cast<float>(hsize) / static_cast<float>(vsize);
+	if (aspect >= 1) {
+		half_width = half_view;
+		half_height = half_view / aspect;
+	}
+	else {
+		half_width = half_view * aspect;
+		half_height = half_view;
+	}
+	pixel_size = half_width * 2 / hsize;
+	set_transform(Transform::identity);
+}
+
+Camera::Camera(std::size_t hsize, std::size_t vsize, const CameraSettings& settings)
+	: Camera(hsize, vsize, settings.field_of_view) {
+	set_transform(view_transform(settings.from, settings.to, settings.up));
+}
+
+const AffineTransform& Camera::get_transform() const {
+	return transform;
+}
+
+void Camera::set_transform(const AffineTransform& t) {
+	transform = t;
+	inverse_transform = t.inverse();
+}
+
+Ray Camera::ray_for_pixel(std::size_t px, std::size_t py) const {
+	float x = half_width - (px + 0.5f) * pixel_size;
+	float y = half_height - (py + 0.5f) * pixel_size;
+	if (projection == Projection::PERSPECTIVE) {
+		Point origin = inverse_transform * point(0, 0, 0);
+		Point pixel = inverse_transform * point(x, y, -1);
+		return Ray{ origin, (pixel - origin).normalize() };
+	}
+	return Ray{ inverse_transform * point(x, y, 0), (inverse_transform * vector(0, 0, -1)).normalize() };
+}
+
+RayRow Camera::row(std::size_t py) const {
+	float x = half_width - 0.5f * pixel_size;
+	float y = half_height - (py + 0.5f) * pixel_size;
+	Vector step = inverse_transform * vector(-pixel_size, 0, 0);
+	Vector rise = inverse_transform * vector(0, -pixel_size, 0);
+	if (projection == Projection::PERSPECTIVE) {
+		Point origin = inverse_transform * point(0, 0, 0);
+		return RayRow{ projection, origin, inverse_transform * point(x, y, -1) - origin, step, rise };
+	}
+	return RayRow{ projection, inverse_transform * point(x, y, 0), (inverse_transform * vector(0, 0, -1)).normalize(), step, rise };
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include "lib.h"
+#include "render.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Checkpoints of a render in progress, so a killed render resumes where it stopped.
+// A checkpoint holds which tiles are finished and their pixels:
+//
+//   CheckpointHeader
+//   uint8[tile count]                   1 for finished tiles
+//   float[3] per pixel of each finished tile, tiles in index order, rows top to bottom
+//
+// Each checkpoint is written to a temporary file, flushed to disk and renamed over
+// the last one, so a kill or power loss mid-write leaves the previous checkpoint intact.
+
+constexpr char CHECKPOINT_MAGIC[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', '\0' };
+constexpr std::uint32_t CHECKPOINT_VERSION = 1;
+
+// Whether the file's data reached the disk
+bool sync_file(const std::string& path) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	bool synced = FlushFileBuffers(file) != 0;
+	CloseHandle(file);
+	return synced;
+#else
+	int fd = open(path.c_str(), O_WRONLY);
+	if (fd < 0)
+		return false;
+	bool synced = fsync(fd) == 0;
+	close(fd);
+	return synced;
+#endif
+}
+
+// Makes a rename into `directory` survive power loss. NTFS journals renames, so
+// there is nothing to do on Windows.
+void sync_directory(const std::filesystem::path& directory) {
+#ifndef _WIN32
+	int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+#endif
+}
+
+struct CheckpointHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t tile_size;
+	std::uint64_t width, height;
+	// Identifies the render (scene, camera, settings); a checkpoint with another key isn't resumed
+	std::uint64_t key;
+	std::uint64_t tiles_done;
+};
+
+// Fills `canvas` with the finished tiles of the checkpoint at `path` and returns the
+// per-tile finished flags. Returns no tiles finished when there is no checkpoint, or
+// when it is damaged or belongs to another render.
+std::vector<char> load_checkpoint(const std::string& path, const TileGrid& grid, std::uint64_t key, Canvas& canvas) {
+	std::vector<char> none(grid.count(), 0);
+	std::ifstream file(path, std::ios::binary);
+	CheckpointHeader h{};
+	if (!file.read(reinterpret_cast<char*>(&h), sizeof(h))
+		|| std::memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0
+		|| h.version != CHECKPOINT_VERSION
+		|| h.tile_size != grid.tile_size || h.width != grid.width || h.height != grid.height
+		|| h.key != key)
+		return none;
+
+	std::vector<char> done(grid.count());
+	if (!file.read(done.data(), static_cast<std::streamsize>(done.size())))
+		return none;
+	std::vector<float> pixels;
+	for (std::size_t t = 0; t < grid.count(); ++t) {
+		if (!done[t])
+			continue;
+		PixelRect r = grid.tile(t);
+		pixels.resize(3 * (r.x1 - r.x0) * (r.y1 - r.y0));
+		if (!file.read(reinterpret_cast<char*>(pixels.data()), static_cast<std::streamsize>(pixels.size() * sizeof(float))))
+			return none;
+		const float* p = pixels.data();
+		for (std::size_t y = r.y0; y < r.y1; ++y) {
+			for (std::size_t x = r.x0; x < r.x1; ++x, p += 3)
+				canvas.write_pixel(x, y, color(p[0], p[1], p[2]));
+		}
+	}
+	return done;
+}
+
+// Writes checkpoints of `canvas` from a background thread every `interval`, so render
+// threads only pay for marking a tile finished. A tile's pixels are read once it is
+// marked, and nothing writes them after that.
+class CheckpointWriter {
+public:
+	CheckpointWriter(const std::string& path, const Canvas& canvas, const TileGrid& grid, std::uint64_t key,
+		std::vector<char> done, std::chrono::milliseconds interval);
+	// Stops the background thread without writing again
+	~CheckpointWriter();
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	void tile_done(std::size_t tile);
+	// Writes a checkpoint now, on the calling thread, if anything finished since the last one
+	void flush();
+	std::size_t checkpoints_written() const;
+private:
+	const std::string path;
+	const Canvas& canvas;
+	const TileGrid grid;
+	const std::uint64_t key;
+	const std::chrono::milliseconds interval;
+
+	mutable std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<char> done;
+	std::size_t finished = 0;
+	std::size_t written = 0;       // `finished` at the last checkpoint
+	std::size_t checkpoints = 0;
+	bool stopping = false;
+	std::mutex write_mutex;        // one write at a time, from the thread or flush()
+	std::thread thread;
+
+	void run();
+	void write();
+};
+
+CheckpointWriter::CheckpointWriter(const std::string& path, const Canvas& canvas, const TileGrid& grid, std::uint64_t key,
+	std::vector<char> done, std::chrono::milliseconds interval)
+	: path{ path }, canvas{ canvas }, grid{ grid }, key{ key }, interval{ interval }, done{ std::move(done) } {
+	for (char d : this->done)
+		finished += d != 0;
+	written = finished;
+	thread = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+void CheckpointWriter::tile_done(std::size_t tile) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!done[tile]) {
+		done[tile] = 1;
+		++finished;
+	}
+}
+
+void CheckpointWriter::flush() {
+	write();
+}
+
+std::size_t CheckpointWriter::checkpoints_written() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return checkpoints;
+}
+
+void CheckpointWriter::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!wake.wait_for(lock, interval, [this]() { return stopping; })) {
+		lock.unlock();
+		write();
+		lock.lock();
+	}
+}
+
+void CheckpointWriter::write() {
+	std::lock_guard<std::mutex> writing(write_mutex);
+	std::vector<char> snapshot;
+	std::size_t count;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (finished == written && checkpoints > 0)
+			return;
+		snapshot = done;
+		count = finished;
+	}
+
+	CheckpointHeader h{};
+	std::memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.tile_size = static_cast<std::uint32_t>(grid.tile_size);
+	h.width = grid.width;
+	h.height = grid.height;
+	h.key = key;
+	h.tiles_done = count;
+
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		file.write(snapshot.data(), static_cast<std::streamsize>(snapshot.size()));
+		std::vector<float> pixels;
+		for (std::size_t t = 0; t < grid.count(); ++t) {
+			if (!snapshot[t])
+				continue;
+			PixelRect r = grid.tile(t);
+			pixels.clear();
+			for (std::size_t y = r.y0; y < r.y1; ++y) {
+				for (std::size_t x = r.x0; x < r.x1; ++x) {
+					Color c = canvas.read_pixel(x, y);
+					pixels.insert(pixels.end(), { c.x, c.y, c.z });
+				}
+			}
+			file.write(reinterpret_cast<const char*>(pixels.data()), static_cast<std::streamsize>(pixels.size() * sizeof(float)));
+		}
+		// A failed write keeps the previous checkpoint
+		file.close();
+		if (!file)
+			return;
+	}
+	// Without this the rename can reach the disk before the data, and a power loss
+	// leaves an empty or partial file in place of the previous checkpoint
+	if (!sync_file(temporary))
+		return;
+	std::error_code ignored;
+	std::filesystem::rename(temporary, path, ignored);
+	if (ignored)
+		return;
+	sync_directory(std::filesystem::path(path).parent_path());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	written = count;
+	++checkpoints;
+}
+
+struct CheckpointSettings {
+	std::string path;
+	std::uint64_t key = 0;
+	std::chrono::milliseconds interval{ 5000 };
+};
+
+struct ResumeStats {
+	std::size_t tiles_resumed;
+	std::size_t tiles_rendered;
+};
+
+// render() with checkpoints: resumes from settings.path if it holds a checkpoint of
+// this render, renders the missing tiles and checkpoints as they finish. The last
+// checkpoint is left in place; delete it once the output is safely written.
+template<class Shade>
+ResumeStats render_resumable(const Camera& camera, const TileBins& bins, Canvas& canvas, Shade&& shade,
+	const RenderSettings& settings, const CheckpointSettings& checkpoints) {
+	std::vector<char> done = load_checkpoint(checkpoints.path, bins.grid, checkpoints.key, canvas);
+	std::vector<std::size_t> missing;
+	for (std::size_t t : hilbert_tiles(bins.grid)) {
+		if (!done[t])
+			missing.push_back(t);
+	}
+
+	CheckpointWriter writer(checkpoints.path, canvas, bins.grid, checkpoints.key, std::move(done), checkpoints.interval);
+	for_each_tile(missing, settings, [&](std::size_t t) {
+		render_tile(camera, bins, t, canvas, shade, settings);
+		writer.tile_done(t);
+	});
+	writer.flush();
+	return ResumeStats{ bins.grid.count() - missing.size(), missing.size() };
+}
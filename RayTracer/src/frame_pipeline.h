@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "lib.h"
+
+// Encodes and writes finished frames on a background thread, so rendering the next
+// frame starts as soon as the last one is handed over. Handing a frame over swaps
+// its pixels for a buffer the pipeline has finished with, so a steady stream of
+// frames reuses the same few buffers instead of allocating one per frame. At most
+// `depth` frames wait to be written; handing over another blocks until one is done.
+class FramePipeline {
+public:
+	typedef std::function<void(std::size_t frame, const Canvas& canvas)> Write;
+
+	FramePipeline(std::size_t width, std::size_t height, Write write, std::size_t depth = 2);
+	// Writes the frames still queued, then stops. Write errors are lost; call finish() to see them.
+	~FramePipeline();
+	FramePipeline(const FramePipeline&) = delete;
+	FramePipeline& operator=(const FramePipeline&) = delete;
+
+	// Queues canvas's pixels as `frame` and gives `canvas` a free buffer, holding some
+	// earlier frame, to render the next one into. Every canvas handed over must have
+	// the pipeline's size and the same layout. Blocks while `depth` frames are
+	// queued. Rethrows the exception of a failed write, after which nothing more is
+	// written.
+	void submit(std::size_t frame, Canvas& canvas);
+	// Waits until every queued frame is written, rethrowing a write's exception
+	void finish();
+	std::size_t frames_written() const;
+	// Buffers allocated so far, counting none for the caller's own canvas
+	std::size_t buffers() const;
+private:
+	const std::size_t width, height;
+	const Write write;
+	const std::size_t depth;
+
+	mutable std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::pair<std::size_t, Canvas>> queue;
+	std::vector<Canvas> spare;
+	std::size_t allocated = 0;
+	std::size_t written = 0;
+	bool writing = false;
+	bool stopping = false;
+	std::exception_ptr error;
+	std::thread thread;
+
+	void run();
+	void rethrow(std::unique_lock<std::mutex>& lock);
+};
+
+FramePipeline::FramePipeline(std::size_t width, std::size_t height, Write write, std::size_t depth)
+	: width{ width }, height{ height }, write{ std::move(write) }, depth{ std::max<std::size_t>(1, depth) } {
+	thread = std::thread(&FramePipeline::run, this);
+}
+
+FramePipeline::~FramePipeline() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	thread.join();
+}
+
+void FramePipeline::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+		if (queue.empty())
+			return;
+		std::pair<std::size_t, Canvas> next = std::move(queue.front());
+		queue.pop_front();
+		writing = true;
+		lock.unlock();
+		std::exception_ptr failed;
+		if (!error) {
+			try {
+				write(next.first, next.second);
+			}
+			catch (...) {
+				failed = std::current_exception();
+			}
+		}
+		lock.lock();
+		writing = false;
+		if (failed)
+			error = failed;
+		else if (!error)
+			++written;
+		spare.push_back(std::move(next.second));
+		changed.notify_all();
+	}
+}
+
+void FramePipeline::rethrow(std::unique_lock<std::mutex>& lock) {
+	if (!error)
+		return;
+	std::exception_ptr e = error;
+	lock.unlock();
+	std::rethrow_exception(e);
+}
+
+void FramePipeline::submit(std::size_t frame, Canvas& canvas) {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this]() { return queue.size() < depth || error; });
+	rethrow(lock);
+	if (spare.empty()) {
+		++allocated;
+		spare.emplace_back(width, height, canvas.layout);
+	}
+	Canvas queued = std::move(spare.back());
+	spare.pop_back();
+	queued.swap_pixels(canvas);
+	queue.emplace_back(frame, std::move(queued));
+	changed.notify_all();
+}
+
+void FramePipeline::finish() {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this]() { return (queue.empty() && !writing) || error; });
+	rethrow(lock);
+}
+
+std::size_t FramePipeline::frames_written() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return written;
+}
+
+std::size_t FramePipeline::buffers() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return allocated;
+}
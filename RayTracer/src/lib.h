@@ -10,6 +10,7 @@
 #include <cassert>
 #include <cstdarg>
 #include <algorithm>
+#include <atomic>
 
 #define EPSILON 0.00001
 
@@ -29,75 +30,228 @@ typedef struct Tuple {
 	Tuple(Tuple&& other) = default;
 	~Tuple() = default;
 
-	bool isPoint() const;
-	bool isVector() const;
+	constexpr bool isPoint() const;
+	constexpr bool isVector() const;
 
-	bool operator==(const Tuple& other) const;
-	Tuple& operator=(const Tuple& other);
-	Tuple operator+(const Tuple& other) const;
-	Tuple operator-(const Tuple& other) const;
-	Tuple operator*(float other) const;
-	Tuple operator/(float other) const;
-	Tuple operator-() const;
+	constexpr bool operator==(const Tuple& other) const;
+	constexpr Tuple& operator=(const Tuple& other);
+	constexpr Tuple operator+(const Tuple& other) const;
+	constexpr Tuple operator-(const Tuple& other) const;
+	constexpr Tuple operator*(float other) const;
+	constexpr Tuple operator/(float other) const;
+	constexpr Tuple operator-() const;
 	float magnitude() const;
 	Tuple normalize() const;
-	Tuple cross(const Tuple& other) const;
-	float dot(const Tuple& other) const;
-	Tuple schur(const Tuple& other) const;
+	constexpr Tuple cross(const Tuple& other) const;
+	constexpr float dot(const Tuple& other) const;
+	constexpr Tuple schur(const Tuple& other) const;
 	RGB getRGB();
 } Point, Vector, Color;
 
+// What a transform is known to be, from most to least specialized. The Transform
+// builders and products maintain it, and inverse() and Ray::transform() use it to
+// skip work: a translation inverts by negating, a scaling by reciprocals and a rigid
+// transform by transposing. GENERAL is always a safe answer, so set() resets it
+// (to AFFINE for an AffineTransform, whose bottom row can't change); operator[]
+// only reads, and code that keeps the kind right writes `elements` directly.
+enum class TransformKind {
+	IDENTITY,
+	TRANSLATION,
+	SCALING, // axis-aligned, possibly non-uniform
+	TRANSLATION_SCALING,
+	RIGID, // rotation and translation
+	AFFINE, // bottom row is [0 0 0 1]
+	GENERAL
+};
+
+constexpr bool is_axis_aligned(TransformKind k) {
+	return k == TransformKind::IDENTITY || k == TransformKind::TRANSLATION
+		|| k == TransformKind::SCALING || k == TransformKind::TRANSLATION_SCALING;
+}
+
+constexpr bool is_rigid(TransformKind k) {
+	return k == TransformKind::IDENTITY || k == TransformKind::TRANSLATION || k == TransformKind::RIGID;
+}
+
+// The kind of a * b
+constexpr TransformKind compose(TransformKind a, TransformKind b) {
+	if (a == TransformKind::IDENTITY)
+		return b;
+	if (b == TransformKind::IDENTITY)
+		return a;
+	if (a == TransformKind::GENERAL || b == TransformKind::GENERAL)
+		return TransformKind::GENERAL;
+	if (a == b && a != TransformKind::TRANSLATION_SCALING)
+		return a;
+	if (is_axis_aligned(a) && is_axis_aligned(b))
+		return TransformKind::TRANSLATION_SCALING;
+	if (is_rigid(a) && is_rigid(b))
+		return TransformKind::RIGID;
+	return TransformKind::AFFINE;
+}
+
 
 template<std::size_t N>
 struct Matrix {
 	typedef Matrix<4> Transform;
 	float elements[N][N];
+	TransformKind kind;
+	// Defined constexpr below, so it is constant-initialized
 	static const Transform identity;
-	static Transform translation(float x, float y, float z);
-	static Transform scaling(float x, float y, float z);
+	static constexpr Transform translation(float x, float y, float z);
+	static constexpr Transform scaling(float x, float y, float z);
+	// The rotations need std::sin/std::cos, which are not constexpr
 	static Transform rotation_x(float radians);
 	static Transform rotation_y(float radians);
 	static Transform rotation_z(float radians);
-	static Transform shearing(float xy, float xz, float yx, float yz, float zx, float zy);
+	static constexpr Transform shearing(float xy, float xz, float yx, float yz, float zx, float zy);
 
-	Transform translate(float x, float y, float z) const;
-	Transform scale(float x, float y, float z) const;
+	constexpr Transform translate(float x, float y, float z) const;
+	constexpr Transform scale(float x, float y, float z) const;
 	Transform rotate_x(float radians) const;
 	Transform rotate_y(float radians) const;
 	Transform rotate_z(float radians) const;
-	Transform shear(float xy, float xz, float yx, float yz, float zx, float zy) const;
-
-
-	Matrix();
-	Matrix(const float(&list)[N][N]);
-	Matrix(const Matrix<N> &m);
-
-	float* operator[](std::size_t row);
-	const float* operator[](std::size_t row) const;
-	bool operator==(const Matrix<N> other) const;
-	bool operator!=(Matrix<N> other) const;
-	Matrix<N> operator*(Matrix<N> other) const;
-	Tuple operator*(const Tuple& other) const;
-	Matrix<N> transpose() const;
-	float determinant() const;
-	Matrix<N - 1> submatrix(std::size_t row, std::size_t col) const;
-	float minor(std::size_t row, std::size_t col) const;
-	float cofactor(std::size_t row, std::size_t col) const;
-	bool invertible() const;
-	Matrix<N> inverse() const;
+	constexpr Transform shear(float xy, float xz, float yx, float yz, float zx, float zy) const;
+
+
+	constexpr Matrix();
+	constexpr Matrix(const float(&list)[N][N], TransformKind kind = TransformKind::GENERAL);
+	constexpr Matrix(const Matrix<N> &m);
+
+	constexpr const float* operator[](std::size_t row) const;
+	// Writes one element, after which the kind is no longer known
+	constexpr void set(std::size_t row, std::size_t column, float value);
+	constexpr bool operator==(const Matrix<N>& other) const;
+	constexpr bool operator!=(const Matrix<N>& other) const;
+	constexpr Matrix<N> operator*(const Matrix<N>& other) const;
+	constexpr Tuple operator*(const Tuple& other) const;
+	constexpr Matrix<N> transpose() const;
+	constexpr float determinant() const;
+	constexpr Matrix<N - 1> submatrix(std::size_t row, std::size_t col) const;
+	constexpr float minor(std::size_t row, std::size_t col) const;
+	constexpr float cofactor(std::size_t row, std::size_t col) const;
+	constexpr bool invertible() const;
+	constexpr Matrix<N> inverse() const;
 };
 
 typedef Matrix<4> Transform;
 
+template<std::size_t N>
+constexpr Matrix<N>::Matrix(const float(&list)[N][N], TransformKind kind) : elements{}, kind{ kind }
+{
+	static_assert(N >= 2, "Matrix must be at least 2x2.");
+	for (int x = 0; x < N; x++) {
+		for (int y = 0; y < N; y++) {
+			elements[x][y] = list[x][y];
+		}
+	}
+}
+
+template<std::size_t N>
+constexpr Matrix<N>::Matrix() : elements{}, kind{ TransformKind::GENERAL }
+{
+	static_assert(N >= 2, "Matrix must be at least 2x2.");
+}
+
+template<std::size_t N>
+constexpr Matrix<N>::Matrix(const Matrix<N> &m) : elements{}, kind{ m.kind }
+{
+	for (std::size_t x = 0; x < N; ++x) {
+		for (std::size_t y = 0; y < N; ++y) {
+			elements[x][y] = m[x][y];
+		}
+	}
+}
+
+// Defined ahead of everything that uses it; otherwise it is not usable in constant expressions
+template<std::size_t N>
+constexpr Matrix<4> Matrix<N>::identity = { {
+	{1.f, 0.f, 0.f, 0.f},
+	{0.f, 1.f, 0.f, 0.f},
+	{0.f, 0.f, 1.f, 0.f},
+	{0.f, 0.f, 0.f, 1.f}
+}, TransformKind::IDENTITY };
+
+// A Transform whose bottom row is always [0 0 0 1], which covers everything the
+// Transform builders produce. Only the top three rows are stored, so it is 48 bytes
+// instead of 64 and multiplying or inverting skips the constant row.
+struct AffineTransform {
+	float elements[3][4];
+	TransformKind kind;
+
+	constexpr AffineTransform();
+	constexpr AffineTransform(const float(&list)[3][4], TransformKind kind = TransformKind::AFFINE);
+	// Assumes m's bottom row is [0 0 0 1]
+	constexpr AffineTransform(const Transform& m);
+
+	constexpr Transform to_matrix() const;
+
+	constexpr const float* operator[](std::size_t row) const;
+	// Writes one element of the top three rows, after which the kind is no longer known
+	constexpr void set(std::size_t row, std::size_t column, float value);
+	constexpr bool operator==(const AffineTransform& other) const;
+	constexpr bool operator!=(const AffineTransform& other) const;
+	constexpr AffineTransform operator*(const AffineTransform& other) const;
+	constexpr Tuple operator*(const Tuple& other) const;
+	constexpr float determinant() const;
+	constexpr bool invertible() const;
+	constexpr AffineTransform inverse() const;
+};
+
+// Composes a chain of transforms in place. Each step is applied after the previous
+// ones, like the fluent Transform API, but costs a few row operations on the 3x4
+// accumulator instead of building a 4x4 temporary and a full product:
+//   AffineTransform t = TransformBuilder().rotate_x(r).scale(5, 5, 5).translate(10, 5, 7);
+// The steps return the builder by reference, so convert it within the same expression.
+struct TransformBuilder {
+	AffineTransform transform;
+
+	constexpr TransformBuilder();
+	constexpr TransformBuilder(const AffineTransform& start);
+
+	constexpr TransformBuilder& translate(float x, float y, float z);
+	constexpr TransformBuilder& scale(float x, float y, float z);
+	TransformBuilder& rotate_x(float radians);
+	TransformBuilder& rotate_y(float radians);
+	TransformBuilder& rotate_z(float radians);
+	constexpr TransformBuilder& shear(float xy, float xz, float yx, float yz, float zx, float zy);
+
+	constexpr AffineTransform build() const;
+	constexpr operator AffineTransform() const;
+};
+
+
+// How a Canvas stores its pixels. TILED keeps each 8x8 block of pixels together,
+// blocks row by row and pixels in Morton (Z) order within a block, so a 2x2 quad is
+// one cache line and a tile's writes touch a few blocks instead of one line per row.
+enum class CanvasLayout {
+	ROW_MAJOR,
+	TILED,
+};
+
+constexpr std::size_t CANVAS_BLOCK = 8;
 
 struct Canvas {
 	const std::size_t width;
 	const std::size_t height;
+	const CanvasLayout layout;
+	// Pixel (x, y) is canvas[index(x, y)]
 	Tuple* canvas;
 
-	Canvas(std::size_t width, std::size_t height);
+	Canvas(std::size_t width, std::size_t height, CanvasLayout layout = CanvasLayout::ROW_MAJOR);
+	Canvas(const Canvas& other);
+	Canvas(Canvas&& other) noexcept;
+	~Canvas();
+	Canvas& operator=(const Canvas&) = delete;
 	
+	// Exchanges pixels without copying them. Assumes `other` is the same size and layout.
+	void swap_pixels(Canvas& other);
+	// Pixels stored, counting a TILED canvas's padding out to whole blocks
+	std::size_t size() const;
 	std::size_t index(std::size_t x, std::size_t y) const;
+	// Row y, left to right. A ROW_MAJOR canvas returns its own storage; a TILED one
+	// gathers the row into `scratch`, which must hold `width` pixels.
+	const Tuple* row(std::size_t y, Tuple* scratch) const;
 	void write_pixel(std::size_t x, std::size_t y, Color c);
 	Color read_pixel(std::size_t x, std::size_t y) const;
 
@@ -107,30 +261,100 @@ struct Canvas {
 
 class CanvasToPPM {
 public:
-	CanvasToPPM(Canvas c, int maxval);
+	CanvasToPPM(const Canvas& c, int maxval);
 	std::string toPlainPPM();
+	// The pixel rows alone, so a frame can be written a strip of rows at a time after
+	// plainPPMHeader()
+	std::string toPlainPixels();
 private:
 	int line_length = 0;
 	const int max_line_length = 70; // including newline
-	const Canvas c;
+	const Canvas& c;
 	const int maxval;
 	std::string result;
 	void appendSampleStr(float sample);
 };
 
+// A block of ids [begin, end) reserved from an ObjectRegistry
+struct IdRange {
+	int begin, end;
+
+	int size() const {
+		return end - begin;
+	}
+};
+
+// Hands out object ids. The ids of one registry are dense, starting at 0, so they can
+// index per-object arrays. allocate() is safe from any thread. A loader creating many
+// objects can instead reserve a range up front and give object i the id begin + i, so
+// ids depend on the object's position in the scene rather than on thread scheduling.
+class ObjectRegistry {
+public:
+	int allocate() {
+		return next.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	IdRange allocate_range(int count) {
+		int begin = next.fetch_add(count, std::memory_order_relaxed);
+		return IdRange{ begin, begin + count };
+	}
+
+	// The number of ids handed out so far
+	int size() const {
+		return next.load(std::memory_order_relaxed);
+	}
+
+	// Used by objects constructed without an explicit id
+	static ObjectRegistry& global() {
+		static ObjectRegistry registry;
+		return registry;
+	}
+private:
+	std::atomic<int> next{ 0 };
+};
+
 struct Sphere {
-	Sphere() {
-		static int i = 0;
-		this->id = i++;
-		this->transform = Transform::identity;
+	Sphere() : Sphere(ObjectRegistry::global().allocate()) {}
+
+	explicit Sphere(int id) : id{ id } {
+		set_transform(Transform::identity);
 	}
 	
 	int id;
-	Transform transform;
+	AffineTransform inverse_transform;
+	// When the transform only translates, rotates and uniformly scales, the sphere is
+	// still a sphere in world space and intersect() solves against center/radius directly
+	bool analytic = false;
+	Point center;
+	float radius = 1.f;
+
+	const AffineTransform& get_transform() const {
+		return transform;
+	}
+
+	// The only way to change the transform, so the values derived from it stay in sync
+	void set_transform(const AffineTransform& t) {
+		transform = t;
+		inverse_transform = t.inverse();
+		center = Point{ t[0][3], t[1][3], t[2][3], 1.f };
+		if (is_rigid(t.kind)) {
+			analytic = true;
+			radius = 1.f;
+		}
+		else if (is_axis_aligned(t.kind)) {
+			radius = std::abs(t[0][0]);
+			analytic = radius == std::abs(t[1][1]) && radius == std::abs(t[2][2]);
+		}
+		else {
+			analytic = false;
+		}
+	}
 
 	bool operator==(const Sphere& other) const {
 		return id == other.id;
 	}
+private:
+	AffineTransform transform;
 };
 
 struct Ray {
@@ -141,9 +365,33 @@ struct Ray {
 		return origin + (direction * t);
 	}
 
-	Ray transform(Transform t) {
+	Ray transform(const Transform& t) const {
+		if (t.kind != TransformKind::GENERAL)
+			return transform(AffineTransform(t));
 		return Ray{ t * origin, t * direction };
 	}
+
+	// Translations leave the direction alone (its w is 0) and axis-aligned scalings
+	// are a multiply-add per component
+	Ray transform(const AffineTransform& t) const {
+		switch (t.kind) {
+		case TransformKind::IDENTITY:
+			return *this;
+		case TransformKind::TRANSLATION:
+			return Ray{
+				Tuple{ origin.x + t[0][3] * origin.w, origin.y + t[1][3] * origin.w, origin.z + t[2][3] * origin.w, origin.w },
+				direction
+			};
+		case TransformKind::SCALING:
+		case TransformKind::TRANSLATION_SCALING:
+			return Ray{
+				Tuple{ origin.x * t[0][0] + t[0][3] * origin.w, origin.y * t[1][1] + t[1][3] * origin.w, origin.z * t[2][2] + t[2][3] * origin.w, origin.w },
+				Tuple{ direction.x * t[0][0], direction.y * t[1][1], direction.z * t[2][2], direction.w }
+			};
+		default:
+			return Ray{ t * origin, t * direction };
+		}
+	}
 };
 
 struct Intersection {
@@ -171,31 +419,46 @@ struct Intersection {
 	}
 };
 
-Color color(float r, float g, float b) {
+constexpr Color color(float r, float g, float b) {
 	return Color{ r, g, b };
 }
 
-Tuple point(float x, float y, float z) {
+constexpr Tuple point(float x, float y, float z) {
 	return Point{ x, y, z, 1.0 };
 }
 
-Tuple vector(float x, float y, float z) {
+constexpr Tuple vector(float x, float y, float z) {
 	return Vector{ x, y, z, 0.0 };
 }
 
-std::vector<Intersection> intersect(Sphere sphere, Ray ray) {
-	std::vector<Intersection> xs{};
-	Ray r = ray.transform(sphere.transform.inverse());
-	Vector sphere_to_ray = r.origin - point(0, 0, 0);
-	float a = r.direction.dot(r.direction);
-	float b = 2 * r.direction.dot(sphere_to_ray);
-	float c = sphere_to_ray.dot(sphere_to_ray) - 1;
-	float discriminant = b * b - 4 * a * c;
+// Solves |origin + t * direction - center|^2 = radius^2 with the half-b form, where
+// sphere_to_ray = origin - center. Only one root is computed with the quadratic formula;
+// the other comes from t0 * t1 = c / a, which avoids cancellation when b^2 >> a * c.
+void intersect_quadratic(const Sphere& sphere, const Vector& sphere_to_ray, const Vector& direction, float radius, std::vector<Intersection>& xs) {
+	float a = direction.dot(direction);
+	float half_b = direction.dot(sphere_to_ray);
+	float c = sphere_to_ray.dot(sphere_to_ray) - radius * radius;
+	float discriminant = half_b * half_b - a * c;
 	if (discriminant < 0) {
+		return;
+	}
+	float q = -(half_b + std::copysign(std::sqrt(discriminant), half_b));
+	float t0 = q / a;
+	float t1 = (q != 0) ? c / q : t0;
+	xs.push_back(Intersection{ std::min(t0, t1), sphere });
+	xs.push_back(Intersection{ std::max(t0, t1), sphere });
+}
+
+// The t values are the same in world and object space, since the ray's direction is
+// transformed rather than normalized
+std::vector<Intersection> intersect(const Sphere& sphere, const Ray& ray) {
+	std::vector<Intersection> xs{};
+	if (sphere.analytic) {
+		intersect_quadratic(sphere, ray.origin - sphere.center, ray.direction, sphere.radius, xs);
 		return xs;
 	}
-	xs.push_back(Intersection{ (-b - sqrtf(discriminant)) / (2 * a), sphere });
-	xs.push_back(Intersection{ (-b + sqrtf(discriminant)) / (2 * a), sphere });
+	Ray r = ray.transform(sphere.inverse_transform);
+	intersect_quadratic(sphere, r.origin - point(0, 0, 0), r.direction, 1.f, xs);
 	return xs;
 }
 
@@ -215,7 +478,7 @@ void hit(std::vector<Intersection> xs, Intersection** i) {
 }
 
 template<class T>
-T clamp(T v, T a, T b) {
+constexpr T clamp(T v, T a, T b) {
 	if (v < a)
 		return a;
 	if (b < v)
@@ -223,33 +486,31 @@ T clamp(T v, T a, T b) {
 	return v;
 }
 
-template<std::size_t N>
-const Matrix<4> Matrix<N>::identity = { {
-	{1.f, 0.f, 0.f, 0.f},
-	{0.f, 1.f, 0.f, 0.f},
-	{0.f, 0.f, 1.f, 0.f},
-	{0.f, 0.f, 0.f, 1.f}
-} };
+// std::abs is not constexpr before C++23
+template<class T>
+constexpr T absolute(T v) {
+	return v < 0 ? -v : v;
+}
 
 template<std::size_t N>
-Transform Matrix<N>::translation(float x, float y, float z) {
+constexpr Transform Matrix<N>::translation(float x, float y, float z) {
 	Matrix result = { {
 		{1.f, 0.f, 0.f, x},
 		{0.f, 1.f, 0.f, y},
 		{0.f, 0.f, 1.f, z},
 		{0.f, 0.f, 0.f, 1.f}
-	}};
+	}, TransformKind::TRANSLATION };
 	return result;
 }
 
 template<std::size_t N>
-Transform Matrix<N>::scaling(float x, float y, float z) {
+constexpr Transform Matrix<N>::scaling(float x, float y, float z) {
 	Matrix result = { {
 		{x, 0.f, 0.f, 0.f},
 		{0.f, y, 0.f, 0.f},
 		{0.f, 0.f, z, 0.f},
 		{0.f, 0.f, 0.f, 1.f}
-	} };
+	}, TransformKind::SCALING };
 	return result;
 }
 
@@ -262,7 +523,7 @@ Transform Matrix<N>::rotation_x(float r) {
 		{0.f, b, -a, 0.f},
 		{0.f, a, b, 0.f},
 		{0.f, 0.f, 0.f, 1.f}
-	} };
+	}, TransformKind::RIGID };
 	return result;
 }
 
@@ -275,7 +536,7 @@ Transform Matrix<N>::rotation_y(float r) {
 		{0.f, 1.f, 0.f, 0.f},
 		{-a, 0.f, b, 0.f},
 		{0.f, 0.f, 0.f, 1.f}
-	} };
+	}, TransformKind::RIGID };
 	return result;
 }
 
@@ -288,93 +549,129 @@ Transform Matrix<N>::rotation_z(float r) {
 		{a, b, 0.f, 0.f},
 		{0.f, 0.f, 1.f, 0.f},
 		{0.f, 0.f, 0.f, 1.f}
-	} };
+	}, TransformKind::RIGID };
 	return result;
 }
 
 template<std::size_t N>
-Transform Matrix<N>::shearing(float xy, float xz, float yx, float yz, float zx, float zy) {
+constexpr Transform Matrix<N>::shearing(float xy, float xz, float yx, float yz, float zx, float zy) {
 	Matrix result = { {
 		{1.f, xy, xz, 0.f},
 		{yx, 1.f, yz, 0.f},
 		{zx, zy, 1.f, 0.f},
 		{0.f, 0.f, 0.f, 1.f}
-	} };
+	}, TransformKind::AFFINE };
 	return result;
 }
 
-template<std::size_t N>
-Transform Matrix<N>::translate(float x, float y, float z) const {
-	return Transform::translation(x, y, z) * (*this);
+// Pre-multiplying by a scaling, rotation or shearing matrix only recombines the top
+// three rows, so the fluent API and TransformBuilder apply these row operations in
+// place instead of multiplying by the full matrix. M is a Transform or AffineTransform.
+template<class M>
+constexpr void premultiply_scaling(M& m, float x, float y, float z) {
+	const float s[3] = { x, y, z };
+	for (std::size_t row = 0; row < 3; ++row) {
+		for (std::size_t col = 0; col < 4; ++col) {
+			m.elements[row][col] *= s[row];
+		}
+	}
 }
 
-template<std::size_t N>
-Transform Matrix<N>::scale(float x, float y, float z) const {
-	return Transform::scaling(x, y, z) * (*this);
+// Rotation in the plane of rows a and b: a' = cos * a - sin * b, b' = sin * a + cos * b
+template<class M>
+void premultiply_rotation(M& m, std::size_t a, std::size_t b, float r) {
+	float sin = std::sin(r);
+	float cos = std::cos(r);
+	for (std::size_t col = 0; col < 4; ++col) {
+		float ra = m.elements[a][col];
+		float rb = m.elements[b][col];
+		m.elements[a][col] = cos * ra - sin * rb;
+		m.elements[b][col] = sin * ra + cos * rb;
+	}
 }
 
-template<std::size_t N>
-Transform Matrix<N>::rotate_x(float r) const {
-	return Transform::rotation_x(r) * (*this);
+template<class M>
+constexpr void premultiply_shearing(M& m, float xy, float xz, float yx, float yz, float zx, float zy) {
+	for (std::size_t col = 0; col < 4; ++col) {
+		float x = m.elements[0][col];
+		float y = m.elements[1][col];
+		float z = m.elements[2][col];
+		m.elements[0][col] = x + xy * y + xz * z;
+		m.elements[1][col] = yx * x + y + yz * z;
+		m.elements[2][col] = zx * x + zy * y + z;
+	}
 }
 
+// Translation adds multiples of the bottom row, which may be anything in a general Transform
 template<std::size_t N>
-Transform Matrix<N>::rotate_y(float r) const {
-	return Transform::rotation_y(r) * (*this);
+constexpr Transform Matrix<N>::translate(float x, float y, float z) const {
+	Transform result = *this;
+	const float t[3] = { x, y, z };
+	for (std::size_t row = 0; row < 3; ++row) {
+		for (std::size_t col = 0; col < 4; ++col) {
+			result.elements[row][col] += t[row] * elements[3][col];
+		}
+	}
+	result.kind = compose(TransformKind::TRANSLATION, kind);
+	return result;
 }
 
 template<std::size_t N>
-Transform Matrix<N>::rotate_z(float r) const {
-	return Transform::rotation_z(r) * (*this);
+constexpr Transform Matrix<N>::scale(float x, float y, float z) const {
+	Transform result = *this;
+	premultiply_scaling(result, x, y, z);
+	result.kind = compose(TransformKind::SCALING, kind);
+	return result;
 }
 
 template<std::size_t N>
-Transform Matrix<N>::shear(float xy, float xz, float yx, float yz, float zx, float zy) const {
-	return Transform::shearing(xy, xz, yx, yz, zx, zy) * (*this);
+Transform Matrix<N>::rotate_x(float r) const {
+	Transform result = *this;
+	premultiply_rotation(result, 1, 2, r);
+	result.kind = compose(TransformKind::RIGID, kind);
+	return result;
 }
 
 template<std::size_t N>
-Matrix<N>::Matrix(const float(&list)[N][N])
-{
-	static_assert(N >= 2, "Matrix must be at least 2x2.");
-	for (int x = 0; x < N; x++) {
-		for (int y = 0; y < N; y++) {
-			elements[x][y] = list[x][y];
-		}
-	}
+Transform Matrix<N>::rotate_y(float r) const {
+	Transform result = *this;
+	premultiply_rotation(result, 2, 0, r);
+	result.kind = compose(TransformKind::RIGID, kind);
+	return result;
 }
 
 template<std::size_t N>
-Matrix<N>::Matrix()
-{
-	static_assert(N >= 2, "Matrix must be at least 2x2.");
+Transform Matrix<N>::rotate_z(float r) const {
+	Transform result = *this;
+	premultiply_rotation(result, 0, 1, r);
+	result.kind = compose(TransformKind::RIGID, kind);
+	return result;
 }
 
 template<std::size_t N>
-inline Matrix<N>::Matrix(const Matrix<N> &m)
-{
-	for (std::size_t x = 0; x < N; ++x) {
-		for (std::size_t y = 0; y < N; ++y) {
-			elements[x][y] = m[x][y];
-		}
-	}
+constexpr Transform Matrix<N>::shear(float xy, float xz, float yx, float yz, float zx, float zy) const {
+	Transform result = *this;
+	premultiply_shearing(result, xy, xz, yx, yz, zx, zy);
+	result.kind = compose(TransformKind::AFFINE, kind);
+	return result;
 }
 
 template<std::size_t N>
-float* Matrix<N>::operator[](std::size_t row){
+constexpr const float* Matrix<N>::operator[](std::size_t row) const {
 	return elements[row];
 }
 
 template<std::size_t N>
-const float* Matrix<N>::operator[](std::size_t row) const {
-	return elements[row];
+constexpr void Matrix<N>::set(std::size_t row, std::size_t column, float value) {
+	elements[row][column] = value;
+	kind = TransformKind::GENERAL;
 }
 
 template<std::size_t N>
-bool Matrix<N>::operator==(Matrix<N> other) const {
+constexpr bool Matrix<N>::operator==(const Matrix<N>& other) const {
 	for (std::size_t x = 0; x < N; ++x) {
 		for (std::size_t y = 0; y < N; ++y) {
-			if (std::abs(elements[x][y] - other[x][y]) > EPSILON)
+			if (absolute(elements[x][y] - other[x][y]) > EPSILON)
 				return false;
 		}
 	}
@@ -382,12 +679,12 @@ bool Matrix<N>::operator==(Matrix<N> other) const {
 }
 
 template<std::size_t N>
-bool Matrix<N>::operator!=(Matrix<N> other) const {
+constexpr bool Matrix<N>::operator!=(const Matrix<N>& other) const {
 	return !(*this == other);
 }
 
 template<std::size_t N>
-Matrix<N> Matrix<N>::operator*(Matrix<N> other) const
+constexpr Matrix<N> Matrix<N>::operator*(const Matrix<N>& other) const
 {
 	Matrix<N> m;
 	for (std::size_t x = 0; x < N; ++x) {
@@ -396,15 +693,16 @@ Matrix<N> Matrix<N>::operator*(Matrix<N> other) const
 			for (std::size_t z = 0; z < N; ++z) {
 				result += elements[x][z] * other[z][y];
 			}
-			m[x][y] = result;
+			m.elements[x][y] = result;
 		}
 	}
+	m.kind = compose(kind, other.kind);
 	return m;
 }
 
 // Just a bunch of dot products
 template<std::size_t N>
-Tuple Matrix<N>::operator*(const Tuple& other) const {
+constexpr Tuple Matrix<N>::operator*(const Tuple& other) const {
 	static_assert(N == 4, "Multiplying tuples with different sizes is not supported.");
 	return Tuple{
 		elements[0][0] * other.x + elements[0][1] * other.y + elements[0][2] * other.z + elements[0][3] * other.w,
@@ -415,18 +713,20 @@ Tuple Matrix<N>::operator*(const Tuple& other) const {
 }
 
 template<std::size_t N>
-Matrix<N> Matrix<N>::transpose() const {
+constexpr Matrix<N> Matrix<N>::transpose() const {
 	Matrix<N> result;
 	for (std::size_t x = 0; x < N; ++x) {
 		for (std::size_t y = 0; y < N; ++y) {
-			result[x][y] = elements[y][x];
+			result.elements[x][y] = elements[y][x];
 		}
 	}
+	if (kind == TransformKind::IDENTITY || kind == TransformKind::SCALING)
+		result.kind = kind;
 	return result;
 }
 
 template<std::size_t N>
-float Matrix<N>::determinant() const {
+constexpr float Matrix<N>::determinant() const {
 	float result = 0.f;
 	for (std::size_t x = 0; x < N; ++x) {
 		result += elements[0][x] * cofactor(0, x);
@@ -434,12 +734,13 @@ float Matrix<N>::determinant() const {
 	return result;
 }
 
-float Matrix<2>::determinant() const {
+template<>
+constexpr float Matrix<2>::determinant() const {
 	return elements[0][0] * elements[1][1] - elements[0][1] * elements[1][0];
 }
 
 template<std::size_t N>
-Matrix<N - 1> Matrix<N>::submatrix(std::size_t row, std::size_t col) const {
+constexpr Matrix<N - 1> Matrix<N>::submatrix(std::size_t row, std::size_t col) const {
 	static_assert(N > 2, "Submatrix for 2x2 or less does not exist.");
 	Matrix<N - 1> result;
 	for (std::size_t x = 0; x < N; ++x) {
@@ -448,50 +749,252 @@ Matrix<N - 1> Matrix<N>::submatrix(std::size_t row, std::size_t col) const {
 			if (y == col) continue;
 			std::size_t ix = x - ((x > row) ? 1 : 0);
 			std::size_t iy = y - ((y > col) ? 1 : 0);
-			result[ix][iy] = elements[x][y];
+			result.elements[ix][iy] = elements[x][y];
 		}
 	}
 	return result;
 }
 
 template<std::size_t N>
-float Matrix<N>::minor(std::size_t row, std::size_t col) const {
+constexpr float Matrix<N>::minor(std::size_t row, std::size_t col) const {
 	static_assert(N > 2, "Submatrix for 2x2 or less does not exist.");
 	return submatrix(row, col).determinant();
 }
 
 template<std::size_t N>
-float Matrix<N>::cofactor(std::size_t row, std::size_t col) const {
+constexpr float Matrix<N>::cofactor(std::size_t row, std::size_t col) const {
 	static_assert(N > 2, "Submatrix for 2x2 or less does not exist.");
 	return minor(row, col) * ((row + col) % 2 == 0 ? 1 : -1);
 }
 
 template<std::size_t N>
-bool Matrix<N>::invertible() const {
+constexpr bool Matrix<N>::invertible() const {
 	return determinant() != 0;
 }
 
+// Anything better than GENERAL is affine, and AffineTransform::inverse() has the fast paths
 template<std::size_t N>
-Matrix<N> Matrix<N>::inverse() const {
+constexpr Matrix<N> Matrix<N>::inverse() const {
+	if constexpr (N == 4) {
+		if (kind != TransformKind::GENERAL)
+			return AffineTransform(*this).inverse().to_matrix();
+	}
 	float d = determinant();
 	assert(d != 0);
 	Matrix<N> result;
 	for (std::size_t x = 0; x < N; ++x) {
 		for (std::size_t y = 0; y < N; ++y) {
-			result[y][x] = cofactor(x, y) / d;
+			result.elements[y][x] = cofactor(x, y) / d;
+		}
+	}
+	return result;
+}
+
+constexpr AffineTransform::AffineTransform() : elements{}, kind{ TransformKind::AFFINE } {}
+
+constexpr AffineTransform::AffineTransform(const float(&list)[3][4], TransformKind kind) : elements{}, kind{ kind } {
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 4; ++y) {
+			elements[x][y] = list[x][y];
+		}
+	}
+}
+
+constexpr AffineTransform::AffineTransform(const Transform& m)
+	: elements{}, kind{ m.kind == TransformKind::GENERAL ? TransformKind::AFFINE : m.kind } {
+	assert(m.elements[3][0] == 0 && m.elements[3][1] == 0 && m.elements[3][2] == 0 && m.elements[3][3] == 1);
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 4; ++y) {
+			elements[x][y] = m.elements[x][y];
+		}
+	}
+}
+
+constexpr Transform AffineTransform::to_matrix() const {
+	Transform result;
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 4; ++y) {
+			result.elements[x][y] = elements[x][y];
+		}
+	}
+	result.elements[3][3] = 1.f;
+	result.kind = kind;
+	return result;
+}
+
+constexpr const float* AffineTransform::operator[](std::size_t row) const {
+	return elements[row];
+}
+
+constexpr void AffineTransform::set(std::size_t row, std::size_t column, float value) {
+	elements[row][column] = value;
+	kind = TransformKind::AFFINE;
+}
+
+constexpr bool AffineTransform::operator==(const AffineTransform& other) const {
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 4; ++y) {
+			if (absolute(elements[x][y] - other[x][y]) > EPSILON)
+				return false;
+		}
+	}
+	return true;
+}
+
+constexpr bool AffineTransform::operator!=(const AffineTransform& other) const {
+	return !(*this == other);
+}
+
+// The implicit bottom rows contribute nothing to the 3x3 part and only add the
+// translation column once
+constexpr AffineTransform AffineTransform::operator*(const AffineTransform& other) const {
+	AffineTransform m;
+	for (std::size_t x = 0; x < 3; ++x) {
+		for (std::size_t y = 0; y < 4; ++y) {
+			m.elements[x][y] = elements[x][0] * other[0][y] + elements[x][1] * other[1][y] + elements[x][2] * other[2][y];
+		}
+		m.elements[x][3] += elements[x][3];
+	}
+	m.kind = compose(kind, other.kind);
+	return m;
+}
+
+constexpr Tuple AffineTransform::operator*(const Tuple& other) const {
+	return Tuple{
+		elements[0][0] * other.x + elements[0][1] * other.y + elements[0][2] * other.z + elements[0][3] * other.w,
+		elements[1][0] * other.x + elements[1][1] * other.y + elements[1][2] * other.z + elements[1][3] * other.w,
+		elements[2][0] * other.x + elements[2][1] * other.y + elements[2][2] * other.z + elements[2][3] * other.w,
+		other.w
+	};
+}
+
+// Equal to the determinant of the 3x3 part, since the bottom row is [0 0 0 1]
+constexpr float AffineTransform::determinant() const {
+	return elements[0][0] * (elements[1][1] * elements[2][2] - elements[1][2] * elements[2][1])
+		- elements[0][1] * (elements[1][0] * elements[2][2] - elements[1][2] * elements[2][0])
+		+ elements[0][2] * (elements[1][0] * elements[2][1] - elements[1][1] * elements[2][0]);
+}
+
+constexpr bool AffineTransform::invertible() const {
+	return determinant() != 0;
+}
+
+// [A | t]^-1 = [A^-1 | -A^-1 * t]. A^-1 is the reciprocal diagonal for scalings, the
+// transpose for rotations and otherwise comes from the 3x3 adjugate.
+constexpr AffineTransform AffineTransform::inverse() const {
+	const auto& e = elements;
+	AffineTransform result;
+	result.kind = kind;
+	switch (kind) {
+	case TransformKind::IDENTITY:
+		return *this;
+	case TransformKind::TRANSLATION:
+		result = *this;
+		result.elements[0][3] = -e[0][3];
+		result.elements[1][3] = -e[1][3];
+		result.elements[2][3] = -e[2][3];
+		return result;
+	case TransformKind::SCALING:
+	case TransformKind::TRANSLATION_SCALING:
+		for (std::size_t x = 0; x < 3; ++x) {
+			assert(e[x][x] != 0);
+			result.elements[x][x] = 1.f / e[x][x];
+			result.elements[x][3] = -e[x][3] * result.elements[x][x];
+		}
+		return result;
+	case TransformKind::RIGID:
+		for (std::size_t x = 0; x < 3; ++x) {
+			for (std::size_t y = 0; y < 3; ++y) {
+				result.elements[x][y] = e[y][x];
+			}
+		}
+		for (std::size_t x = 0; x < 3; ++x) {
+			result.elements[x][3] = -(result.elements[x][0] * e[0][3] + result.elements[x][1] * e[1][3] + result.elements[x][2] * e[2][3]);
 		}
+		return result;
+	default:
+		break;
+	}
+	float d = determinant();
+	assert(d != 0);
+	result.elements[0][0] = (e[1][1] * e[2][2] - e[1][2] * e[2][1]) / d;
+	result.elements[0][1] = (e[0][2] * e[2][1] - e[0][1] * e[2][2]) / d;
+	result.elements[0][2] = (e[0][1] * e[1][2] - e[0][2] * e[1][1]) / d;
+	result.elements[1][0] = (e[1][2] * e[2][0] - e[1][0] * e[2][2]) / d;
+	result.elements[1][1] = (e[0][0] * e[2][2] - e[0][2] * e[2][0]) / d;
+	result.elements[1][2] = (e[0][2] * e[1][0] - e[0][0] * e[1][2]) / d;
+	result.elements[2][0] = (e[1][0] * e[2][1] - e[1][1] * e[2][0]) / d;
+	result.elements[2][1] = (e[0][1] * e[2][0] - e[0][0] * e[2][1]) / d;
+	result.elements[2][2] = (e[0][0] * e[1][1] - e[0][1] * e[1][0]) / d;
+	for (std::size_t x = 0; x < 3; ++x) {
+		result.elements[x][3] = -(result.elements[x][0] * e[0][3] + result.elements[x][1] * e[1][3] + result.elements[x][2] * e[2][3]);
 	}
 	return result;
 }
 
-bool Tuple::operator==(const Tuple& other) const {
-	return std::abs(x - other.x) <= EPSILON &&
-		std::abs(y - other.y) <= EPSILON &&
-		std::abs(z - other.z) <= EPSILON &&
-		std::abs(w - other.w) <= EPSILON;
+constexpr TransformBuilder::TransformBuilder() : transform{ {
+	{1.f, 0.f, 0.f, 0.f},
+	{0.f, 1.f, 0.f, 0.f},
+	{0.f, 0.f, 1.f, 0.f}
+}, TransformKind::IDENTITY } {}
+
+constexpr TransformBuilder::TransformBuilder(const AffineTransform& start) : transform{ start } {}
+
+// The implicit bottom row is [0 0 0 1], so only the translation column changes
+constexpr TransformBuilder& TransformBuilder::translate(float x, float y, float z) {
+	transform.elements[0][3] += x;
+	transform.elements[1][3] += y;
+	transform.elements[2][3] += z;
+	transform.kind = compose(TransformKind::TRANSLATION, transform.kind);
+	return *this;
+}
+
+constexpr TransformBuilder& TransformBuilder::scale(float x, float y, float z) {
+	premultiply_scaling(transform, x, y, z);
+	transform.kind = compose(TransformKind::SCALING, transform.kind);
+	return *this;
+}
+
+TransformBuilder& TransformBuilder::rotate_x(float r) {
+	premultiply_rotation(transform, 1, 2, r);
+	transform.kind = compose(TransformKind::RIGID, transform.kind);
+	return *this;
+}
+
+TransformBuilder& TransformBuilder::rotate_y(float r) {
+	premultiply_rotation(transform, 2, 0, r);
+	transform.kind = compose(TransformKind::RIGID, transform.kind);
+	return *this;
+}
+
+TransformBuilder& TransformBuilder::rotate_z(float r) {
+	premultiply_rotation(transform, 0, 1, r);
+	transform.kind = compose(TransformKind::RIGID, transform.kind);
+	return *this;
+}
+
+constexpr TransformBuilder& TransformBuilder::shear(float xy, float xz, float yx, float yz, float zx, float zy) {
+	premultiply_shearing(transform, xy, xz, yx, yz, zx, zy);
+	transform.kind = compose(TransformKind::AFFINE, transform.kind);
+	return *this;
 }
 
-Tuple& Tuple::operator=(const Tuple& other) {
+constexpr AffineTransform TransformBuilder::build() const {
+	return transform;
+}
+
+constexpr TransformBuilder::operator AffineTransform() const {
+	return transform;
+}
+
+constexpr bool Tuple::operator==(const Tuple& other) const {
+	return absolute(x - other.x) <= EPSILON &&
+		absolute(y - other.y) <= EPSILON &&
+		absolute(z - other.z) <= EPSILON &&
+		absolute(w - other.w) <= EPSILON;
+}
+
+constexpr Tuple& Tuple::operator=(const Tuple& other) {
 	x = other.x;
 	y = other.y;
 	z = other.z;
@@ -499,29 +1002,29 @@ Tuple& Tuple::operator=(const Tuple& other) {
 	return *this;
 }
 
-Tuple Tuple::operator+(const Tuple& other) const {
+constexpr Tuple Tuple::operator+(const Tuple& other) const {
 	return Tuple{x + other.x, y + other.y, z + other.z, w + other.w};
 }
 
-Tuple Tuple::operator-(const Tuple& other) const {
+constexpr Tuple Tuple::operator-(const Tuple& other) const {
 	return {x - other.x, y - other.y, z - other.z, w - other.w};
 }
 
-Tuple Tuple::operator-() const {
+constexpr Tuple Tuple::operator-() const {
 	return { -x, -y, -z, -w };
 }
 
-Tuple Tuple::operator*(float other) const {
+constexpr Tuple Tuple::operator*(float other) const {
 	return { x * other, y * other, z * other, w * other };
 }
 
 // Multipication is communitive!
 
-Tuple operator*(float f, Tuple& t) {
+constexpr Tuple operator*(float f, const Tuple& t) {
 	return { t.x * f, t.y * f, t.z * f, t.w * f };
 }
 
-Tuple Tuple::operator/(float other) const {
+constexpr Tuple Tuple::operator/(float other) const {
 	return { x / other, y / other, z / other, w / other };
 }
 
@@ -531,25 +1034,25 @@ Tuple Tuple::normalize() const {
 }
 
 float Tuple::magnitude() const {
-	return std::sqrtf(x * x + y * y + z * z + w * w);
+	return std::sqrt(x * x + y * y + z * z + w * w);
 }
 
-float Tuple::dot(const Tuple& other) const {
+constexpr float Tuple::dot(const Tuple& other) const {
 	return x * other.x + y * other.y + z * other.z + w * other.w;
 }
 
-Tuple Tuple::cross(const Tuple& other) const {
+constexpr Tuple Tuple::cross(const Tuple& other) const {
 	return vector(
 		y * other.z - z * other.y,
 		z * other.x - x * other.z,
 		x * other.y - y * other.x);
 }
 
-bool Tuple::isPoint() const {
+constexpr bool Tuple::isPoint() const {
 	return w == 1.0;
 }
 
-bool Tuple::isVector() const {
+constexpr bool Tuple::isVector() const {
 	return w == 0.0;
 }
 
@@ -575,7 +1078,7 @@ std::ostream& operator<<(std::ostream& o, Tuple t) {
 }
 
 template<std::size_t N>
-std::ostream& operator<<(std::ostream& output, Matrix<N> mat) {
+std::ostream& operator<<(std::ostream& output, const Matrix<N>& mat) {
 	for (std::size_t x = 0; x < N; ++x) {
 		output << "[";
 		for (std::size_t y = 0; y < N; ++y) {
@@ -586,11 +1089,15 @@ std::ostream& operator<<(std::ostream& output, Matrix<N> mat) {
 	return output;
 }
 
+std::ostream& operator<<(std::ostream& output, const AffineTransform& t) {
+	return output << t.to_matrix();
+}
+
 RGB Tuple::getRGB() {
 	return RGB{ x, y, z };
 }
 
-Tuple Tuple::schur(const Tuple& other) const {
+constexpr Tuple Tuple::schur(const Tuple& other) const {
 	return Tuple{
 		x * other.x,
 		y * other.y,
@@ -599,16 +1106,58 @@ Tuple Tuple::schur(const Tuple& other) const {
 	};
 }
 
-Canvas::Canvas(std::size_t width, std::size_t height) : width{ width }, height{height} {
-	canvas = new Tuple[width * height];
-	for (std::size_t x = 0; x < width * height; ++x) {
+Canvas::Canvas(std::size_t width, std::size_t height, CanvasLayout layout) : width{ width }, height{height}, layout{ layout } {
+	canvas = new Tuple[size()];
+	for (std::size_t x = 0; x < size(); ++x) {
 		canvas[x] = color(0, 0, 0);
 	}
 }
 
+Canvas::Canvas(const Canvas& other) : width{ other.width }, height{ other.height }, layout{ other.layout } {
+	canvas = new Tuple[size()];
+	std::copy(other.canvas, other.canvas + size(), canvas);
+}
+
+// Leaves `other` without pixels; it can only be destroyed
+Canvas::Canvas(Canvas&& other) noexcept : width{ other.width }, height{ other.height }, layout{ other.layout }, canvas{ other.canvas } {
+	other.canvas = nullptr;
+}
+
+Canvas::~Canvas() {
+	delete[] canvas;
+}
+
+void Canvas::swap_pixels(Canvas& other) {
+	std::swap(canvas, other.canvas);
+}
+
+std::size_t Canvas::size() const {
+	if (layout == CanvasLayout::ROW_MAJOR)
+		return width * height;
+	return (width + CANVAS_BLOCK - 1) / CANVAS_BLOCK * ((height + CANVAS_BLOCK - 1) / CANVAS_BLOCK) * CANVAS_BLOCK * CANVAS_BLOCK;
+}
+
+// 0b abc -> 0b a0b0c, for coordinates within a block
+constexpr std::size_t spread_bits(std::size_t v) {
+	v = (v | (v << 2)) & 0x33;
+	return (v | (v << 1)) & 0x55;
+}
+
 // Assumes x and y are in range
 std::size_t Canvas::index(std::size_t x, std::size_t y) const {
-	return x + y * width;
+	if (layout == CanvasLayout::ROW_MAJOR)
+		return x + y * width;
+	std::size_t blocks_across = (width + CANVAS_BLOCK - 1) / CANVAS_BLOCK;
+	std::size_t block = y / CANVAS_BLOCK * blocks_across + x / CANVAS_BLOCK;
+	return block * CANVAS_BLOCK * CANVAS_BLOCK + (spread_bits(x % CANVAS_BLOCK) | spread_bits(y % CANVAS_BLOCK) << 1);
+}
+
+const Tuple* Canvas::row(std::size_t y, Tuple* scratch) const {
+	if (layout == CanvasLayout::ROW_MAJOR)
+		return canvas + y * width;
+	for (std::size_t x = 0; x < width; ++x)
+		scratch[x] = canvas[index(x, y)];
+	return scratch;
 }
 
 void Canvas::write_pixel(std::size_t x, std::size_t y, Color c) {
@@ -622,13 +1171,22 @@ Color Canvas::read_pixel(std::size_t x, std::size_t y) const {
 	return canvas[index(x, y)];
 }
 
-CanvasToPPM::CanvasToPPM(Canvas c, int maxval = 255) : c{ c }, maxval{ maxval } {
+CanvasToPPM::CanvasToPPM(const Canvas& c, int maxval = 255) : c{ c }, maxval{ maxval } {
 
 }
 
-// Newlines are appended if the line exceeds 70 characters or the row of pixels ends
+std::string plainPPMHeader(std::size_t width, std::size_t height, int maxval) {
+	return std::string{ "P3\n" } + std::to_string(width) + " " + std::to_string(height) + "\n" + std::to_string(maxval) + "\n";
+}
+
 std::string CanvasToPPM::toPlainPPM() {
-	result = std::string{ "P3\n" } + std::to_string(c.width) + " " + std::to_string(c.height) + "\n" + std::to_string(maxval) + "\n";
+	return plainPPMHeader(c.width, c.height, maxval) + toPlainPixels();
+}
+
+// Newlines are appended if the line exceeds 70 characters or the row of pixels ends
+std::string CanvasToPPM::toPlainPixels() {
+	result.clear();
+	line_length = 0;
 	// generate pixel data
 	// TODO: Write an iterator for canvas
 	for (std::size_t x = 0; x < c.height * c.width; ++x) {
@@ -636,11 +1194,12 @@ std::string CanvasToPPM::toPlainPPM() {
 			result[result.length() - 1] = '\n';
 			line_length = 0;
 		}
-		appendSampleStr(c.canvas[x].getRGB().red);
-		appendSampleStr(c.canvas[x].getRGB().green);
-		appendSampleStr(c.canvas[x].getRGB().blue);
+		Tuple& pixel = c.canvas[c.index(x % c.width, x / c.width)];
+		appendSampleStr(pixel.getRGB().red);
+		appendSampleStr(pixel.getRGB().green);
+		appendSampleStr(pixel.getRGB().blue);
 	}
-	if (result[result.length() - 1] != '\n')
+	if (!result.empty() && result[result.length() - 1] != '\n')
 		result[result.length() - 1] = '\n';
 	return result;
 }
@@ -1,30 +1,320 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include "lib.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "camera.h"
+#include "render.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "raw_canvas.h"
+#include "animation.h"
+#include "y4m.h"
+#include "budget.h"
+#include "paged_canvas.h"
 
-int main() {
-	int height, width;
-	height = width = 600;
-	Canvas c(width, height);
-	Sphere sphere;
-	sphere.transform = Transform::scaling(width / 2.f, width / 2.f, width / 2.f);
-	for (int x = 0; x < width; ++x) {
-		for (int y = 0; y < height; ++y) {
-			Ray ray{ point(x - width / 2, y - height / 2, -5), vector(0, 0, 1) };
-			std::vector<Intersection> inters = intersections(intersect(sphere, ray));
-			Intersection* h = nullptr;
-			hit(inters, &h);
-			if (h != nullptr) {
-				c.write_pixel(x, y, color(255, 0, 0));
-			}
-			else {
-				c.write_pixel(x, y, color(0, 0, 0));
-			}
-		}
-	}
+// Usage: RayTracer [scene file] [--checkpoint file | --workers count | --frames n | --budget ms | --paged file] [--samples n] [--seed n] [--raw file] [--y4m file] [--region x0 y0 x1 y1]
+// Without a scene file, renders the chapter 5 sphere through an orthographic camera;
+// scene files are seen through their perspective camera. A scene file is compiled to
+// "<scene file>.cache" on first use and mapped from there until the scene changes.
+//   --checkpoint  save finished tiles to `file` every few seconds and, if it already
+//                 holds a checkpoint of this render, resume from it.
+//                 Not with --workers or --budget.
+//   --workers     render in `count` worker processes instead of threads
+//   --samples n   jittered samples per pixel (default 1, through the pixel center)
+//   --seed n      seed for the jitter; renders with different seeds can be averaged
+//   --raw file    also save the canvas as lossless floats, for RayMerge
+//   --frames n    render an n frame turntable, the objects spinning once about the
+//                 camera's target, to the output name with the frame number added
+//                 (and to the --raw name likewise).
+//                 Not with --checkpoint, --workers or --budget.
+//   --y4m file    write frames to `file` ("-" for stdout) as a YUV4MPEG2 video stream
+//                 instead of PPMs, e.g. to pipe an animation into ffmpeg
+//   --budget ms   a preview within about `ms` milliseconds: a coarse pass, then as
+//                 many tiles as fit, from the middle out
+//   --region      render only pixels [x0, x1) x [y0, y1) of the frame and save just
+//                 them; the raw file keeps their place in the frame for RayMerge.
+//                 Not with --checkpoint, --workers, --frames or --budget.
+//   --paged file  keep the frame in a sparse tile file at `file` instead of memory,
+//                 for frames too big for RAM; the outputs are streamed from it.
+//                 Only with --samples, --seed and --raw.
+
+constexpr int width = 600;
+constexpr int height = 600;
+constexpr Transform sphere_transform = Transform::scaling(width / 2.f, width / 2.f, width / 2.f);
+
+// One world unit per pixel, looking down +z at the sphere
+Camera chapter5_camera() {
+	Camera camera(width, height, static_cast<float>(width), Projection::ORTHOGRAPHIC);
+	camera.set_transform(view_transform(point(0, 0, -5), point(0, 0, 0), vector(0, 1, 0)));
+	return camera;
+}
+
+// "output.ppm" -> "output_0007.ppm"
+std::string frame_path(const std::string& output, std::size_t frame) {
+	char number[16];
+	std::snprintf(number, sizeof(number), "_%04zu", frame);
+	std::size_t dot = output.rfind('.');
+	if (dot == std::string::npos)
+		return output + number;
+	return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// A frame of an animation that couldn't be saved
+struct FrameError {
+	std::string message;
+};
+
+// False if the file couldn't be written
+bool write_ppm(const std::string& path, const Canvas& c) {
 	CanvasToPPM c2ppm(c);
 	std::ofstream file;
-	file.open("output.ppm");
+	file.open(path);
 	file << c2ppm.toPlainPPM();
 	file.close();
+	return static_cast<bool>(file);
+}
+
+int main(int argc, char** argv) {
+	std::string scene_path;
+	std::string checkpoint_path;
+	unsigned workers = 0;
+	std::size_t frames = 0;
+	std::string raw_path;
+	std::string y4m_path;
+	std::string paged_path;
+	long long budget_ms = -1;
+	bool cropped = false;
+	std::size_t region_bounds[4] = {};
+	RenderSettings settings;
+	settings.threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+			checkpoint_path = argv[++i];
+		else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+			workers = static_cast<unsigned>(std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = static_cast<std::size_t>(std::max(0, std::atoi(argv[++i])));
+		else if (std::strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+			settings.samples = static_cast<std::uint32_t>(std::max(1, std::atoi(argv[++i])));
+		else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			settings.seed = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "--raw") == 0 && i + 1 < argc)
+			raw_path = argv[++i];
+		else if (std::strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+			budget_ms = std::max(0LL, std::atoll(argv[++i]));
+		else if (std::strcmp(argv[i], "--y4m") == 0 && i + 1 < argc)
+			y4m_path = argv[++i];
+		else if (std::strcmp(argv[i], "--paged") == 0 && i + 1 < argc)
+			paged_path = argv[++i];
+		else if (std::strcmp(argv[i], "--region") == 0 && i + 4 < argc) {
+			cropped = true;
+			for (std::size_t& b : region_bounds)
+				b = static_cast<std::size_t>(std::max(0, std::atoi(argv[++i])));
+		}
+		else
+			scene_path = argv[i];
+	}
+
+	// Keeps stdout clean when the video goes there
+	std::ostream& messages = y4m_path == "-" ? std::cerr : std::cout;
+
+	Scene scene;
+	std::unique_ptr<SceneCache> cache;
+	SphereBatchView objects;
+	std::string output;
+	if (!scene_path.empty()) {
+		try {
+			cache = load_scene_cached(scene_path, scene_path + ".cache");
+		}
+		catch (const SceneError& e) {
+			std::cerr << scene_path << ":" << e << "\n";
+			return 1;
+		}
+		scene.width = static_cast<std::size_t>(cache->header().width);
+		scene.height = static_cast<std::size_t>(cache->header().height);
+		objects = cache->batch();
+		output = cache->output();
+	}
+	else {
+		scene.width = width;
+		scene.height = height;
+		scene.add(sphere_transform);
+		objects = scene.batch.view();
+		output = scene.output;
+	}
+
+	Camera camera = cache ? Camera(scene.width, scene.height, cache->camera()) : chapter5_camera();
+
+	auto shade = [](const Ray&, const BatchHit& hit) {
+		return hit.hit() ? color(255, 0, 0) : color(0, 0, 0);
+	};
+
+	PixelRect whole{ 0, 0, scene.width, scene.height };
+	PixelRect region = whole;
+	if (cropped) {
+		region = overlap(whole, PixelRect{ region_bounds[0], region_bounds[1], region_bounds[2], region_bounds[3] });
+		if (region.empty() || workers > 0 || !checkpoint_path.empty() || frames > 0 || budget_ms >= 0) {
+			std::cerr << "--region needs a rectangle inside the frame, and no --checkpoint, --workers, --frames or --budget\n";
+			return 1;
+		}
+	}
+
+	if (!paged_path.empty() && (workers > 0 || !checkpoint_path.empty() || frames > 0 || budget_ms >= 0 || cropped || !y4m_path.empty())) {
+		std::cerr << "--paged can't be combined with --checkpoint, --workers, --frames, --budget, --region or --y4m\n";
+		return 1;
+	}
+
+	// The other renderers don't resume, so the checkpoint would be deleted unused
+	if (!checkpoint_path.empty() && (workers > 0 || budget_ms >= 0)) {
+		std::cerr << "--checkpoint can't be combined with --workers or --budget\n";
+		return 1;
+	}
+
+	if (frames > 0 && (workers > 0 || !checkpoint_path.empty() || budget_ms >= 0)) {
+		std::cerr << "--frames can't be combined with --checkpoint, --workers or --budget\n";
+		return 1;
+	}
+
+	if (frames > 0) {
+		if (cache)
+			cache->copy_objects(scene);
+		Point pivot = cache ? cache->camera().to : point(0, 0, 0);
+		std::vector<AffineTransform> start;
+		for (const Sphere& s : scene.objects)
+			start.push_back(s.get_transform());
+		auto spin = [&](std::size_t frame, Scene& scene, Camera&, FrameChanges& changes) {
+			float angle = 2 * M_PI * frame / frames;
+			for (std::size_t i = 0; i < start.size(); ++i) {
+				scene.set_transform(i, TransformBuilder(start[i]).translate(-pivot.x, -pivot.y, -pivot.z).rotate_y(angle).translate(pivot.x, pivot.y, pivot.z));
+				changes.moved.push_back(i);
+			}
+		};
+		try {
+			std::unique_ptr<Y4MWriter> video;
+			if (!y4m_path.empty())
+				video = std::make_unique<Y4MWriter>(y4m_path, scene.width, scene.height);
+			// Thrown errors stop the sequence and come back out of render_sequence
+			auto encode = [&](std::size_t frame, const Canvas& c) {
+				if (!raw_path.empty())
+					write_raw_canvas(frame_path(raw_path, frame), c, static_cast<float>(settings.samples));
+				if (video) {
+					video->write_frame(c);
+					return;
+				}
+				std::string path = frame_path(output, frame);
+				if (!write_ppm(path, c))
+					throw FrameError{ "can't write " + path };
+			};
+			SequenceSettings sequence;
+			sequence.render = settings;
+			SequenceStats stats = render_sequence(scene, camera, frames, spin, shade, encode, sequence);
+			if (video)
+				video->close();
+			messages << "rendered " << stats.frames << " frames, " << stats.tiles_rendered << " tiles\n";
+		}
+		catch (const Y4MError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+		catch (const FrameError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+		catch (const RawCanvasError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+		return 0;
+	}
+
+	TileBins bins = bin_objects(camera, TileGrid{ scene.width, scene.height }, objects);
+	if (!paged_path.empty()) {
+		try {
+			PagedCanvas paged(paged_path, scene.width, scene.height);
+			render_paged(camera, bins, paged, shade, settings);
+			if (!raw_path.empty())
+				write_raw_canvas(raw_path, paged, static_cast<float>(settings.samples));
+			write_plain_ppm(output, paged);
+		}
+		catch (const PagedCanvasError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+		catch (const RawCanvasError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+		return 0;
+	}
+	// Tiles write whole blocks of a TILED canvas; the encoders read it back row by row
+	Canvas c(scene.width, scene.height, CanvasLayout::TILED);
+	bool resumed = false;
+	if (workers > 0) {
+		ShardSettings shards;
+		shards.workers = workers;
+		try {
+			ShardStats stats = render_sharded(camera, bins, c, shade, settings, shards);
+			if (stats.worker_crashes > 0)
+				messages << stats.worker_crashes << " workers crashed, " << stats.tiles_reassigned << " tiles reassigned\n";
+		}
+		catch (const ShardError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+	}
+	else if (budget_ms >= 0) {
+		BudgetSettings budget;
+		budget.budget = std::chrono::milliseconds(budget_ms);
+		BudgetStats stats = render_budgeted(camera, bins, c, shade, settings, budget);
+		messages << "refined " << stats.refined_tiles << " of " << stats.tiles << " tiles (" << 100 * stats.coverage
+			<< "% of pixels, coarse " << 100 * stats.coarse_coverage << "%) in " << stats.elapsed.count() / 1000.0 << " ms\n";
+	}
+	else if (checkpoint_path.empty()) {
+		render_region(camera, bins, region, c, shade, settings);
+	}
+	else {
+		CheckpointSettings checkpoints;
+		checkpoints.path = checkpoint_path;
+		// Resuming is only valid for the same scene and sampling
+		std::uint64_t scene_key = cache ? cache->header().source_hash : 0;
+		checkpoints.key = scene_hash(std::to_string(scene_key) + " " + std::to_string(settings.samples) + " " + std::to_string(settings.seed));
+		ResumeStats stats = render_resumable(camera, bins, c, shade, settings, checkpoints);
+		messages << "resumed " << stats.tiles_resumed << " tiles, rendered " << stats.tiles_rendered << "\n";
+		resumed = true;
+	}
+	if (!raw_path.empty()) {
+		try {
+			write_raw_canvas(raw_path, c, region, static_cast<float>(settings.samples));
+		}
+		catch (const RawCanvasError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+	}
+	if (y4m_path.empty()) {
+		bool written = cropped ? write_ppm(output, copy_region(c, region)) : write_ppm(output, c);
+		if (!written) {
+			std::cerr << "can't write " << output << "\n";
+			return 1;
+		}
+	}
+	else {
+		try {
+			Y4MWriter video(y4m_path, region.width(), region.height());
+			video.write_frame(c, region);
+			video.close();
+		}
+		catch (const Y4MError& e) {
+			std::cerr << e.message << "\n";
+			return 1;
+		}
+	}
+	// The frame is saved, so the checkpoint has nothing left to resume
+	if (resumed)
+		std::remove(checkpoint_path.c_str());
 }
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "lib.h"
+#include "render.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A frame too big to hold in memory. Its pixels live in a sparse file with one
+// fixed-size slot per tile, float RGB rows top to bottom:
+//
+//   float[3] x tile_size x tile_size per tile, tiles in index order
+//
+// The file is sized for the whole frame up front but only written tiles take disk
+// space; the holes read back as zeros, which is black. Tiles are rendered into a
+// tile-sized canvas and written out as they finish, so memory holds only the tiles
+// in flight, and encoders read the frame back a row of tiles at a time.
+
+struct PagedCanvasError {
+	std::string message;
+};
+
+class PagedCanvas {
+public:
+	// Creates (or truncates) `path`. Throws PagedCanvasError if it can't be created
+	// at the frame's size.
+	PagedCanvas(const std::string& path, std::size_t width, std::size_t height, std::size_t tile_size = TILE_SIZE);
+	// Closes and deletes the file
+	~PagedCanvas();
+	PagedCanvas(const PagedCanvas&) = delete;
+	PagedCanvas& operator=(const PagedCanvas&) = delete;
+
+	const std::size_t width, height;
+
+	const TileGrid& grid() const;
+	// Saves tile `tile` from `pixels`, a canvas of the tile's size with the tile's top
+	// left pixel at (0, 0). Safe from several threads for different tiles. Throws
+	// PagedCanvasError if the write fails.
+	void write_tile(std::size_t tile, const Canvas& pixels);
+	// A canvas of the tile's size with its pixels, black if it was never written
+	Canvas read_tile(std::size_t tile) const;
+	// Rows [y0, y1) of the frame, read from the tiles they cross
+	Canvas read_rows(std::size_t y0, std::size_t y1) const;
+	std::size_t tiles_written() const;
+	// The file's apparent size; the disk it takes is that of the tiles written
+	std::uint64_t file_size() const;
+private:
+	std::string path;
+	TileGrid tiles;
+	std::atomic<std::size_t> written{ 0 };
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+#else
+	int fd = -1;
+#endif
+
+	std::uint64_t slot_bytes() const;
+	// Throw PagedCanvasError unless all `bytes` are transferred
+	void write_at(std::uint64_t offset, const void* data, std::size_t bytes);
+	void read_at(std::uint64_t offset, void* data, std::size_t bytes) const;
+};
+
+PagedCanvas::PagedCanvas(const std::string& path, std::size_t width, std::size_t height, std::size_t tile_size)
+	: width{ width }, height{ height }, path{ path }, tiles{ width, height, tile_size } {
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw PagedCanvasError{ "can't create " + path };
+	// Without this NTFS fills the file with zeros on disk
+	DWORD returned;
+	DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+	LARGE_INTEGER size;
+	size.QuadPart = static_cast<LONGLONG>(file_size());
+	if (!SetFilePointerEx(file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+		CloseHandle(file);
+		DeleteFileA(path.c_str());
+		throw PagedCanvasError{ "can't size " + path };
+	}
+#else
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw PagedCanvasError{ "can't create " + path };
+	if (ftruncate(fd, static_cast<off_t>(file_size())) != 0) {
+		close(fd);
+		unlink(path.c_str());
+		throw PagedCanvasError{ "can't size " + path };
+	}
+#endif
+}
+
+PagedCanvas::~PagedCanvas() {
+#ifdef _WIN32
+	CloseHandle(file);
+	DeleteFileA(path.c_str());
+#else
+	close(fd);
+	unlink(path.c_str());
+#endif
+}
+
+const TileGrid& PagedCanvas::grid() const {
+	return tiles;
+}
+
+std::uint64_t PagedCanvas::slot_bytes() const {
+	return static_cast<std::uint64_t>(tiles.tile_size) * tiles.tile_size * 3 * sizeof(float);
+}
+
+std::uint64_t PagedCanvas::file_size() const {
+	return tiles.count() * slot_bytes();
+}
+
+std::size_t PagedCanvas::tiles_written() const {
+	return written;
+}
+
+#ifdef _WIN32
+
+void PagedCanvas::write_at(std::uint64_t offset, const void* data, std::size_t bytes) {
+	OVERLAPPED at{};
+	at.Offset = static_cast<DWORD>(offset);
+	at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD done = 0;
+	if (!WriteFile(file, data, static_cast<DWORD>(bytes), &done, &at) || done != bytes)
+		throw PagedCanvasError{ "can't write " + path };
+}
+
+void PagedCanvas::read_at(std::uint64_t offset, void* data, std::size_t bytes) const {
+	OVERLAPPED at{};
+	at.Offset = static_cast<DWORD>(offset);
+	at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD done = 0;
+	if (!ReadFile(file, data, static_cast<DWORD>(bytes), &done, &at) || done != bytes)
+		throw PagedCanvasError{ "can't read " + path };
+}
+
+#else
+
+void PagedCanvas::write_at(std::uint64_t offset, const void* data, std::size_t bytes) {
+	const char* from = static_cast<const char*>(data);
+	while (bytes > 0) {
+		ssize_t done = pwrite(fd, from, bytes, static_cast<off_t>(offset));
+		if (done <= 0)
+			throw PagedCanvasError{ "can't write " + path };
+		from += done;
+		offset += done;
+		bytes -= done;
+	}
+}
+
+void PagedCanvas::read_at(std::uint64_t offset, void* data, std::size_t bytes) const {
+	char* to = static_cast<char*>(data);
+	while (bytes > 0) {
+		ssize_t done = pread(fd, to, bytes, static_cast<off_t>(offset));
+		if (done <= 0)
+			throw PagedCanvasError{ "can't read " + path };
+		to += done;
+		offset += done;
+		bytes -= done;
+	}
+}
+
+#endif
+
+void PagedCanvas::write_tile(std::size_t tile, const Canvas& pixels) {
+	PixelRect r = tiles.tile(tile);
+	std::vector<float> rgb(3 * r.width() * r.height());
+	for (std::size_t y = 0; y < r.height(); ++y) {
+		for (std::size_t x = 0; x < r.width(); ++x) {
+			Color c = pixels.read_pixel(x, y);
+			std::memcpy(&rgb[3 * (y * r.width() + x)], &c, 3 * sizeof(float));
+		}
+	}
+	write_at(tile * slot_bytes(), rgb.data(), rgb.size() * sizeof(float));
+	++written;
+}
+
+Canvas PagedCanvas::read_tile(std::size_t tile) const {
+	PixelRect r = tiles.tile(tile);
+	std::vector<float> rgb(3 * r.width() * r.height());
+	read_at(tile * slot_bytes(), rgb.data(), rgb.size() * sizeof(float));
+	Canvas pixels(r.width(), r.height());
+	for (std::size_t y = 0; y < r.height(); ++y) {
+		for (std::size_t x = 0; x < r.width(); ++x) {
+			const float* p = &rgb[3 * (y * r.width() + x)];
+			pixels.write_pixel(x, y, color(p[0], p[1], p[2]));
+		}
+	}
+	return pixels;
+}
+
+Canvas PagedCanvas::read_rows(std::size_t y0, std::size_t y1) const {
+	Canvas rows(width, y1 - y0);
+	for (std::size_t t : region_tiles(tiles, PixelRect{ 0, y0, width, y1 })) {
+		PixelRect r = tiles.tile(t);
+		Canvas pixels = read_tile(t);
+		for (std::size_t y = std::max(r.y0, y0); y < std::min(r.y1, y1); ++y) {
+			for (std::size_t x = r.x0; x < r.x1; ++x)
+				rows.write_pixel(x, y - y0, pixels.read_pixel(x - r.x0, y - r.y0));
+		}
+	}
+	return rows;
+}
+
+// render() into a paged canvas. Each tile is rendered into a canvas of its own and
+// written out, so memory holds one tile per thread. The bins' grid must be the
+// canvas's grid().
+template<class Shade>
+void render_paged(const Camera& camera, const TileBins& bins, PagedCanvas& canvas, Shade&& shade, const RenderSettings& settings = {}) {
+	for_each_tile(hilbert_tiles(bins.grid), settings, [&](std::size_t t) {
+		PixelRect r = bins.grid.tile(t);
+		Canvas pixels(r.width(), r.height());
+		render_tile_pixels(camera, bins, t, r, pixels, r.x0, r.y0, shade, settings);
+		canvas.write_tile(t, pixels);
+	});
+}
+
+// Streams the frame to a plain PPM a row of tiles at a time. Throws PagedCanvasError.
+void write_plain_ppm(const std::string& path, const PagedCanvas& canvas, int maxval = 255) {
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw PagedCanvasError{ "can't create " + path };
+	file << plainPPMHeader(canvas.width, canvas.height, maxval);
+	std::size_t step = canvas.grid().tile_size;
+	for (std::size_t y = 0; y < canvas.height; y += step) {
+		Canvas rows = canvas.read_rows(y, std::min(y + step, canvas.height));
+		file << CanvasToPPM(rows, maxval).toPlainPixels();
+	}
+	file.close();
+	if (!file)
+		throw PagedCanvasError{ "can't write " + path };
+}
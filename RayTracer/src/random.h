@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Counter-based random numbers: Philox4x32-10 (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3"). A number is a pure function of the seed and of
+// (pixel, sample, dimension), so there is no generator state to share or advance,
+// and an image comes out the same however its tiles are scheduled.
+//
+// The counter is (pixel low, pixel high, sample, dimension / 4) and the key is the
+// seed. One block yields four words, for dimensions 4b to 4b + 3.
+
+constexpr std::uint32_t PHILOX_M0 = 0xD2511F53;
+constexpr std::uint32_t PHILOX_M1 = 0xCD9E8D57;
+constexpr std::uint32_t PHILOX_W0 = 0x9E3779B9;
+constexpr std::uint32_t PHILOX_W1 = 0xBB67AE85;
+constexpr int PHILOX_ROUNDS = 10;
+
+typedef std::array<std::uint32_t, 4> PhiloxBlock;
+
+PhiloxBlock philox(PhiloxBlock counter, std::uint32_t key0, std::uint32_t key1) {
+	for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+		std::uint64_t p0 = static_cast<std::uint64_t>(PHILOX_M0) * counter[0];
+		std::uint64_t p1 = static_cast<std::uint64_t>(PHILOX_M1) * counter[2];
+		counter = {
+			static_cast<std::uint32_t>(p1 >> 32) ^ counter[1] ^ key0,
+			static_cast<std::uint32_t>(p1),
+			static_cast<std::uint32_t>(p0 >> 32) ^ counter[3] ^ key1,
+			static_cast<std::uint32_t>(p0),
+		};
+		key0 += PHILOX_W0;
+		key1 += PHILOX_W1;
+	}
+	return counter;
+}
+
+// The top 24 bits as a float in [0, 1); exact, so the SIMD path gives the same bits
+constexpr float uniform_float(std::uint32_t bits) {
+	return static_cast<float>(bits >> 8) * (1.f / 16777216.f);
+}
+
+class CounterRng {
+public:
+	explicit CounterRng(std::uint64_t seed);
+
+	PhiloxBlock block(std::uint64_t pixel, std::uint32_t sample, std::uint32_t block) const;
+	// A uniform float in [0, 1)
+	float uniform(std::uint64_t pixel, std::uint32_t sample, std::uint32_t dimension) const;
+	// out[w][i] = uniform(first_pixel + i, sample, 4 * block + w) for i < count, 8 pixels at a time with AVX2
+	void uniform_blocks(std::uint64_t first_pixel, std::size_t count, std::uint32_t sample, std::uint32_t block, float* const out[4]) const;
+private:
+	std::uint32_t key0, key1;
+};
+
+CounterRng::CounterRng(std::uint64_t seed)
+	: key0{ static_cast<std::uint32_t>(seed) }, key1{ static_cast<std::uint32_t>(seed >> 32) } {
+}
+
+PhiloxBlock CounterRng::block(std::uint64_t pixel, std::uint32_t sample, std::uint32_t block) const {
+	return philox({ static_cast<std::uint32_t>(pixel), static_cast<std::uint32_t>(pixel >> 32), sample, block }, key0, key1);
+}
+
+float CounterRng::uniform(std::uint64_t pixel, std::uint32_t sample, std::uint32_t dimension) const {
+	return uniform_float(block(pixel, sample, dimension / 4)[dimension % 4]);
+}
+
+#if defined(__AVX2__)
+
+// High and low halves of a * m for 8 lanes. mul_epu32 multiplies the even lanes, so
+// the odd lanes are shifted down for a second multiply.
+inline void philox_mulhilo(__m256i a, __m256i m, __m256i& hi, __m256i& lo) {
+	__m256i even = _mm256_mul_epu32(a, m);
+	__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+	hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+	lo = _mm256_mullo_epi32(a, m);
+}
+
+#endif
+
+void CounterRng::uniform_blocks(std::uint64_t first_pixel, std::size_t count, std::uint32_t sample, std::uint32_t block, float* const out[4]) const {
+	std::size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i m0 = _mm256_set1_epi32(static_cast<int>(PHILOX_M0));
+	const __m256i m1 = _mm256_set1_epi32(static_cast<int>(PHILOX_M1));
+	const __m256 scale = _mm256_set1_ps(1.f / 16777216.f);
+	for (; i + 8 <= count; i += 8) {
+		// Lane l is pixel first_pixel + i + l; the high word only differs if the low one wraps
+		alignas(32) std::uint32_t low[8], high[8];
+		for (std::size_t l = 0; l < 8; ++l) {
+			std::uint64_t pixel = first_pixel + i + l;
+			low[l] = static_cast<std::uint32_t>(pixel);
+			high[l] = static_cast<std::uint32_t>(pixel >> 32);
+		}
+		__m256i c[4] = {
+			_mm256_load_si256(reinterpret_cast<const __m256i*>(low)),
+			_mm256_load_si256(reinterpret_cast<const __m256i*>(high)),
+			_mm256_set1_epi32(static_cast<int>(sample)),
+			_mm256_set1_epi32(static_cast<int>(block)),
+		};
+		std::uint32_t k0 = key0, k1 = key1;
+		for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+			__m256i hi0, lo0, hi1, lo1;
+			philox_mulhilo(c[0], m0, hi0, lo0);
+			philox_mulhilo(c[2], m1, hi1, lo1);
+			c[0] = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), _mm256_set1_epi32(static_cast<int>(k0)));
+			c[1] = lo1;
+			c[2] = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), _mm256_set1_epi32(static_cast<int>(k1)));
+			c[3] = lo0;
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+		for (std::size_t w = 0; w < 4; ++w)
+			_mm256_storeu_ps(out[w] + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(c[w], 8)), scale));
+	}
+#endif
+	for (; i < count; ++i) {
+		PhiloxBlock words = this->block(first_pixel + i, sample, block);
+		for (std::size_t w = 0; w < 4; ++w)
+			out[w][i] = uniform_float(words[w]);
+	}
+}
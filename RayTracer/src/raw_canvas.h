@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include "lib.h"
+#include "render.h"
+#include "paged_canvas.h"
+
+// Lossless float canvases, for renders done in pieces. A file holds a rectangle of
+// a frame, possibly the whole frame, as rows of float RGB:
+//
+//   RawCanvasHeader
+//   float[3] per pixel, rows top to bottom
+//
+// `weight` is how many samples per pixel the values average, so separately rendered
+// sample sets can be combined. Files are read and written a row at a time, which
+// keeps merging bounded by a few rows per input whatever the frame size.
+
+constexpr char RAW_CANVAS_MAGIC[8] = { 'R', 'T', 'R', 'A', 'W', '\0', '\0', '\0' };
+constexpr std::uint32_t RAW_CANVAS_VERSION = 1;
+
+struct RawCanvasHeader {
+	char magic[8];
+	std::uint32_t version;
+	float weight;
+	std::uint64_t frame_width, frame_height;
+	// The rectangle of the frame this file holds
+	std::uint64_t x0, y0, width, height;
+};
+
+struct RawCanvasError {
+	std::string message;
+};
+
+RawCanvasHeader raw_canvas_header(std::size_t frame_width, std::size_t frame_height, const PixelRect& region, float weight) {
+	RawCanvasHeader h{};
+	std::memcpy(h.magic, RAW_CANVAS_MAGIC, sizeof(h.magic));
+	h.version = RAW_CANVAS_VERSION;
+	h.weight = weight;
+	h.frame_width = frame_width;
+	h.frame_height = frame_height;
+	h.x0 = region.x0;
+	h.y0 = region.y0;
+	h.width = region.x1 - region.x0;
+	h.height = region.y1 - region.y0;
+	return h;
+}
+
+class RawCanvasReader {
+public:
+	// Throws RawCanvasError if the file can't be opened or isn't a raw canvas
+	explicit RawCanvasReader(const std::string& path);
+
+	const RawCanvasHeader& header() const;
+	bool covers_row(std::size_t y) const;
+	// The next row of the rectangle: 3 * header().width floats
+	void read_row(float* rgb);
+private:
+	std::string path;
+	std::ifstream file;
+	RawCanvasHeader h;
+};
+
+class RawCanvasWriter {
+public:
+	// Throws RawCanvasError if the file can't be created
+	RawCanvasWriter(const std::string& path, const RawCanvasHeader& header);
+
+	const RawCanvasHeader& header() const;
+	void write_row(const float* rgb);
+	// Throws RawCanvasError if any write failed
+	void close();
+private:
+	std::string path;
+	std::ofstream file;
+	RawCanvasHeader h;
+};
+
+RawCanvasReader::RawCanvasReader(const std::string& path) : path{ path }, file{ path, std::ios::binary } {
+	if (!file)
+		throw RawCanvasError{ "can't open " + path };
+	if (!file.read(reinterpret_cast<char*>(&h), sizeof(h))
+		|| std::memcmp(h.magic, RAW_CANVAS_MAGIC, sizeof(h.magic)) != 0
+		|| h.version != RAW_CANVAS_VERSION)
+		throw RawCanvasError{ path + " is not a raw canvas" };
+	if (h.x0 + h.width > h.frame_width || h.y0 + h.height > h.frame_height)
+		throw RawCanvasError{ path + " holds a rectangle outside its frame" };
+}
+
+const RawCanvasHeader& RawCanvasReader::header() const {
+	return h;
+}
+
+bool RawCanvasReader::covers_row(std::size_t y) const {
+	return y >= h.y0 && y < h.y0 + h.height;
+}
+
+void RawCanvasReader::read_row(float* rgb) {
+	if (!file.read(reinterpret_cast<char*>(rgb), static_cast<std::streamsize>(3 * h.width * sizeof(float))))
+		throw RawCanvasError{ path + " is truncated" };
+}
+
+RawCanvasWriter::RawCanvasWriter(const std::string& path, const RawCanvasHeader& header)
+	: path{ path }, file{ path, std::ios::binary | std::ios::trunc }, h{ header } {
+	if (!file)
+		throw RawCanvasError{ "can't create " + path };
+	file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+}
+
+const RawCanvasHeader& RawCanvasWriter::header() const {
+	return h;
+}
+
+void RawCanvasWriter::write_row(const float* rgb) {
+	file.write(reinterpret_cast<const char*>(rgb), static_cast<std::streamsize>(3 * h.width * sizeof(float)));
+}
+
+void RawCanvasWriter::close() {
+	file.close();
+	if (!file)
+		throw RawCanvasError{ "can't write " + path };
+}
+
+// Saves `region` of `canvas`, whose size is the frame's
+void write_raw_canvas(const std::string& path, const Canvas& canvas, const PixelRect& region, float weight = 1) {
+	RawCanvasWriter writer(path, raw_canvas_header(canvas.width, canvas.height, region, weight));
+	std::vector<float> row(3 * (region.x1 - region.x0));
+	for (std::size_t y = region.y0; y < region.y1; ++y) {
+		for (std::size_t x = region.x0; x < region.x1; ++x) {
+			Color c = canvas.read_pixel(x, y);
+			std::memcpy(&row[3 * (x - region.x0)], &c, 3 * sizeof(float));
+		}
+		writer.write_row(row.data());
+	}
+	writer.close();
+}
+
+void write_raw_canvas(const std::string& path, const Canvas& canvas, float weight = 1) {
+	write_raw_canvas(path, canvas, PixelRect{ 0, 0, canvas.width, canvas.height }, weight);
+}
+
+// Saves a crop with the frame size and position it was cut from, so RayMerge can
+// paste it back
+void write_raw_canvas(const std::string& path, const CropCanvas& crop, float weight = 1) {
+	RawCanvasWriter writer(path, raw_canvas_header(crop.frame_width, crop.frame_height, crop.region, weight));
+	std::vector<float> row(3 * crop.region.width());
+	for (std::size_t y = 0; y < crop.region.height(); ++y) {
+		for (std::size_t x = 0; x < crop.region.width(); ++x) {
+			Color c = crop.canvas.read_pixel(x, y);
+			std::memcpy(&row[3 * x], &c, 3 * sizeof(float));
+		}
+		writer.write_row(row.data());
+	}
+	writer.close();
+}
+
+// Saves a paged canvas whole, reading it back a row of tiles at a time
+void write_raw_canvas(const std::string& path, const PagedCanvas& canvas, float weight = 1) {
+	RawCanvasWriter writer(path, raw_canvas_header(canvas.width, canvas.height, PixelRect{ 0, 0, canvas.width, canvas.height }, weight));
+	std::vector<float> row(3 * canvas.width);
+	std::size_t step = canvas.grid().tile_size;
+	for (std::size_t y0 = 0; y0 < canvas.height; y0 += step) {
+		Canvas rows = canvas.read_rows(y0, std::min(y0 + step, canvas.height));
+		for (std::size_t y = 0; y < rows.height; ++y) {
+			for (std::size_t x = 0; x < rows.width; ++x) {
+				Color c = rows.read_pixel(x, y);
+				std::memcpy(&row[3 * x], &c, 3 * sizeof(float));
+			}
+			writer.write_row(row.data());
+		}
+	}
+	writer.close();
+}
+
+// Copies the file's rectangle into `canvas`, which must be frame sized; the rest of
+// the canvas is left alone. Returns the header.
+RawCanvasHeader read_raw_canvas(const std::string& path, Canvas& canvas) {
+	RawCanvasReader reader(path);
+	const RawCanvasHeader& h = reader.header();
+	if (h.frame_width != canvas.width || h.frame_height != canvas.height)
+		throw RawCanvasError{ path + " is from a frame of another size" };
+	std::vector<float> row(3 * h.width);
+	for (std::size_t y = h.y0; y < h.y0 + h.height; ++y) {
+		reader.read_row(row.data());
+		for (std::size_t i = 0; i < h.width; ++i)
+			canvas.write_pixel(h.x0 + i, y, color(row[3 * i], row[3 * i + 1], row[3 * i + 2]));
+	}
+	return h;
+}
+
+enum class MergeMode {
+	// Pastes each input's rectangle into the frame; where rectangles overlap, later inputs win
+	COMPOSE,
+	// Per pixel, the weight-weighted mean of the inputs covering it
+	AVERAGE,
+};
+
+// Merges inputs from the same frame into one whole-frame raw canvas. Pixels no input
+// covers are black. The output weight is the smallest input weight for COMPOSE and
+// the total for AVERAGE. Throws RawCanvasError on unreadable or mismatched inputs,
+// or an output that is one of the inputs.
+RawCanvasHeader merge_raw_canvases(const std::vector<std::string>& inputs, const std::string& output, MergeMode mode) {
+	if (inputs.empty())
+		throw RawCanvasError{ "nothing to merge" };
+	// Creating the output would truncate that input before it's read
+	for (const std::string& path : inputs) {
+		std::error_code missing;
+		if (std::filesystem::equivalent(output, path, missing))
+			throw RawCanvasError{ output + " is also an input" };
+	}
+	std::vector<std::unique_ptr<RawCanvasReader>> readers;
+	for (const std::string& path : inputs)
+		readers.push_back(std::make_unique<RawCanvasReader>(path));
+
+	const RawCanvasHeader& first = readers[0]->header();
+	float weight = mode == MergeMode::COMPOSE ? first.weight : 0.f;
+	for (std::size_t i = 0; i < readers.size(); ++i) {
+		const RawCanvasHeader& h = readers[i]->header();
+		if (h.frame_width != first.frame_width || h.frame_height != first.frame_height)
+			throw RawCanvasError{ inputs[i] + " is from a frame of another size" };
+		weight = mode == MergeMode::COMPOSE ? std::min(weight, h.weight) : weight + h.weight;
+	}
+
+	std::size_t width = static_cast<std::size_t>(first.frame_width);
+	std::size_t height = static_cast<std::size_t>(first.frame_height);
+	RawCanvasWriter writer(output, raw_canvas_header(width, height, PixelRect{ 0, 0, width, height }, weight));
+	std::vector<float> row(3 * width);
+	std::vector<float> total_weight(width);
+	std::vector<float> input;
+	for (std::size_t y = 0; y < height; ++y) {
+		std::fill(row.begin(), row.end(), 0.f);
+		std::fill(total_weight.begin(), total_weight.end(), 0.f);
+		for (auto& reader : readers) {
+			if (!reader->covers_row(y))
+				continue;
+			const RawCanvasHeader& h = reader->header();
+			input.resize(3 * h.width);
+			reader->read_row(input.data());
+			float* out = &row[3 * h.x0];
+			if (mode == MergeMode::COMPOSE) {
+				std::copy(input.begin(), input.end(), out);
+				continue;
+			}
+			for (std::size_t i = 0; i < 3 * h.width; ++i)
+				out[i] += input[i] * h.weight;
+			for (std::size_t i = 0; i < h.width; ++i)
+				total_weight[h.x0 + i] += h.weight;
+		}
+		if (mode == MergeMode::AVERAGE) {
+			for (std::size_t x = 0; x < width; ++x) {
+				if (total_weight[x] > 0) {
+					for (std::size_t c = 0; c < 3; ++c)
+						row[3 * x + c] /= total_weight[x];
+				}
+			}
+		}
+		writer.write_row(row.data());
+	}
+	writer.close();
+	return writer.header();
+}
+
+// Streams the raw canvas at `raw_path` to a plain PPM at `path` of the rectangle it
+// holds, a row at a time. Throws RawCanvasError.
+void raw_canvas_to_ppm(const std::string& raw_path, const std::string& path, int maxval = 255) {
+	RawCanvasReader reader(raw_path);
+	const RawCanvasHeader& h = reader.header();
+	std::size_t width = static_cast<std::size_t>(h.width);
+	std::size_t height = static_cast<std::size_t>(h.height);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw RawCanvasError{ "can't create " + path };
+	file << plainPPMHeader(width, height, maxval);
+	std::vector<float> rgb(3 * width);
+	Canvas row(width, 1);
+	for (std::size_t y = 0; y < height; ++y) {
+		reader.read_row(rgb.data());
+		for (std::size_t x = 0; x < width; ++x)
+			row.write_pixel(x, 0, color(rgb[3 * x], rgb[3 * x + 1], rgb[3 * x + 2]));
+		file << CanvasToPPM(row, maxval).toPlainPixels();
+	}
+	file.close();
+	if (!file)
+		throw RawCanvasError{ "can't write " + path };
+}
@@ -0,0 +1,542 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include "lib.h"
+#include "sphere_batch.h"
+#include "camera.h"
+#include "random.h"
+#include "thread_pool.h"
+
+// Primary visibility, tile by tile. Before rendering, each object's bounding box is
+// projected through the camera to a conservative pixel rectangle and the object is
+// binned into the tiles that rectangle overlaps, so a pixel only tests the objects
+// that can appear in its tile. The bins are only valid for rays from the camera.
+
+constexpr std::size_t TILE_SIZE = 16;
+
+// Pixels [x0, x1) x [y0, y1)
+struct PixelRect {
+	std::size_t x0, y0, x1, y1;
+
+	bool empty() const {
+		return x0 >= x1 || y0 >= y1;
+	}
+	std::size_t width() const {
+		return x1 - x0;
+	}
+	std::size_t height() const {
+		return y1 - y0;
+	}
+};
+
+// The pixels in both; empty if none
+PixelRect overlap(const PixelRect& a, const PixelRect& b) {
+	PixelRect r{ std::max(a.x0, b.x0), std::max(a.y0, b.y0), std::min(a.x1, b.x1), std::min(a.y1, b.y1) };
+	return r.empty() ? PixelRect{ 0, 0, 0, 0 } : r;
+}
+
+// The canvas split into row-major tiles of tile_size pixels; edge tiles are clipped
+struct TileGrid {
+	std::size_t width, height;
+	std::size_t tile_size = TILE_SIZE;
+
+	std::size_t columns() const;
+	std::size_t rows() const;
+	std::size_t count() const;
+	PixelRect tile(std::size_t index) const;
+};
+
+// Objects binned per tile. Each tile's objects keep their batch order and have their
+// rows copied next to each other, so a tile is one contiguous SphereBatchView.
+struct TileBins {
+	TileGrid grid;
+	std::vector<std::size_t> offsets;   // tile t owns entries [offsets[t], offsets[t + 1])
+	std::vector<std::uint32_t> objects; // per entry, the object's index in the source batch
+	SphereBatch batch;                  // per entry, the object's rows
+	std::vector<PixelRect> covered;     // per source object, the tiles it overlaps (in tiles, not pixels)
+
+	TileBins() = default;
+	// No objects binned yet
+	explicit TileBins(const TileGrid& grid);
+
+	SphereBatchView view(std::size_t tile) const;
+};
+
+std::size_t TileGrid::columns() const {
+	return (width + tile_size - 1) / tile_size;
+}
+
+std::size_t TileGrid::rows() const {
+	return (height + tile_size - 1) / tile_size;
+}
+
+std::size_t TileGrid::count() const {
+	return columns() * rows();
+}
+
+PixelRect TileGrid::tile(std::size_t index) const {
+	std::size_t x = index % columns() * tile_size;
+	std::size_t y = index / columns() * tile_size;
+	return PixelRect{ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) };
+}
+
+TileBins::TileBins(const TileGrid& grid) : grid{ grid } {}
+
+SphereBatchView TileBins::view(std::size_t tile) const {
+	SphereBatchView v{};
+	for (std::size_t e = 0; e < 12; ++e) {
+		v.rows[e] = batch.rows[e].data() + offsets[tile];
+	}
+	v.ids = batch.ids.data() + offsets[tile];
+	v.count = offsets[tile + 1] - offsets[tile];
+	return v;
+}
+
+// The object-to-world transform of a batch entry, recovered from its inverse rows
+AffineTransform batch_transform(const SphereBatchView& batch, std::size_t i) {
+	const float* const* m = batch.rows;
+	AffineTransform inverse({
+		{ m[0][i], m[1][i], m[2][i], m[3][i] },
+		{ m[4][i], m[5][i], m[6][i], m[7][i] },
+		{ m[8][i], m[9][i], m[10][i], m[11][i] },
+	});
+	return inverse.inverse();
+}
+
+// The pixels whose camera rays can hit the unit sphere under `object_to_world`.
+// Empty when the sphere is entirely behind the camera; the whole canvas when it
+// straddles the camera plane and can't be projected.
+PixelRect screen_footprint(const Camera& camera, const AffineTransform& object_to_world) {
+	const AffineTransform& m = object_to_world;
+	PixelRect all{ 0, 0, camera.hsize, camera.vsize };
+	PixelRect none{ 0, 0, 0, 0 };
+
+	// The tightest world-space box around the transformed sphere
+	float extent[3];
+	for (std::size_t r = 0; r < 3; ++r)
+		extent[r] = std::sqrt(m[r][0] * m[r][0] + m[r][1] * m[r][1] + m[r][2] * m[r][2]);
+
+	float inf = std::numeric_limits<float>::infinity();
+	float u_min = inf, u_max = -inf, v_min = inf, v_max = -inf;
+	std::size_t behind = 0;
+	for (int c = 0; c < 8; ++c) {
+		Point corner{
+			m[0][3] + (c & 1 ? extent[0] : -extent[0]),
+			m[1][3] + (c & 2 ? extent[1] : -extent[1]),
+			m[2][3] + (c & 4 ? extent[2] : -extent[2]),
+			1.f
+		};
+		Point p = camera.get_transform() * corner;
+		float x = p.x, y = p.y;
+		if (camera.projection == Projection::PERSPECTIVE) {
+			if (p.z >= 0) {
+				++behind;
+				continue;
+			}
+			x /= -p.z;
+			y /= -p.z;
+		}
+		else if (p.z > 0) {
+			++behind;
+		}
+		// Pixel i's ray passes through u = i + 0.5
+		float u = (camera.half_width - x) / camera.pixel_size;
+		float v = (camera.half_height - y) / camera.pixel_size;
+		u_min = std::min(u_min, u);
+		u_max = std::max(u_max, u);
+		v_min = std::min(v_min, v);
+		v_max = std::max(v_max, v);
+	}
+	if (behind == 8)
+		return none;
+	if (behind > 0 && camera.projection == Projection::PERSPECTIVE)
+		return all;
+
+	// A pixel of margin absorbs rounding in the projection
+	auto first = [](float f, std::size_t size) {
+		return static_cast<std::size_t>(clamp(std::floor(f) - 1, 0.f, static_cast<float>(size)));
+	};
+	auto last = [](float f, std::size_t size) {
+		return static_cast<std::size_t>(clamp(std::ceil(f) + 1, 0.f, static_cast<float>(size)));
+	};
+	return PixelRect{ first(u_min, camera.hsize), first(v_min, camera.vsize), last(u_max, camera.hsize), last(v_max, camera.vsize) };
+}
+
+// The tiles overlapped by batch entry i's footprint
+PixelRect covered_tiles(const Camera& camera, const TileGrid& grid, const SphereBatchView& batch, std::size_t i) {
+	PixelRect r = screen_footprint(camera, batch_transform(batch, i));
+	if (r.empty())
+		return PixelRect{ 0, 0, 0, 0 };
+	return PixelRect{ r.x0 / grid.tile_size, r.y0 / grid.tile_size, (r.x1 - 1) / grid.tile_size + 1, (r.y1 - 1) / grid.tile_size + 1 };
+}
+
+TileBins bin_objects(const Camera& camera, const TileGrid& grid, const SphereBatchView& batch) {
+	TileBins bins{ grid };
+	std::size_t columns = grid.columns();
+	bins.offsets.assign(grid.count() + 1, 0);
+
+	// The tile rectangle each object covers, then a counting sort into the tiles
+	std::vector<PixelRect>& covered = bins.covered;
+	covered.resize(batch.count);
+	for (std::size_t i = 0; i < batch.count; ++i) {
+		covered[i] = covered_tiles(camera, grid, batch, i);
+		for (std::size_t ty = covered[i].y0; ty < covered[i].y1; ++ty) {
+			for (std::size_t tx = covered[i].x0; tx < covered[i].x1; ++tx)
+				++bins.offsets[ty * columns + tx + 1];
+		}
+	}
+	for (std::size_t t = 0; t < grid.count(); ++t)
+		bins.offsets[t + 1] += bins.offsets[t];
+
+	std::size_t entries = bins.offsets.back();
+	bins.objects.resize(entries);
+	std::vector<std::size_t> next(bins.offsets.begin(), bins.offsets.end() - 1);
+	for (std::size_t i = 0; i < batch.count; ++i) {
+		for (std::size_t ty = covered[i].y0; ty < covered[i].y1; ++ty) {
+			for (std::size_t tx = covered[i].x0; tx < covered[i].x1; ++tx)
+				bins.objects[next[ty * columns + tx]++] = static_cast<std::uint32_t>(i);
+		}
+	}
+
+	for (std::size_t e = 0; e < 12; ++e) {
+		bins.batch.rows[e].resize(entries);
+		for (std::size_t k = 0; k < entries; ++k)
+			bins.batch.rows[e][k] = batch.rows[e][bins.objects[k]];
+	}
+	bins.batch.ids.resize(entries);
+	for (std::size_t k = 0; k < entries; ++k)
+		bins.batch.ids[k] = batch.ids[bins.objects[k]];
+	return bins;
+}
+
+// Random dimensions per sample, drawn from CounterRng keyed by the pixel's index in
+// the canvas. Block 0 holds the pixel jitter; new stochastic features take the
+// following dimensions.
+enum SampleDimension : std::uint32_t {
+	JITTER_U,
+	JITTER_V,
+};
+
+struct RenderSettings {
+	// One sample goes through the pixel center; more are jittered and averaged
+	std::uint32_t samples = 1;
+	std::uint64_t seed = 0;
+	unsigned threads = 1;
+	// When set, tiles run on the pool's workers instead of `threads` new threads
+	ThreadPool* pool = nullptr;
+};
+
+// Traces the camera rays of the pixels of one tile inside `clip` against the tile's
+// objects. Frame pixel (x, y) goes to canvas pixel (x - x0, y - y0), so `canvas`
+// can be the whole frame or a crop starting at (x0, y0). shade(ray, hit) gives each
+// sample's colour, where hit.index is an index into the batch the bins were built
+// from. shade must be safe to call from several threads when settings.threads > 1
+// or settings.pool is set.
+template<class Shade>
+void render_tile_pixels(const Camera& camera, const TileBins& bins, std::size_t tile, const PixelRect& clip,
+	Canvas& canvas, std::size_t x0, std::size_t y0, Shade&& shade, const RenderSettings& settings = {}) {
+	PixelRect r = overlap(bins.grid.tile(tile), clip);
+	if (r.empty())
+		return;
+	SphereBatchView objects = bins.view(tile);
+	const std::uint32_t* source = bins.objects.data() + bins.offsets[tile];
+	auto trace = [&](const Ray& ray) {
+		BatchHit hit = intersect_nearest(objects, ray);
+		if (hit.hit())
+			hit.index = source[hit.index];
+		return shade(ray, hit);
+	};
+
+	if (settings.samples <= 1) {
+		for (std::size_t y = r.y0; y < r.y1; ++y) {
+			RayRow row = camera.row(y);
+			for (std::size_t x = r.x0; x < r.x1; ++x)
+				canvas.write_pixel(x - x0, y - y0, trace(row.at(x)));
+		}
+		return;
+	}
+
+	CounterRng rng(settings.seed);
+	std::size_t width = r.x1 - r.x0;
+	std::vector<float> jitter(4 * width);
+	float* const blocks[4] = { &jitter[0], &jitter[width], &jitter[2 * width], &jitter[3 * width] };
+	std::vector<Color> sum(width);
+	for (std::size_t y = r.y0; y < r.y1; ++y) {
+		RayRow row = camera.row(y);
+		std::fill(sum.begin(), sum.end(), color(0, 0, 0));
+		for (std::uint32_t sample = 0; sample < settings.samples; ++sample) {
+			rng.uniform_blocks(y * bins.grid.width + r.x0, width, sample, 0, blocks);
+			for (std::size_t i = 0; i < width; ++i)
+				sum[i] = sum[i] + trace(row.at(r.x0 + i, blocks[JITTER_U][i], blocks[JITTER_V][i]));
+		}
+		for (std::size_t i = 0; i < width; ++i)
+			canvas.write_pixel(r.x0 + i - x0, y - y0, sum[i] / static_cast<float>(settings.samples));
+	}
+}
+
+// Renders one whole tile into a frame-sized canvas
+template<class Shade>
+void render_tile(const Camera& camera, const TileBins& bins, std::size_t tile, Canvas& canvas, Shade&& shade, const RenderSettings& settings = {}) {
+	render_tile_pixels(camera, bins, tile, bins.grid.tile(tile), canvas, 0, 0, shade, settings);
+}
+
+// Runs work(tile) for each of `tiles` on settings.pool, or else on settings.threads
+// threads. Tiles are handed out one at a time from a shared counter. If work throws,
+// no more tiles are handed out and the first exception is rethrown once every
+// thread has stopped.
+template<class Work>
+void for_each_tile(const std::vector<std::size_t>& tiles, const RenderSettings& settings, Work&& work) {
+	if (settings.pool) {
+		settings.pool->parallel_for(tiles.size(), [&](std::size_t i) { work(tiles[i]); });
+		return;
+	}
+	unsigned threads = settings.threads;
+	if (threads <= 1 || tiles.size() <= 1) {
+		for (std::size_t t : tiles)
+			work(t);
+		return;
+	}
+	std::atomic<std::size_t> next{ 0 };
+	std::exception_ptr failure;
+	std::mutex failure_mutex;
+	auto worker = [&]() {
+		for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tiles.size();) {
+			try {
+				work(tiles[i]);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(failure_mutex);
+				if (!failure)
+					failure = std::current_exception();
+				next = tiles.size();
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned t = 1; t < std::min<std::size_t>(threads, tiles.size()); ++t)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread& w : workers)
+		w.join();
+	if (failure)
+		std::rethrow_exception(failure);
+}
+
+std::vector<std::size_t> all_tiles(const TileGrid& grid) {
+	std::vector<std::size_t> tiles(grid.count());
+	for (std::size_t t = 0; t < tiles.size(); ++t)
+		tiles[t] = t;
+	return tiles;
+}
+
+// Position of tile (x, y) along a Hilbert curve through an n x n grid, n a power of two
+std::uint64_t hilbert_distance(std::uint64_t n, std::uint64_t x, std::uint64_t y) {
+	std::uint64_t d = 0;
+	for (std::uint64_t s = n / 2; s > 0; s /= 2) {
+		std::uint64_t rx = (x & s) ? 1 : 0;
+		std::uint64_t ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so the curve inside it runs the right way
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x % s;
+				y = s - 1 - y % s;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+// The grid's tiles along a Hilbert curve, so the tiles in flight at once stay close
+// together: their objects and rays are more alike than a row of tiles across the
+// frame, and so are the pixels they write. Consecutive tiles share an edge, except
+// where the curve through the next power-of-two square steps outside the grid.
+std::vector<std::size_t> hilbert_tiles(const TileGrid& grid) {
+	std::size_t columns = grid.columns();
+	std::uint64_t n = 1;
+	while (n < columns || n < grid.rows())
+		n *= 2;
+	std::vector<std::pair<std::uint64_t, std::size_t>> keyed(grid.count());
+	for (std::size_t t = 0; t < keyed.size(); ++t)
+		keyed[t] = { hilbert_distance(n, t % columns, t / columns), t };
+	std::sort(keyed.begin(), keyed.end());
+	std::vector<std::size_t> tiles(keyed.size());
+	for (std::size_t i = 0; i < keyed.size(); ++i)
+		tiles[i] = keyed[i].second;
+	return tiles;
+}
+
+// Every sample is a function of its pixel, sample number and the seed, so the image
+// is the same for any thread count. Tiles are handed out in hilbert_tiles() order.
+template<class Shade>
+void render(const Camera& camera, const TileBins& bins, Canvas& canvas, Shade&& shade, const RenderSettings& settings = {}) {
+	for_each_tile(hilbert_tiles(bins.grid), settings, [&](std::size_t t) {
+		render_tile(camera, bins, t, canvas, shade, settings);
+	});
+}
+
+// The tiles overlapping `region`, in index order
+std::vector<std::size_t> region_tiles(const TileGrid& grid, const PixelRect& region) {
+	std::vector<std::size_t> tiles;
+	PixelRect r = overlap(region, PixelRect{ 0, 0, grid.width, grid.height });
+	if (r.empty())
+		return tiles;
+	std::size_t columns = grid.columns();
+	for (std::size_t ty = r.y0 / grid.tile_size; ty <= (r.y1 - 1) / grid.tile_size; ++ty) {
+		for (std::size_t tx = r.x0 / grid.tile_size; tx <= (r.x1 - 1) / grid.tile_size; ++tx)
+			tiles.push_back(ty * columns + tx);
+	}
+	return tiles;
+}
+
+// Renders the pixels of a frame-sized canvas inside `region` and leaves the rest as
+// they are. They come out as render() would draw them.
+template<class Shade>
+void render_region(const Camera& camera, const TileBins& bins, const PixelRect& region, Canvas& canvas, Shade&& shade, const RenderSettings& settings = {}) {
+	for_each_tile(region_tiles(bins.grid, region), settings, [&](std::size_t t) {
+		render_tile_pixels(camera, bins, t, region, canvas, 0, 0, shade, settings);
+	});
+}
+
+// A crop of a frame: frame pixel (x, y) is canvas pixel (x - region.x0, y - region.y0)
+struct CropCanvas {
+	std::size_t frame_width, frame_height;
+	PixelRect region;
+	Canvas canvas;
+
+	CropCanvas(std::size_t frame_width, std::size_t frame_height, const PixelRect& region);
+};
+
+CropCanvas::CropCanvas(std::size_t frame_width, std::size_t frame_height, const PixelRect& region)
+	: frame_width{ frame_width }, frame_height{ frame_height }, region{ region }, canvas(region.width(), region.height()) {
+}
+
+// Renders `region`, clipped to the frame, into a canvas of just that size
+template<class Shade>
+CropCanvas render_crop(const Camera& camera, const TileBins& bins, const PixelRect& region, Shade&& shade, const RenderSettings& settings = {}) {
+	PixelRect clipped = overlap(region, PixelRect{ 0, 0, bins.grid.width, bins.grid.height });
+	CropCanvas crop(bins.grid.width, bins.grid.height, clipped);
+	for_each_tile(region_tiles(bins.grid, clipped), settings, [&](std::size_t t) {
+		render_tile_pixels(camera, bins, t, clipped, crop.canvas, clipped.x0, clipped.y0, shade, settings);
+	});
+	return crop;
+}
+
+// A row-major canvas of `region`'s size holding its pixels, e.g. to encode just a region
+Canvas copy_region(const Canvas& canvas, const PixelRect& region) {
+	Canvas copy(region.width(), region.height());
+	std::vector<Tuple> scratch(canvas.width);
+	for (std::size_t y = 0; y < region.height(); ++y) {
+		const Tuple* row = canvas.row(region.y0 + y, scratch.data()) + region.x0;
+		std::copy(row, row + region.width(), copy.canvas + copy.index(0, y));
+	}
+	return copy;
+}
+
+// Rebins the objects at `changed` (indices into `batch`, whose rows already hold
+// their new transforms) and returns the tiles they covered before or cover now, in
+// ascending order. Only those tiles' lists change; the rest are copied as they are.
+// The batch must have the same objects in the same order as when the bins were built.
+// The new lists are built in `spare`, which is swapped with `bins`; passing the same
+// spare every frame reuses its storage instead of allocating.
+std::vector<std::size_t> update_bins(const Camera& camera, TileBins& bins, const SphereBatchView& batch, std::vector<std::size_t> changed, TileBins& spare) {
+	const TileGrid& grid = bins.grid;
+	std::size_t columns = grid.columns();
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+	std::vector<char> dirty(grid.count(), 0);
+	auto mark = [&](const PixelRect& r) {
+		for (std::size_t ty = r.y0; ty < r.y1; ++ty) {
+			for (std::size_t tx = r.x0; tx < r.x1; ++tx)
+				dirty[ty * columns + tx] = 1;
+		}
+	};
+	for (std::size_t i : changed) {
+		mark(bins.covered[i]);
+		bins.covered[i] = covered_tiles(camera, grid, batch, i);
+		mark(bins.covered[i]);
+	}
+
+	TileBins& updated = spare;
+	updated.grid = grid;
+	updated.covered.swap(bins.covered);
+	updated.offsets.assign(grid.count() + 1, 0);
+	updated.objects.clear();
+	updated.objects.reserve(bins.objects.size() + changed.size());
+	std::vector<std::size_t> tiles;
+	for (std::size_t t = 0; t < grid.count(); ++t) {
+		const std::uint32_t* old_begin = bins.objects.data() + bins.offsets[t];
+		const std::uint32_t* old_end = bins.objects.data() + bins.offsets[t + 1];
+		if (!dirty[t]) {
+			updated.objects.insert(updated.objects.end(), old_begin, old_end);
+		}
+		else {
+			// Merge the unchanged objects with the changed ones that land here, keeping batch order
+			tiles.push_back(t);
+			std::size_t tx = t % columns, ty = t / columns;
+			auto c = changed.begin();
+			for (const std::uint32_t* o = old_begin; o != old_end || c != changed.end();) {
+				if (c == changed.end() || (o != old_end && *o < *c)) {
+					updated.objects.push_back(*o++);
+					continue;
+				}
+				if (o != old_end && *o == *c)
+					++o;
+				const PixelRect& r = updated.covered[*c];
+				if (tx >= r.x0 && tx < r.x1 && ty >= r.y0 && ty < r.y1)
+					updated.objects.push_back(static_cast<std::uint32_t>(*c));
+				++c;
+			}
+		}
+		updated.offsets[t + 1] = updated.objects.size();
+	}
+
+	// Rows of clean tiles are copied in blocks; dirty tiles gather theirs from the batch
+	std::size_t entries = updated.objects.size();
+	for (std::size_t e = 0; e < 12; ++e)
+		updated.batch.rows[e].resize(entries);
+	updated.batch.ids.resize(entries);
+	for (std::size_t t = 0; t < grid.count(); ++t) {
+		std::size_t begin = updated.offsets[t], end = updated.offsets[t + 1];
+		if (!dirty[t]) {
+			std::size_t from = bins.offsets[t];
+			for (std::size_t e = 0; e < 12; ++e)
+				std::copy(bins.batch.rows[e].begin() + from, bins.batch.rows[e].begin() + from + (end - begin), updated.batch.rows[e].begin() + begin);
+			std::copy(bins.batch.ids.begin() + from, bins.batch.ids.begin() + from + (end - begin), updated.batch.ids.begin() + begin);
+		}
+		else {
+			for (std::size_t k = begin; k < end; ++k) {
+				for (std::size_t e = 0; e < 12; ++e)
+					updated.batch.rows[e][k] = batch.rows[e][updated.objects[k]];
+				updated.batch.ids[k] = batch.ids[updated.objects[k]];
+			}
+		}
+	}
+
+	std::swap(bins, spare);
+	return tiles;
+}
+
+std::vector<std::size_t> update_bins(const Camera& camera, TileBins& bins, const SphereBatchView& batch, const std::vector<std::size_t>& changed) {
+	TileBins spare{ bins.grid };
+	return update_bins(camera, bins, batch, changed, spare);
+}
+
+// Brings a canvas rendered from `bins` up to date after the objects at `changed`
+// moved: rebins them and re-renders only the tiles they covered before or cover now.
+// Returns the number of tiles re-rendered.
+template<class Shade>
+std::size_t rerender_changed(const Camera& camera, TileBins& bins, const SphereBatchView& batch, const std::vector<std::size_t>& changed, Canvas& canvas, Shade&& shade, const RenderSettings& settings = {}) {
+	std::vector<std::size_t> tiles = update_bins(camera, bins, batch, changed);
+	for_each_tile(tiles, settings, [&](std::size_t t) {
+		render_tile(camera, bins, t, canvas, shade, settings);
+	});
+	return tiles.size();
+}
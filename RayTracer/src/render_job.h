@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "lib.h"
+#include "camera.h"
+#include "render.h"
+
+// A render running in the background, for hosts that can't block while it runs.
+// The handle reports progress, can cancel the render, and can copy out what has
+// been rendered so far. Workers check for cancellation before each tile, so a
+// cancelled job stops within one tile per thread.
+
+enum class JobState {
+	RUNNING,
+	FINISHED,
+	CANCELLED,
+	// shade threw; wait() rethrows it
+	FAILED,
+};
+
+class RenderJob {
+public:
+	// Called after each finished tile with the tiles done so far and the total, from
+	// the render threads but never two at once
+	typedef std::function<void(std::size_t done, std::size_t total)> Progress;
+
+	// Starts rendering all of bins' tiles into a canvas of the job's own. The camera
+	// and shade are copied; `bins` must outlive the job. shade is called as by render().
+	template<class Shade>
+	RenderJob(const Camera& camera, const TileBins& bins, Shade shade, const RenderSettings& settings = {}, Progress progress = {});
+	// Cancels the render if it is still running and waits for its threads
+	~RenderJob();
+	RenderJob(const RenderJob&) = delete;
+	RenderJob& operator=(const RenderJob&) = delete;
+
+	JobState state() const;
+	std::size_t tiles_done() const;
+	std::size_t tiles_total() const;
+	// Returns at once; the job's state turns CANCELLED once its threads have stopped
+	void cancel();
+	// Blocks until the job stops. Returns true if every tile was rendered and false if
+	// it was cancelled, and rethrows shade's exception if it failed.
+	bool wait();
+	// false if the job is still running after `timeout`
+	bool wait_for(std::chrono::milliseconds timeout);
+	// A copy of the canvas with the tiles finished so far; unfinished tiles are black.
+	// Safe while the job runs.
+	Canvas snapshot() const;
+	// The finished canvas. Only once the job has stopped.
+	const Canvas& canvas() const;
+private:
+	const TileBins& bins;
+	Canvas pixels;
+	std::unique_ptr<std::atomic<bool>[]> finished;
+	std::atomic<std::size_t> done{ 0 };
+	std::atomic<bool> cancelling{ false };
+	Progress progress;
+	std::mutex progress_mutex;
+
+	mutable std::mutex mutex;
+	std::condition_variable stopped;
+	JobState current = JobState::RUNNING;
+	std::exception_ptr error;
+	std::thread thread;
+
+	void run(const std::function<void(std::size_t)>& render_one, const RenderSettings& settings);
+};
+
+template<class Shade>
+RenderJob::RenderJob(const Camera& camera, const TileBins& bins, Shade shade, const RenderSettings& settings, Progress progress)
+	: bins{ bins }, pixels(bins.grid.width, bins.grid.height), finished{ new std::atomic<bool>[bins.grid.count()] },
+	progress{ std::move(progress) } {
+	for (std::size_t t = 0; t < bins.grid.count(); ++t)
+		finished[t] = false;
+	thread = std::thread([this, camera, shade, settings]() mutable {
+		run([&](std::size_t t) { render_tile(camera, this->bins, t, pixels, shade, settings); }, settings);
+	});
+}
+
+RenderJob::~RenderJob() {
+	cancel();
+	thread.join();
+}
+
+void RenderJob::run(const std::function<void(std::size_t)>& render_one, const RenderSettings& settings) {
+	std::size_t total = bins.grid.count();
+	for_each_tile(hilbert_tiles(bins.grid), settings, [&](std::size_t t) {
+		if (cancelling)
+			return;
+		try {
+			render_one(t);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+			cancelling = true;
+			return;
+		}
+		finished[t].store(true, std::memory_order_release);
+		// Counted under the lock so progress is reported in order
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		std::size_t count = ++done;
+		if (progress)
+			progress(count, total);
+	});
+
+	std::lock_guard<std::mutex> lock(mutex);
+	current = error ? JobState::FAILED : done == total ? JobState::FINISHED : JobState::CANCELLED;
+	stopped.notify_all();
+}
+
+JobState RenderJob::state() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return current;
+}
+
+std::size_t RenderJob::tiles_done() const {
+	return done;
+}
+
+std::size_t RenderJob::tiles_total() const {
+	return bins.grid.count();
+}
+
+void RenderJob::cancel() {
+	cancelling = true;
+}
+
+bool RenderJob::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	stopped.wait(lock, [this]() { return current != JobState::RUNNING; });
+	if (error)
+		std::rethrow_exception(error);
+	return current == JobState::FINISHED;
+}
+
+bool RenderJob::wait_for(std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	return stopped.wait_for(lock, timeout, [this]() { return current != JobState::RUNNING; });
+}
+
+Canvas RenderJob::snapshot() const {
+	Canvas copy(pixels.width, pixels.height, pixels.layout);
+	for (std::size_t t = 0; t < bins.grid.count(); ++t) {
+		if (!finished[t].load(std::memory_order_acquire))
+			continue;
+		PixelRect r = bins.grid.tile(t);
+		for (std::size_t y = r.y0; y < r.y1; ++y) {
+			for (std::size_t x = r.x0; x < r.x1; ++x)
+				copy.canvas[copy.index(x, y)] = pixels.canvas[pixels.index(x, y)];
+		}
+	}
+	return copy;
+}
+
+const Canvas& RenderJob::canvas() const {
+	return pixels;
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include "lib.h"
+#include "sphere_batch.h"
+
+// Scene files are line based. '#' starts a comment; blank lines are ignored.
+//
+//   canvas 600 600
+//   output output.ppm
+//   camera fov 1.0472 from 0 0 -5 to 0 0 0 up 0 1 0
+//   sphere scale 2 2 2 rotate_y 0.5 translate 0 1 0
+//
+// A sphere's transform steps apply left to right, like the fluent Transform API:
+// translate x y z, scale x y z, rotate_x r, rotate_y r, rotate_z r and
+// shear xy xz yx yz zx zy. Every camera setting is optional.
+
+struct CameraSettings {
+	float field_of_view = M_PI / 3;
+	Point from = point(0, 0, -5);
+	Point to = point(0, 0, 0);
+	Vector up = vector(0, 1, 0);
+};
+
+struct Scene {
+	// Ids are dense per scene, so objects[i].id == i for loaded scenes
+	ObjectRegistry registry;
+	std::vector<Sphere> objects;
+	SphereBatch batch;
+	std::size_t width = 600;
+	std::size_t height = 600;
+	std::string output = "output.ppm";
+	CameraSettings camera;
+
+	Sphere& add(const AffineTransform& transform);
+	// Moves objects[index], keeping its batch rows in sync
+	void set_transform(std::size_t index, const AffineTransform& transform);
+	void reserve(std::size_t count);
+};
+
+struct SceneError {
+	std::size_t line, column; // 1-based
+	std::string message;
+};
+
+Sphere& Scene::add(const AffineTransform& transform) {
+	Sphere s(registry.allocate());
+	s.set_transform(transform);
+	batch.add(s);
+	objects.push_back(s);
+	return objects.back();
+}
+
+void Scene::set_transform(std::size_t index, const AffineTransform& transform) {
+	objects[index].set_transform(transform);
+	batch.set(index, objects[index]);
+}
+
+void Scene::reserve(std::size_t count) {
+	objects.reserve(count);
+	batch.reserve(count);
+}
+
+std::ostream& operator<<(std::ostream& o, const SceneError& e) {
+	return o << e.line << ":" << e.column << ": " << e.message;
+}
+
+// A single pass over the text. Tokens are views into the source and numbers are
+// parsed in place, so the only allocations are the scene's own storage.
+class SceneParser {
+public:
+	SceneParser(std::string_view source, Scene& scene);
+	void parse();
+private:
+	const char* cursor;
+	const char* end;
+	const char* line_start;
+	std::size_t line = 1;
+	Scene& scene;
+
+	void skip_blanks();
+	bool at_line_end();
+	void next_line();
+	std::string_view word(const char* what);
+	float number();
+	std::size_t size();
+	Tuple triple(float w);
+	void parse_sphere();
+	void parse_camera();
+	[[noreturn]] void fail(const char* at, const std::string& message) const;
+};
+
+SceneParser::SceneParser(std::string_view source, Scene& scene)
+	: cursor{ source.data() }, end{ source.data() + source.size() }, line_start{ source.data() }, scene{ scene } {
+}
+
+void SceneParser::fail(const char* at, const std::string& message) const {
+	throw SceneError{ line, static_cast<std::size_t>(at - line_start) + 1, message };
+}
+
+// Spaces, tabs, carriage returns and comments, but not newlines
+void SceneParser::skip_blanks() {
+	while (cursor < end) {
+		if (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') {
+			++cursor;
+		}
+		else if (*cursor == '#') {
+			while (cursor < end && *cursor != '\n')
+				++cursor;
+		}
+		else {
+			break;
+		}
+	}
+}
+
+bool SceneParser::at_line_end() {
+	skip_blanks();
+	return cursor == end || *cursor == '\n';
+}
+
+void SceneParser::next_line() {
+	if (!at_line_end()) {
+		std::string_view extra = word("a token");
+		fail(extra.data(), "unexpected '" + std::string(extra) + "'");
+	}
+	if (cursor < end) {
+		++cursor;
+		++line;
+		line_start = cursor;
+	}
+}
+
+std::string_view SceneParser::word(const char* what) {
+	if (at_line_end())
+		fail(cursor, std::string("expected ") + what);
+	const char* begin = cursor;
+	while (cursor < end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n' && *cursor != '#')
+		++cursor;
+	return std::string_view(begin, cursor - begin);
+}
+
+float SceneParser::number() {
+	std::string_view token = word("a number");
+	float value = 0;
+	auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+	if (result.ec != std::errc() || result.ptr != token.data() + token.size())
+		fail(token.data(), "expected a number, got '" + std::string(token) + "'");
+	return value;
+}
+
+std::size_t SceneParser::size() {
+	std::string_view token = word("a size");
+	std::size_t value = 0;
+	auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+	if (result.ec != std::errc() || result.ptr != token.data() + token.size() || value == 0)
+		fail(token.data(), "expected a positive integer, got '" + std::string(token) + "'");
+	return value;
+}
+
+Tuple SceneParser::triple(float w) {
+	float x = number();
+	float y = number();
+	float z = number();
+	return Tuple{ x, y, z, w };
+}
+
+void SceneParser::parse_sphere() {
+	TransformBuilder builder;
+	while (!at_line_end()) {
+		std::string_view step = word("a transform");
+		if (step == "translate") {
+			Tuple t = triple(0);
+			builder.translate(t.x, t.y, t.z);
+		}
+		else if (step == "scale") {
+			Tuple s = triple(0);
+			builder.scale(s.x, s.y, s.z);
+		}
+		else if (step == "rotate_x") {
+			builder.rotate_x(number());
+		}
+		else if (step == "rotate_y") {
+			builder.rotate_y(number());
+		}
+		else if (step == "rotate_z") {
+			builder.rotate_z(number());
+		}
+		else if (step == "shear") {
+			float v[6];
+			for (float& f : v)
+				f = number();
+			builder.shear(v[0], v[1], v[2], v[3], v[4], v[5]);
+		}
+		else {
+			fail(step.data(), "unknown transform '" + std::string(step) + "'");
+		}
+	}
+	if (!builder.transform.invertible())
+		fail(line_start, "sphere transform is not invertible");
+	scene.add(builder);
+}
+
+void SceneParser::parse_camera() {
+	while (!at_line_end()) {
+		std::string_view setting = word("a camera setting");
+		if (setting == "fov")
+			scene.camera.field_of_view = number();
+		else if (setting == "from")
+			scene.camera.from = triple(1);
+		else if (setting == "to")
+			scene.camera.to = triple(1);
+		else if (setting == "up")
+			scene.camera.up = triple(0);
+		else
+			fail(setting.data(), "unknown camera setting '" + std::string(setting) + "'");
+	}
+}
+
+void SceneParser::parse() {
+	while (cursor < end) {
+		if (at_line_end()) {
+			next_line();
+			continue;
+		}
+		std::string_view keyword = word("a keyword");
+		if (keyword == "sphere") {
+			parse_sphere();
+		}
+		else if (keyword == "camera") {
+			parse_camera();
+		}
+		else if (keyword == "canvas") {
+			scene.width = size();
+			scene.height = size();
+		}
+		else if (keyword == "output") {
+			std::string_view path = word("a path");
+			scene.output.assign(path.data(), path.size());
+		}
+		else {
+			fail(keyword.data(), "unknown keyword '" + std::string(keyword) + "'");
+		}
+		next_line();
+	}
+}
+
+// Throws SceneError on malformed input. Objects are appended to `scene`.
+void load_scene(std::string_view source, Scene& scene) {
+	// One object per line at most, so this is the only growth of the object tables
+	std::size_t lines = 1;
+	for (const char* p = source.data(); (p = static_cast<const char*>(std::memchr(p, '\n', source.data() + source.size() - p))) != nullptr; ++p)
+		++lines;
+	scene.reserve(scene.objects.size() + lines);
+	SceneParser(source, scene).parse();
+}
+
+// Throws SceneError with line 0 when the file can't be read
+std::string read_scene_file(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw SceneError{ 0, 0, "can't open " + path };
+	std::string source;
+	file.seekg(0, std::ios::end);
+	source.resize(static_cast<std::size_t>(file.tellg()));
+	file.seekg(0, std::ios::beg);
+	file.read(&source[0], source.size());
+	return source;
+}
+
+// Throws SceneError with line 0 when the file can't be read
+void load_scene_file(const std::string& path, Scene& scene) {
+	load_scene(read_scene_file(path), scene);
+}
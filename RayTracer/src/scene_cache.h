@@ -0,0 +1,361 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include "lib.h"
+#include "sphere_batch.h"
+#include "scene.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A loaded scene saved in the layout the renderer reads, so a cache file is mapped
+// and used in place. Every table is addressed by its offset from the start of the
+// file, which keeps the layout position-independent. Bump SCENE_CACHE_VERSION
+// whenever the layout or anything it stores changes.
+//
+//   SceneCacheHeader
+//   CachedObject[object_count]         forward transforms and ids
+//   float[object_count] x 12           the SphereBatch rows (precomputed inverses)
+//   int32[object_count]                the SphereBatch ids
+//   char[output_length]                output path
+//
+// There is no acceleration structure in the renderer yet; when one lands, its nodes
+// go in another table here and the version goes up.
+
+constexpr char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr std::uint32_t SCENE_CACHE_VERSION = 1;
+// Tables start on a 64-byte boundary so SIMD loads don't straddle cache lines
+constexpr std::uint64_t SCENE_CACHE_ALIGNMENT = 64;
+
+struct CachedObject {
+	std::int32_t id;
+	std::int32_t kind;
+	float transform[3][4];
+};
+
+struct SceneCacheHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t object_size;
+	std::uint64_t source_hash;
+	std::uint64_t object_count;
+	std::uint64_t width, height;
+	float field_of_view;
+	float from[3], to[3], up[3];
+	std::uint64_t objects_offset;
+	std::uint64_t rows_offset[12];
+	std::uint64_t ids_offset;
+	std::uint64_t output_offset, output_length;
+	std::uint64_t file_size;
+};
+
+// FNV-1a, used to tell whether the cache was built from the current scene text
+std::uint64_t scene_hash(std::string_view source) {
+	std::uint64_t hash = 14695981039346656037ull;
+	for (char c : source) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+Sphere cached_sphere(const CachedObject& object) {
+	Sphere s(object.id);
+	s.set_transform(AffineTransform(object.transform, static_cast<TransformKind>(object.kind)));
+	return s;
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const;
+	std::size_t size() const;
+private:
+	const char* bytes = nullptr;
+	std::size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) {
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+		return;
+	bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (bytes != nullptr)
+		length = static_cast<std::size_t>(file_size.QuadPart);
+}
+
+MappedFile::~MappedFile() {
+	if (bytes != nullptr)
+		UnmapViewOfFile(bytes);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		void* mapped = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED) {
+			bytes = static_cast<const char*>(mapped);
+			length = static_cast<std::size_t>(info.st_size);
+		}
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (bytes != nullptr)
+		munmap(const_cast<char*>(bytes), length);
+}
+
+#endif
+
+const char* MappedFile::data() const {
+	return bytes;
+}
+
+std::size_t MappedFile::size() const {
+	return length;
+}
+
+// A mapped cache file. Check valid() before using anything else.
+class SceneCache {
+public:
+	explicit SceneCache(const std::string& path);
+
+	// The file exists, has this build's layout and was built from source text with this hash
+	bool valid(std::uint64_t source_hash) const;
+
+	const SceneCacheHeader& header() const;
+	const CachedObject* objects() const;
+	std::size_t size() const;
+	SphereBatchView batch() const;
+	std::string output() const;
+	CameraSettings camera() const;
+	// Appends the cached objects to `scene`, for callers that move them; the mapping is read-only
+	void copy_objects(Scene& scene) const;
+private:
+	MappedFile file;
+	bool well_formed = false;
+
+	template<class T>
+	const T* table(std::uint64_t offset) const;
+};
+
+SceneCache::SceneCache(const std::string& path) : file{ path } {
+	if (file.size() < sizeof(SceneCacheHeader))
+		return;
+	const SceneCacheHeader& h = header();
+	if (std::memcmp(h.magic, SCENE_CACHE_MAGIC, sizeof(h.magic)) != 0
+		|| h.version != SCENE_CACHE_VERSION
+		|| h.object_size != sizeof(CachedObject)
+		|| h.file_size != file.size())
+		return;
+	// More objects than the file could hold would also overflow the table sizes below
+	if (h.object_count > file.size() / sizeof(CachedObject))
+		return;
+	// Every table has to lie inside the file
+	auto fits = [&](std::uint64_t offset, std::uint64_t bytes) {
+		return offset <= file.size() && bytes <= file.size() - offset;
+	};
+	well_formed = fits(h.objects_offset, h.object_count * sizeof(CachedObject))
+		&& fits(h.ids_offset, h.object_count * sizeof(std::int32_t))
+		&& fits(h.output_offset, h.output_length);
+	for (std::uint64_t offset : h.rows_offset)
+		well_formed = well_formed && fits(offset, h.object_count * sizeof(float));
+	// cached_sphere() casts the kind back, and a sphere's transform is at most affine
+	for (std::size_t i = 0; well_formed && i < size(); ++i) {
+		std::int32_t kind = objects()[i].kind;
+		well_formed = kind >= static_cast<std::int32_t>(TransformKind::IDENTITY)
+			&& kind <= static_cast<std::int32_t>(TransformKind::AFFINE);
+	}
+}
+
+bool SceneCache::valid(std::uint64_t source_hash) const {
+	return well_formed && header().source_hash == source_hash;
+}
+
+const SceneCacheHeader& SceneCache::header() const {
+	return *reinterpret_cast<const SceneCacheHeader*>(file.data());
+}
+
+template<class T>
+const T* SceneCache::table(std::uint64_t offset) const {
+	return reinterpret_cast<const T*>(file.data() + offset);
+}
+
+const CachedObject* SceneCache::objects() const {
+	return table<CachedObject>(header().objects_offset);
+}
+
+std::size_t SceneCache::size() const {
+	return static_cast<std::size_t>(header().object_count);
+}
+
+SphereBatchView SceneCache::batch() const {
+	SphereBatchView v{};
+	for (std::size_t e = 0; e < 12; ++e) {
+		v.rows[e] = table<float>(header().rows_offset[e]);
+	}
+	v.ids = table<std::int32_t>(header().ids_offset);
+	v.count = size();
+	return v;
+}
+
+std::string SceneCache::output() const {
+	return std::string(table<char>(header().output_offset), static_cast<std::size_t>(header().output_length));
+}
+
+void SceneCache::copy_objects(Scene& scene) const {
+	scene.reserve(scene.objects.size() + size());
+	// Keeps later ids from colliding with the cached ones
+	scene.registry.allocate_range(static_cast<int>(size()));
+	for (std::size_t i = 0; i < size(); ++i) {
+		scene.objects.push_back(cached_sphere(objects()[i]));
+		scene.batch.add(scene.objects.back());
+	}
+}
+
+CameraSettings SceneCache::camera() const {
+	const SceneCacheHeader& h = header();
+	CameraSettings c;
+	c.field_of_view = h.field_of_view;
+	c.from = point(h.from[0], h.from[1], h.from[2]);
+	c.to = point(h.to[0], h.to[1], h.to[2]);
+	c.up = vector(h.up[0], h.up[1], h.up[2]);
+	return c;
+}
+
+static std::uint64_t align_up(std::uint64_t offset) {
+	return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+// Written to a temporary file and renamed over `path`, so readers never map a
+// half-written cache. Throws SceneError with line 0 when the file can't be written.
+void write_scene_cache(const std::string& path, const Scene& scene, std::uint64_t source_hash) {
+	static_assert(sizeof(int) == sizeof(std::int32_t), "SphereBatch ids are written as int32");
+	std::uint64_t count = scene.objects.size();
+
+	SceneCacheHeader h{};
+	std::memcpy(h.magic, SCENE_CACHE_MAGIC, sizeof(h.magic));
+	h.version = SCENE_CACHE_VERSION;
+	h.object_size = sizeof(CachedObject);
+	h.source_hash = source_hash;
+	h.object_count = count;
+	h.width = scene.width;
+	h.height = scene.height;
+	h.field_of_view = scene.camera.field_of_view;
+	const Tuple* vectors[3] = { &scene.camera.from, &scene.camera.to, &scene.camera.up };
+	float* fields[3] = { h.from, h.to, h.up };
+	for (std::size_t v = 0; v < 3; ++v) {
+		fields[v][0] = vectors[v]->x;
+		fields[v][1] = vectors[v]->y;
+		fields[v][2] = vectors[v]->z;
+	}
+
+	std::uint64_t offset = align_up(sizeof(SceneCacheHeader));
+	h.objects_offset = offset;
+	offset = align_up(offset + count * sizeof(CachedObject));
+	for (std::uint64_t& row : h.rows_offset) {
+		row = offset;
+		offset = align_up(offset + count * sizeof(float));
+	}
+	h.ids_offset = offset;
+	offset = align_up(offset + count * sizeof(std::int32_t));
+	h.output_offset = offset;
+	h.output_length = scene.output.size();
+	h.file_size = offset + h.output_length;
+
+	std::vector<CachedObject> objects(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		const Sphere& s = scene.objects[i];
+		objects[i].id = s.id;
+		objects[i].kind = static_cast<std::int32_t>(s.get_transform().kind);
+		std::memcpy(objects[i].transform, s.get_transform().elements, sizeof(objects[i].transform));
+	}
+
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		if (!file)
+			throw SceneError{ 0, 0, "can't write " + temporary };
+		std::uint64_t written = 0;
+		auto write_at = [&](std::uint64_t at, const void* data, std::uint64_t bytes) {
+			static const char padding[SCENE_CACHE_ALIGNMENT] = {};
+			file.write(padding, static_cast<std::streamsize>(at - written));
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+			written = at + bytes;
+		};
+		write_at(0, &h, sizeof(h));
+		write_at(h.objects_offset, objects.data(), count * sizeof(CachedObject));
+		for (std::size_t e = 0; e < 12; ++e)
+			write_at(h.rows_offset[e], scene.batch.rows[e].data(), count * sizeof(float));
+		write_at(h.ids_offset, scene.batch.ids.data(), count * sizeof(std::int32_t));
+		write_at(h.output_offset, scene.output.data(), h.output_length);
+		file.close();
+		if (!file)
+			throw SceneError{ 0, 0, "can't write " + temporary };
+	}
+	std::error_code failed;
+	std::filesystem::rename(temporary, path, failed);
+	if (failed) {
+		std::filesystem::remove(temporary, failed);
+		throw SceneError{ 0, 0, "can't write " + path };
+	}
+}
+
+// Maps the cache for `scene_path`, first rebuilding it from the scene text if it is
+// missing, stale or from another version. Throws SceneError if the scene is malformed
+// or the cache can't be written.
+std::unique_ptr<SceneCache> load_scene_cached(const std::string& scene_path, const std::string& cache_path) {
+	std::string source = read_scene_file(scene_path);
+	std::uint64_t hash = scene_hash(source);
+
+	auto cache = std::make_unique<SceneCache>(cache_path);
+	if (cache->valid(hash))
+		return cache;
+	cache.reset();
+
+	Scene scene;
+	load_scene(source, scene);
+	write_scene_cache(cache_path, scene, hash);
+	cache = std::make_unique<SceneCache>(cache_path);
+	if (!cache->valid(hash))
+		throw SceneError{ 0, 0, "can't map " + cache_path };
+	return cache;
+}
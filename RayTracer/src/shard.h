@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include "lib.h"
+#include "render.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Renders a frame across worker processes on this machine. The coordinator forks
+// the workers, so each starts with the scene, camera and bins already in memory,
+// and talks to each over a Unix domain socket pair:
+//
+//   coordinator -> worker   uint32 count, uint32 tile[count]    an assignment
+//   worker -> coordinator   uint32 tile, float[3] per pixel     one per finished tile
+//
+// A worker gets its next assignment once every tile of the last one is back, and
+// exits when its socket closes. If a worker dies, or hangs past the assignment
+// timeout and is killed, its unfinished tiles go back in the queue and a
+// replacement is forked.
+//
+// Windows has no fork(), so there the frame is rendered by threads in this process.
+
+struct ShardSettings {
+	unsigned workers = 2;
+	std::size_t tiles_per_assignment = 8;
+	// Replacement workers forked after crashes before giving up
+	unsigned max_restarts = 4;
+	// A worker that hasn't returned every tile of an assignment by then is killed
+	std::chrono::milliseconds assignment_timeout = std::chrono::minutes(10);
+};
+
+struct ShardStats {
+	std::size_t assignments = 0;
+	std::size_t worker_crashes = 0;
+	std::size_t tiles_reassigned = 0;
+	// Of the crashes, workers killed for running past the assignment timeout
+	std::size_t worker_timeouts = 0;
+};
+
+struct ShardError {
+	std::string message;
+};
+
+#ifndef _WIN32
+
+bool write_all(int fd, const void* data, std::size_t bytes) {
+	const char* p = static_cast<const char*>(data);
+	while (bytes > 0) {
+		ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		bytes -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+// False on end of stream or error, including a stream that ends mid-message
+bool read_all(int fd, void* data, std::size_t bytes) {
+	char* p = static_cast<char*>(data);
+	while (bytes > 0) {
+		ssize_t n = read(fd, p, bytes);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		bytes -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+// The worker side: renders assignments into its copy-on-write copy of the canvas
+// and streams each tile back. Never returns.
+template<class Shade>
+[[noreturn]] void shard_worker(int fd, const Camera& camera, const TileBins& bins, Canvas& canvas, Shade& shade, RenderSettings settings) {
+	// A pool's threads don't survive fork()
+	settings.threads = 1;
+	settings.pool = nullptr;
+	std::vector<std::uint32_t> tiles;
+	std::vector<float> pixels;
+	for (std::uint32_t count; read_all(fd, &count, sizeof(count));) {
+		tiles.resize(count);
+		if (!read_all(fd, tiles.data(), count * sizeof(std::uint32_t)))
+			break;
+		for (std::uint32_t t : tiles) {
+			render_tile(camera, bins, t, canvas, shade, settings);
+			PixelRect r = bins.grid.tile(t);
+			pixels.clear();
+			for (std::size_t y = r.y0; y < r.y1; ++y) {
+				for (std::size_t x = r.x0; x < r.x1; ++x) {
+					Color c = canvas.read_pixel(x, y);
+					pixels.insert(pixels.end(), { c.x, c.y, c.z });
+				}
+			}
+			if (!write_all(fd, &t, sizeof(t)) || !write_all(fd, pixels.data(), pixels.size() * sizeof(float)))
+				_exit(1);
+		}
+	}
+	_exit(0);
+}
+
+struct ShardWorker {
+	pid_t pid;
+	int fd;
+	std::vector<std::uint32_t> outstanding;
+	// When the outstanding tiles are due
+	std::chrono::steady_clock::time_point deadline;
+};
+
+// render() across worker processes. shade runs in the workers, and a worker whose
+// shade throws dies like any other crash. Throws ShardError when workers keep dying
+// after max_restarts replacements.
+template<class Shade>
+ShardStats render_sharded(const Camera& camera, const TileBins& bins, Canvas& canvas, Shade&& shade,
+	const RenderSettings& settings, const ShardSettings& shards) {
+	ShardStats stats;
+	std::deque<std::uint32_t> pending;
+	// Along the Hilbert curve, so an assignment is a compact patch of the frame
+	for (std::size_t t : hilbert_tiles(bins.grid))
+		pending.push_back(static_cast<std::uint32_t>(t));
+	std::size_t remaining = pending.size();
+	std::vector<ShardWorker> workers;
+	unsigned restarts = 0;
+
+	auto spawn = [&]() {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			throw ShardError{ "socketpair failed" };
+		pid_t pid = fork();
+		if (pid < 0) {
+			close(fds[0]);
+			close(fds[1]);
+			throw ShardError{ "fork failed" };
+		}
+		if (pid == 0) {
+			// Nothing may unwind out of the child into the coordinator's code
+			try {
+				close(fds[0]);
+				for (const ShardWorker& w : workers)
+					close(w.fd);
+				shard_worker(fds[1], camera, bins, canvas, shade, settings);
+			}
+			catch (...) {
+				_exit(1);
+			}
+		}
+		close(fds[1]);
+		workers.push_back(ShardWorker{ pid, fds[0], {}, {} });
+	};
+	auto retire = [&](std::size_t i) {
+		close(workers[i].fd);
+		waitpid(workers[i].pid, nullptr, 0);
+		workers.erase(workers.begin() + i);
+	};
+	// Sends the next assignment, or closes the socket when there's nothing left
+	auto assign = [&](ShardWorker& w) {
+		std::uint32_t count = static_cast<std::uint32_t>(std::min(shards.tiles_per_assignment, pending.size()));
+		if (count == 0) {
+			shutdown(w.fd, SHUT_WR);
+			return;
+		}
+		w.outstanding.assign(pending.begin(), pending.begin() + count);
+		pending.erase(pending.begin(), pending.begin() + count);
+		w.deadline = std::chrono::steady_clock::now() + shards.assignment_timeout;
+		++stats.assignments;
+		if (write_all(w.fd, &count, sizeof(count)))
+			write_all(w.fd, w.outstanding.data(), count * sizeof(std::uint32_t));
+	};
+	// Its tiles go back to the front of the queue for a replacement
+	auto crashed = [&](std::size_t i) {
+		++stats.worker_crashes;
+		stats.tiles_reassigned += workers[i].outstanding.size();
+		pending.insert(pending.begin(), workers[i].outstanding.begin(), workers[i].outstanding.end());
+		kill(workers[i].pid, SIGKILL);
+		retire(i);
+		if (restarts++ >= shards.max_restarts)
+			throw ShardError{ "workers keep crashing" };
+		spawn();
+		assign(workers.back());
+	};
+
+	try {
+		for (unsigned i = 0; i < std::max(1u, shards.workers) && !pending.empty(); ++i) {
+			spawn();
+			assign(workers.back());
+		}
+
+		std::vector<float> pixels;
+		std::vector<pollfd> polled;
+		while (remaining > 0) {
+			polled.clear();
+			// Wake up for the first deadline of a worker with tiles outstanding
+			auto now = std::chrono::steady_clock::now();
+			int timeout = -1;
+			for (const ShardWorker& w : workers) {
+				polled.push_back(pollfd{ w.fd, POLLIN, 0 });
+				if (w.outstanding.empty())
+					continue;
+				long long left = w.deadline <= now ? 0 : std::chrono::ceil<std::chrono::milliseconds>(w.deadline - now).count();
+				int wait = static_cast<int>(std::min<long long>(left, std::numeric_limits<int>::max()));
+				timeout = timeout < 0 ? wait : std::min(timeout, wait);
+			}
+			if (poll(polled.data(), polled.size(), timeout) < 0) {
+				if (errno == EINTR)
+					continue;
+				throw ShardError{ "poll failed" };
+			}
+			// Back to front: replacements are appended, so the workers still to check keep their index
+			for (std::size_t i = polled.size(); i-- > 0;) {
+				if (polled[i].revents == 0)
+					continue;
+				ShardWorker& w = workers[i];
+				std::uint32_t tile;
+				bool received = read_all(w.fd, &tile, sizeof(tile));
+				if (!received && w.outstanding.empty()) {
+					// Finished and exited after its socket was closed
+					retire(i);
+					continue;
+				}
+				// A failed assign() shows up here too, as a dead worker with tiles outstanding
+				auto slot = received ? std::find(w.outstanding.begin(), w.outstanding.end(), tile) : w.outstanding.end();
+				if (slot == w.outstanding.end()) {
+					crashed(i);
+					continue;
+				}
+				PixelRect r = bins.grid.tile(tile);
+				pixels.resize(3 * (r.x1 - r.x0) * (r.y1 - r.y0));
+				if (!read_all(w.fd, pixels.data(), pixels.size() * sizeof(float))) {
+					crashed(i);
+					continue;
+				}
+				const float* p = pixels.data();
+				for (std::size_t y = r.y0; y < r.y1; ++y) {
+					for (std::size_t x = r.x0; x < r.x1; ++x, p += 3)
+						canvas.write_pixel(x, y, color(p[0], p[1], p[2]));
+				}
+				w.outstanding.erase(slot);
+				--remaining;
+				if (w.outstanding.empty())
+					assign(w);
+			}
+			// Hung workers are killed; replacements are appended with deadlines still ahead
+			now = std::chrono::steady_clock::now();
+			for (std::size_t i = workers.size(); i-- > 0;) {
+				if (!workers[i].outstanding.empty() && workers[i].deadline <= now) {
+					++stats.worker_timeouts;
+					crashed(i);
+				}
+			}
+		}
+	}
+	catch (...) {
+		for (ShardWorker& w : workers) {
+			kill(w.pid, SIGKILL);
+			close(w.fd);
+			waitpid(w.pid, nullptr, 0);
+		}
+		throw;
+	}
+	while (!workers.empty())
+		retire(workers.size() - 1);
+	return stats;
+}
+
+#else
+
+template<class Shade>
+ShardStats render_sharded(const Camera& camera, const TileBins& bins, Canvas& canvas, Shade&& shade,
+	const RenderSettings& settings, const ShardSettings& shards) {
+	RenderSettings threaded = settings;
+	threaded.threads = std::max(settings.threads, shards.workers);
+	render(camera, bins, canvas, shade, threaded);
+	return ShardStats{};
+}
+
+#endif
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include "lib.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Spheres laid out as structure-of-arrays for the batched kernel: one array per element
+// of the 3x4 inverse transform, so one load fetches the same element for 8 spheres.
+// Element (r, c) of sphere i is rows[r * 4 + c][i].
+struct SphereBatchView {
+	const float* rows[12];
+	const int* ids;
+	std::size_t count;
+};
+
+struct SphereBatch {
+	std::vector<float> rows[12];
+	std::vector<int> ids;
+
+	void add(const Sphere& s);
+	// Overwrites the sphere at `index`, e.g. after its transform changed
+	void set(std::size_t index, const Sphere& s);
+	void reserve(std::size_t count);
+	std::size_t size() const;
+	SphereBatchView view() const;
+};
+
+// The nearest positive hit of a ray within a range of a batch
+struct BatchHit {
+	static constexpr std::size_t NONE = std::numeric_limits<std::size_t>::max();
+
+	std::size_t index; // index into the batch, or NONE
+	float t;
+
+	bool hit() const {
+		return index != NONE;
+	}
+};
+
+void SphereBatch::add(const Sphere& s) {
+	for (std::size_t e = 0; e < 12; ++e) {
+		rows[e].push_back(s.inverse_transform[e / 4][e % 4]);
+	}
+	ids.push_back(s.id);
+}
+
+void SphereBatch::set(std::size_t index, const Sphere& s) {
+	for (std::size_t e = 0; e < 12; ++e) {
+		rows[e][index] = s.inverse_transform[e / 4][e % 4];
+	}
+	ids[index] = s.id;
+}
+
+void SphereBatch::reserve(std::size_t count) {
+	for (auto& row : rows)
+		row.reserve(count);
+	ids.reserve(count);
+}
+
+std::size_t SphereBatch::size() const {
+	return ids.size();
+}
+
+SphereBatchView SphereBatch::view() const {
+	SphereBatchView v{};
+	for (std::size_t e = 0; e < 12; ++e) {
+		v.rows[e] = rows[e].data();
+	}
+	v.ids = ids.data();
+	v.count = size();
+	return v;
+}
+
+// Same quadratic as intersect(), against the unit sphere in object space. Returns the
+// smallest positive root, or infinity.
+float nearest_root(const SphereBatchView& batch, std::size_t i, const Ray& ray) {
+	const float* const* m = batch.rows;
+	float ox = m[0][i] * ray.origin.x + m[1][i] * ray.origin.y + m[2][i] * ray.origin.z + m[3][i];
+	float oy = m[4][i] * ray.origin.x + m[5][i] * ray.origin.y + m[6][i] * ray.origin.z + m[7][i];
+	float oz = m[8][i] * ray.origin.x + m[9][i] * ray.origin.y + m[10][i] * ray.origin.z + m[11][i];
+	float dx = m[0][i] * ray.direction.x + m[1][i] * ray.direction.y + m[2][i] * ray.direction.z;
+	float dy = m[4][i] * ray.direction.x + m[5][i] * ray.direction.y + m[6][i] * ray.direction.z;
+	float dz = m[8][i] * ray.direction.x + m[9][i] * ray.direction.y + m[10][i] * ray.direction.z;
+	float a = dx * dx + dy * dy + dz * dz;
+	float half_b = dx * ox + dy * oy + dz * oz;
+	float c = ox * ox + oy * oy + oz * oz - 1.f;
+	float discriminant = half_b * half_b - a * c;
+	float inf = std::numeric_limits<float>::infinity();
+	if (discriminant < 0)
+		return inf;
+	float q = -(half_b + std::copysign(std::sqrt(discriminant), half_b));
+	float t0 = std::min(q / a, c / q);
+	float t1 = std::max(q / a, c / q);
+	return t0 > 0 ? t0 : (t1 > 0 ? t1 : inf);
+}
+
+#if defined(__AVX2__)
+
+// 8 spheres per iteration. Lanes that miss keep +inf, so the running minimum needs no
+// branches; the index of the best lane is carried alongside it in an integer register.
+BatchHit intersect_nearest_avx2(const SphereBatchView& batch, const Ray& ray, std::size_t begin, std::size_t end) {
+	const float* const* m = batch.rows;
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+	const __m256 sign = _mm256_set1_ps(-0.f);
+
+	__m256 best_t = inf;
+	__m256i best_index = _mm256_set1_epi32(-1);
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	index = _mm256_add_epi32(index, _mm256_set1_epi32(static_cast<int>(begin)));
+	const __m256i step = _mm256_set1_epi32(8);
+
+	std::size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 e[12];
+		for (std::size_t k = 0; k < 12; ++k)
+			e[k] = _mm256_loadu_ps(m[k] + i);
+
+		__m256 tox = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[0], ox), _mm256_mul_ps(e[1], oy)), _mm256_add_ps(_mm256_mul_ps(e[2], oz), e[3]));
+		__m256 toy = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[4], ox), _mm256_mul_ps(e[5], oy)), _mm256_add_ps(_mm256_mul_ps(e[6], oz), e[7]));
+		__m256 toz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[8], ox), _mm256_mul_ps(e[9], oy)), _mm256_add_ps(_mm256_mul_ps(e[10], oz), e[11]));
+		__m256 tdx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[0], dx), _mm256_mul_ps(e[1], dy)), _mm256_mul_ps(e[2], dz));
+		__m256 tdy = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[4], dx), _mm256_mul_ps(e[5], dy)), _mm256_mul_ps(e[6], dz));
+		__m256 tdz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[8], dx), _mm256_mul_ps(e[9], dy)), _mm256_mul_ps(e[10], dz));
+
+		__m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tdx, tdx), _mm256_mul_ps(tdy, tdy)), _mm256_mul_ps(tdz, tdz));
+		__m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tdx, tox), _mm256_mul_ps(tdy, toy)), _mm256_mul_ps(tdz, toz));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tox, tox), _mm256_mul_ps(toy, toy)), _mm256_mul_ps(toz, toz)), one);
+		__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+		__m256 hit = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+
+		// q = -(half_b + copysign(sqrt(discriminant), half_b))
+		__m256 root = _mm256_or_ps(_mm256_sqrt_ps(_mm256_max_ps(discriminant, zero)), _mm256_and_ps(half_b, sign));
+		__m256 q = _mm256_xor_ps(_mm256_add_ps(half_b, root), sign);
+		__m256 r0 = _mm256_div_ps(q, a);
+		__m256 r1 = _mm256_div_ps(c, q);
+		__m256 t0 = _mm256_min_ps(r0, r1);
+		__m256 t1 = _mm256_max_ps(r0, r1);
+		__m256 t = _mm256_blendv_ps(inf, t1, _mm256_cmp_ps(t1, zero, _CMP_GT_OQ));
+		t = _mm256_blendv_ps(t, t0, _mm256_cmp_ps(t0, zero, _CMP_GT_OQ));
+		t = _mm256_blendv_ps(inf, t, hit);
+
+		__m256 closer = _mm256_cmp_ps(t, best_t, _CMP_LT_OQ);
+		best_t = _mm256_blendv_ps(best_t, t, closer);
+		best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index), _mm256_castsi256_ps(index), closer));
+		index = _mm256_add_epi32(index, step);
+	}
+
+	alignas(32) float lane_t[8];
+	alignas(32) std::int32_t lane_index[8];
+	_mm256_store_ps(lane_t, best_t);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lane_index), best_index);
+	BatchHit result{ BatchHit::NONE, std::numeric_limits<float>::infinity() };
+	for (std::size_t lane = 0; lane < 8; ++lane) {
+		if (lane_index[lane] < 0) continue;
+		std::size_t candidate = static_cast<std::size_t>(lane_index[lane]);
+		if (lane_t[lane] < result.t || (lane_t[lane] == result.t && candidate < result.index))
+			result = BatchHit{ candidate, lane_t[lane] };
+	}
+
+	for (; i < end; ++i) {
+		float t = nearest_root(batch, i, ray);
+		if (t < result.t)
+			result = BatchHit{ i, t };
+	}
+	return result;
+}
+
+#endif
+
+// The nearest positive intersection of `ray` with spheres [begin, end) of the batch.
+// Matches running intersect() and hit() over the same spheres, and ties go to the
+// lower index.
+BatchHit intersect_nearest(const SphereBatchView& batch, const Ray& ray, std::size_t begin, std::size_t end) {
+#if defined(__AVX2__)
+	return intersect_nearest_avx2(batch, ray, begin, end);
+#else
+	BatchHit result{ BatchHit::NONE, std::numeric_limits<float>::infinity() };
+	for (std::size_t i = begin; i < end; ++i) {
+		float t = nearest_root(batch, i, ray);
+		if (t < result.t)
+			result = BatchHit{ i, t };
+	}
+	return result;
+#endif
+}
+
+BatchHit intersect_nearest(const SphereBatchView& batch, const Ray& ray) {
+	return intersect_nearest(batch, ray, 0, batch.count);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that live as long as the pool, so a sequence of frames doesn't pay
+// for creating and joining threads every frame.
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned threads);
+	// Finishes the queued tasks, then joins the workers
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned size() const;
+	// Runs work(i) for every i in [0, count) on the workers and the calling thread,
+	// and returns once all of them have finished. If work throws, the indices not yet
+	// started are skipped and the first exception is rethrown once every thread has
+	// stopped. Must not be called from a task.
+	void parallel_for(std::size_t count, const std::function<void(std::size_t)>& work);
+	std::future<void> submit(std::function<void()> task);
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::packaged_task<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void run();
+};
+
+ThreadPool::ThreadPool(unsigned threads) {
+	for (unsigned t = 0; t < threads; ++t)
+		workers.emplace_back(&ThreadPool::run, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& w : workers)
+		w.join();
+}
+
+unsigned ThreadPool::size() const {
+	return static_cast<unsigned>(workers.size());
+}
+
+void ThreadPool::run() {
+	for (;;) {
+		std::packaged_task<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+	std::packaged_task<void()> packaged(std::move(task));
+	std::future<void> done = packaged.get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(packaged));
+	}
+	wake.notify_one();
+	return done;
+}
+
+void ThreadPool::parallel_for(std::size_t count, const std::function<void(std::size_t)>& work) {
+	std::atomic<std::size_t> next{ 0 };
+	auto drain = [&]() {
+		try {
+			for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+				work(i);
+		}
+		catch (...) {
+			next = count;
+			throw;
+		}
+	};
+	std::vector<std::future<void>> helpers;
+	std::exception_ptr failure;
+	try {
+		for (std::size_t h = 0; h < workers.size() && h + 1 < count; ++h)
+			helpers.push_back(submit(drain));
+		drain();
+	}
+	catch (...) {
+		failure = std::current_exception();
+	}
+	// The helpers use this frame's state, so every one has to finish before it unwinds
+	for (std::future<void>& h : helpers) {
+		try {
+			h.get();
+		}
+		catch (...) {
+			if (!failure)
+				failure = std::current_exception();
+		}
+	}
+	if (failure)
+		std::rethrow_exception(failure);
+}
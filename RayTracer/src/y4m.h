@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "lib.h"
+#include "render.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// YUV4MPEG2 output, for piping frames into a video encoder instead of writing a file
+// per frame:
+//
+//   RayTracer scene --frames 240 --y4m - | ffmpeg -i - animation.mp4
+//
+// Pixels are clamped to [0, 1] and converted to 8-bit BT.601 studio range YUV. Chroma
+// is 4:2:0 with each sample the mean of a 2x2 block (C420jpeg); at an odd edge the
+// block is the pixels that exist.
+
+struct Y4MError {
+	std::string message;
+};
+
+// BT.601 for R, G and B in [0, 1], scaled to studio range
+constexpr float Y4M_Y[3] = { 65.481f, 128.553f, 24.966f };
+constexpr float Y4M_CB[3] = { -37.797f, -74.203f, 112.f };
+constexpr float Y4M_CR[3] = { 112.f, -93.786f, -18.214f };
+
+// Converts rows `top` and `bottom` (the same row for the last row of an odd height)
+// to two rows of luma and one of each chroma plane
+void yuv420_rows(const Tuple* top, const Tuple* bottom, std::size_t width,
+	std::uint8_t* y_top, std::uint8_t* y_bottom, std::uint8_t* u, std::uint8_t* v) {
+	std::size_t x = 0;
+#if defined(__AVX2__)
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+	// Offsets include the 0.5 that makes truncation round, as in the scalar loop
+	const __m256 y_offset = _mm256_set1_ps(16.5f);
+	const __m128 c_offset = _mm_set1_ps(128.5f), quarter = _mm_set1_ps(0.25f);
+	// 8 pixels as R, G and B vectors, even pixels in the low half and odd in the high
+	auto load = [&](const Tuple* p, __m256& r, __m256& g, __m256& b) {
+		const float* f = reinterpret_cast<const float*>(p);
+		__m256 p01 = _mm256_loadu_ps(f), p23 = _mm256_loadu_ps(f + 8);
+		__m256 p45 = _mm256_loadu_ps(f + 16), p67 = _mm256_loadu_ps(f + 24);
+		__m256 xy0 = _mm256_unpacklo_ps(p01, p23), zw0 = _mm256_unpackhi_ps(p01, p23);
+		__m256 xy1 = _mm256_unpacklo_ps(p45, p67), zw1 = _mm256_unpackhi_ps(p45, p67);
+		r = _mm256_min_ps(_mm256_max_ps(_mm256_shuffle_ps(xy0, xy1, 0x44), zero), one);
+		g = _mm256_min_ps(_mm256_max_ps(_mm256_shuffle_ps(xy0, xy1, 0xEE), zero), one);
+		b = _mm256_min_ps(_mm256_max_ps(_mm256_shuffle_ps(zw0, zw1, 0x44), zero), one);
+	};
+	// Back to pixel order, then 8 bytes
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	auto store_luma = [&](__m256 r, __m256 g, __m256 b, std::uint8_t* out) {
+		__m256 luma = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(Y4M_Y[0])), _mm256_mul_ps(g, _mm256_set1_ps(Y4M_Y[1]))),
+			_mm256_add_ps(_mm256_mul_ps(b, _mm256_set1_ps(Y4M_Y[2])), y_offset));
+		__m256i words = _mm256_permutevar8x32_epi32(_mm256_cvttps_epi32(luma), order);
+		__m128i packed = _mm_packus_epi16(_mm_packus_epi32(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)), _mm_setzero_si128());
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+	};
+	auto store_chroma = [&](__m128 r, __m128 g, __m128 b, const float (&k)[3], std::uint8_t* out) {
+		__m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(k[0])), _mm_mul_ps(g, _mm_set1_ps(k[1]))),
+			_mm_add_ps(_mm_mul_ps(b, _mm_set1_ps(k[2])), c_offset));
+		__m128i words = _mm_cvttps_epi32(c);
+		int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(words, words), _mm_setzero_si128()));
+		std::memcpy(out, &bytes, 4);
+	};
+	// The mean of each 2x2 block: rows added, then the even and odd halves
+	auto blocks = [&](__m256 t, __m256 b) {
+		__m256 rows = _mm256_add_ps(t, b);
+		return _mm_mul_ps(_mm_add_ps(_mm256_castps256_ps128(rows), _mm256_extractf128_ps(rows, 1)), quarter);
+	};
+	for (; x + 8 <= width; x += 8) {
+		__m256 rt, gt, bt, rb, gb, bb;
+		load(top + x, rt, gt, bt);
+		load(bottom + x, rb, gb, bb);
+		store_luma(rt, gt, bt, y_top + x);
+		store_luma(rb, gb, bb, y_bottom + x);
+		__m128 r = blocks(rt, rb), g = blocks(gt, gb), b = blocks(bt, bb);
+		store_chroma(r, g, b, Y4M_CB, u + x / 2);
+		store_chroma(r, g, b, Y4M_CR, v + x / 2);
+	}
+#endif
+	auto clamped = [](const Tuple& p, float (&rgb)[3]) {
+		rgb[0] = std::min(std::max(p.x, 0.f), 1.f);
+		rgb[1] = std::min(std::max(p.y, 0.f), 1.f);
+		rgb[2] = std::min(std::max(p.z, 0.f), 1.f);
+	};
+	auto luma = [](const float (&rgb)[3]) {
+		return static_cast<std::uint8_t>((rgb[0] * Y4M_Y[0] + rgb[1] * Y4M_Y[1]) + (rgb[2] * Y4M_Y[2] + 16.5f));
+	};
+	for (; x < width; x += 2) {
+		std::size_t pair = std::min<std::size_t>(2, width - x);
+		float sum[3] = { 0, 0, 0 };
+		for (std::size_t i = 0; i < pair; ++i) {
+			float t[3], b[3];
+			clamped(top[x + i], t);
+			clamped(bottom[x + i], b);
+			y_top[x + i] = luma(t);
+			y_bottom[x + i] = luma(b);
+			for (std::size_t c = 0; c < 3; ++c)
+				sum[c] += t[c] + b[c];
+		}
+		for (std::size_t c = 0; c < 3; ++c)
+			sum[c] *= pair == 2 ? 0.25f : 0.5f;
+		u[x / 2] = static_cast<std::uint8_t>((sum[0] * Y4M_CB[0] + sum[1] * Y4M_CB[1]) + (sum[2] * Y4M_CB[2] + 128.5f));
+		v[x / 2] = static_cast<std::uint8_t>((sum[0] * Y4M_CR[0] + sum[1] * Y4M_CR[1]) + (sum[2] * Y4M_CR[2] + 128.5f));
+	}
+}
+
+// Writes a YUV4MPEG2 stream. Each frame goes out with a few large writes and is
+// flushed as soon as it is written, so a reader on the other end of a pipe can
+// start encoding it while the next frame renders.
+class Y4MWriter {
+public:
+	// "-" is stdout. Throws Y4MError if the file can't be created.
+	Y4MWriter(const std::string& path, std::size_t width, std::size_t height, unsigned fps = 30);
+	// Closes the file; call close() first to find out whether the writes succeeded
+	~Y4MWriter();
+	Y4MWriter(const Y4MWriter&) = delete;
+	Y4MWriter& operator=(const Y4MWriter&) = delete;
+
+	// Throws Y4MError if the canvas isn't the stream's size or the write fails
+	void write_frame(const Canvas& canvas);
+	// Writes just `region` of the canvas, which must be the stream's size
+	void write_frame(const Canvas& canvas, const PixelRect& region);
+	// Throws Y4MError if any write failed
+	void close();
+	std::size_t frames_written() const;
+private:
+	std::string path;
+	std::FILE* file;
+	const std::size_t width, height;
+	// The planes of one frame: Y, then U, then V
+	std::vector<std::uint8_t> planes;
+	std::vector<Tuple> scratch;
+	std::size_t frames = 0;
+};
+
+Y4MWriter::Y4MWriter(const std::string& path, std::size_t width, std::size_t height, unsigned fps)
+	: path{ path }, width{ width }, height{ height } {
+	if (path == "-") {
+		file = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	else {
+		file = std::fopen(path.c_str(), "wb");
+	}
+	if (!file)
+		throw Y4MError{ "can't create " + path };
+	// Frames are written from `planes` in one piece, so stdio's own buffer only holds headers
+	std::size_t chroma = ((width + 1) / 2) * ((height + 1) / 2);
+	planes.resize(width * height + 2 * chroma);
+	std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height)
+		+ " F" + std::to_string(fps) + ":1 Ip A1:1 C420jpeg\n";
+	std::fwrite(header.data(), 1, header.size(), file);
+}
+
+Y4MWriter::~Y4MWriter() {
+	if (file && file != stdout)
+		std::fclose(file);
+}
+
+void Y4MWriter::write_frame(const Canvas& canvas) {
+	write_frame(canvas, PixelRect{ 0, 0, canvas.width, canvas.height });
+}
+
+void Y4MWriter::write_frame(const Canvas& canvas, const PixelRect& region) {
+	if (region.width() != width || region.height() != height || region.x1 > canvas.width || region.y1 > canvas.height)
+		throw Y4MError{ "frame size doesn't match the stream" };
+	std::size_t chroma_width = (width + 1) / 2;
+	// Room to gather two rows of a canvas that isn't row-major
+	scratch.resize(2 * canvas.width);
+	std::uint8_t* y = planes.data();
+	std::uint8_t* u = y + width * height;
+	std::uint8_t* v = u + chroma_width * ((height + 1) / 2);
+	for (std::size_t row = 0; row < height; row += 2) {
+		std::size_t below = std::min(row + 1, height - 1);
+		const Tuple* top = canvas.row(region.y0 + row, scratch.data()) + region.x0;
+		const Tuple* bottom = canvas.row(region.y0 + below, scratch.data() + canvas.width) + region.x0;
+		yuv420_rows(top, bottom, width, y + row * width, y + below * width, u + row / 2 * chroma_width, v + row / 2 * chroma_width);
+	}
+	static const char frame_header[] = "FRAME\n";
+	std::fwrite(frame_header, 1, sizeof(frame_header) - 1, file);
+	std::fwrite(planes.data(), 1, planes.size(), file);
+	if (std::fflush(file) != 0 || std::ferror(file))
+		throw Y4MError{ "can't write " + path };
+	++frames;
+}
+
+void Y4MWriter::close() {
+	if (!file)
+		return;
+	bool failed = std::fflush(file) != 0 || std::ferror(file);
+	if (file != stdout)
+		failed = std::fclose(file) != 0 || failed;
+	file = nullptr;
+	if (failed)
+		throw Y4MError{ "can't write " + path };
+}
+
+std::size_t Y4MWriter::frames_written() const {
+	return frames;
+}
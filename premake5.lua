@@ -1,8 +1,20 @@
 local target_output = "build/%{cfg.platform}/%{cfg.buildcfg}/bin/%{prj.name}/"
 local object_output = "build/%{cfg.platform}/%{cfg.buildcfg}/bin-int/%{prj.name}/"
 
+-- The AVX2 paths (sphere kernel, Philox, YUV conversion) are picked at compile
+-- time with no runtime check, so binaries built with them need an AVX2 CPU
+newoption {
+	trigger = "avx2",
+	description = "Build the AVX2 paths; the binaries won't start on CPUs without AVX2"
+}
+
 workspace "RayTracerChallenge"
 	configurations {"Debug", "Release"}
+	cppdialect "C++17"
+
+	filter {"options:avx2"}
+		vectorextensions "AVX2"
+	filter {}
 
 project "RayTracer"
 	location "RayTracer"
@@ -49,6 +61,54 @@ project "RayTester"
 	objdir (object_output)
 
 
+project "RayBench"
+	location "RayBench"
+	kind "ConsoleApp"
+	language "C++"
+
+	files
+	{
+		"%{prj.name}/**.h",
+		"%{prj.name}/**.cpp"
+	}
+
+	includedirs
+	{
+		"RayTracer/src/"
+	}
+
+	targetdir (target_output)
+	objdir (object_output)
+
+	-- Numbers from unoptimized builds are meaningless
+	optimize "On"
+	symbols "On"
+
+project "RayMerge"
+	location "RayMerge"
+	kind "ConsoleApp"
+	language "C++"
+
+	files
+	{
+		"%{prj.name}/**.h",
+		"%{prj.name}/**.cpp"
+	}
+
+	includedirs
+	{
+		"RayTracer/src/"
+	}
+
+	targetdir (target_output)
+	objdir (object_output)
+
+	filter {"configurations:Debug"}
+		symbols "On"
+
+	filter {"configurations:Release"}
+		optimize "On"
+
 project "gtest"
 	location "gtest"
 	kind "StaticLib"